@@ -18,9 +18,26 @@
 
 /* Atari disk access */
 
+#define _XOPEN_SOURCE 700 /* For nftw() and open_memstream() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "imd.h"
 
 /* Disks: .ATR file has a 16 byte header, then data:
  *
@@ -139,24 +156,68 @@
  *               sector number in lower two bits.
  *      254      Lower 8 bits of next sector number.
  *      255      Number of data bytes in sector: Usually 253 except for last sector
+ *
+ *  MyDOS large volumes (hard disk partitions, up to 65535 sectors of 128 or 256 bytes):
+ *
+ *     Any image which isn't one of the sizes above.  The number of sectors
+ *     comes from the image size and the sector size from the .ATR header.
+ *
+ *     Boot sectors, VTOC sector and directory sectors: same as DOS 2.0s.
+ *     Sector 720 is an ordinary sector.
+ *
+ *     VTOC: bytes 0..9 as for DOS 2.0s (3..4 is the current number of free
+ *     sectors).  The allocation bitmap has one bit for every sector of the
+ *     volume: it starts at byte 10 of sector 360 and carries on from byte 0
+ *     of sectors 359, 358 and so on, as many as it needs.
+ *
+ *     Directory: same as DOS 2.0s.  Flag bit 4 marks a subdirectory, whose
+ *     start sector is the first of its own 8 directory sectors.
+ *
+ *     Data sectors: same as DOS 2.0s on volumes of up to 1023 sectors.  On
+ *     larger volumes bytes 125..126 are a 16-bit next sector number (high
+ *     byte first) and there is no file number.
+ *
+ *  SpartaDOS (any size up to 65535 sectors of 128 or 256 bytes):
+ *
+ *     Found by the volume information in boot sector 1:
+ *      9..10: First sector map of main directory
+ *     11..12: Total sectors
+ *     13..14: Free sectors
+ *         15: Number of bitmap sectors
+ *     16..17: First bitmap sector
+ *     22..29: Volume name
+ *         31: Sector size: 0x80 for 128, 0x00 for 256
+ *         32: Version: 0x11, 0x20 or 0x21
+ *
+ *     Bitmap: one bit for every sector from 0 up, MSB first, 1 means free,
+ *     in consecutive sectors.
+ *
+ *     Sector map: 0..1 next map sector, 2..3 previous map sector, then the
+ *     data sectors of the file, two bytes each (0 for a hole).  Data sectors
+ *     are all data; the length of the file is in its directory entry.
+ *
+ *     Directory: a file of 23 byte entries.  The first is a header:
+ *       1..2: Sector map of parent directory (0 for main directory)
+ *       3..5: Length of directory in bytes
+ *      6..16: Directory name
+ *
+ *     Directory entry:
+ *          0: flags: 0x01 locked, 0x02 hidden, 0x04 archived, 0x08 in use,
+ *             0x10 deleted, 0x20 subdirectory, 0x80 opened for output.
+ *             0 marks the end of the directory.
+ *       1..2: First sector map
+ *       3..5: Length in bytes
+ *      6..13: Name
+ *     14..16: Extension
+ *     17..19: Date (day, month, year)
+ *     20..22: Time (hours, minutes, seconds)
  */
 
-/* Error status */
-int status = 0;
-
-/* Set if fixes were made */
-int fixes = 0;
-
 /* Sector size in bytes */
 #define SECTOR_SIZE 128
 #define DD_SECTOR_SIZE 256
 
-/* True if disk is double-density */
-int disk_dd = 0;
-int sector_size = SECTOR_SIZE;
-
 /* Largest reachable sector + 1 */
-int disk_size = 720;
 #define SD_DISK_SIZE 720
 #define ED_DISK_SIZE 1024
 #define DD_DISK_SIZE 720
@@ -174,6 +235,8 @@ int disk_size = 720;
 #define FLAG_DELETED 0x80
 #define FLAG_IN_USE 0x40
 #define FLAG_LOCKED 0x20
+#define FLAG_SUBDIR 0x10 /* MyDOS: entry is a subdirectory */
+#define FLAG_NOFILENO 0x04 /* MyDOS: sectors have 16-bit links, no file number */
 #define FLAG_DOS2 0x02
 #define FLAG_OPENED 0x01
 
@@ -196,47 +259,21 @@ struct dirent {
 /* First 125 bytes are used for data */
 #define DATA_SIZE 125
 #define DD_DATA_SIZE 253
-int data_size = DATA_SIZE;
 
 /* Byte 125 has file number in upper 6 bits */
 #define DATA_FILE_NUM 125 /* Upper 6 bits (0..63) */
 #define DD_DATA_FILE_NUM 253
-int data_file_num = DATA_FILE_NUM;
 
 /* Byte 125 and 126 have next sector number: valid values (1..719) or (1..1023) */
 #define DATA_NEXT_HIGH 125 /* Lower 2 bits */
 #define DD_DATA_NEXT_HIGH 253
-int data_next_high = DATA_NEXT_HIGH;
 
 #define DATA_NEXT_LOW 126 /* All 8 bits */
 #define DD_DATA_NEXT_LOW 254 /* All 8 bits */
-int data_next_low = DATA_NEXT_LOW;
 
 /* Byte 127 has number of bytes used */
 #define DATA_BYTES 127
 #define DD_DATA_BYTES 255
-int data_bytes = DATA_BYTES;
-
-void set_density(int dd)
-{
-        if (dd) {
-                sector_size = DD_SECTOR_SIZE;
-                data_size = DD_DATA_SIZE;
-                data_file_num = DD_DATA_FILE_NUM;
-                data_next_high = DD_DATA_NEXT_HIGH;
-                data_next_low = DD_DATA_NEXT_LOW;
-                data_bytes = DD_DATA_BYTES;
-                disk_dd = 1;
-        } else {
-                sector_size = SECTOR_SIZE;
-                data_size = DATA_SIZE;
-                data_file_num = DATA_FILE_NUM;
-                data_next_high = DATA_NEXT_HIGH;
-                data_next_low = DATA_NEXT_LOW;
-                data_bytes = DATA_BYTES;
-                disk_dd = 0;
-        }
-}
 
 /* Bytes within VTOC */
 
@@ -275,1195 +312,4538 @@ void set_density(int dd)
 
 #define VTOC2_NUM_UNUSED 122
 
-FILE *disk;
+/* SpartaDOS volume information in boot sector 1 */
+#define SP_DIR_MAP 9
+#define SP_NUM_SECTS 11
+#define SP_NUM_UNUSED 13
+#define SP_BITMAP_SECTS 15
+#define SP_BITMAP 16
+#define SP_SECTOR_SIZE 31
+#define SP_VERSION 32
+
+/* SpartaDOS directory entry */
+#define SP_FLAG_LOCKED 0x01
+#define SP_FLAG_HIDDEN 0x02
+#define SP_FLAG_IN_USE 0x08
+#define SP_FLAG_DELETED 0x10
+#define SP_FLAG_SUBDIR 0x20
+#define SP_FLAG_OPENED 0x80
+
+struct sp_dirent {
+        unsigned char flag;
+        unsigned char map_lo;
+        unsigned char map_hi;
+        unsigned char len[3];
+        unsigned char name[8];
+        unsigned char suffix[3];
+        unsigned char date[3];
+        unsigned char time[3];
+};
+
+#define SP_ENTRY_SIZE 23
+
+/* SpartaDOS sector map: next and previous map sector, then data sectors */
+#define SP_MAP_NEXT 0
+#define SP_MAP_PREV 2
+#define SP_MAP_DATA 4
 
-int getsect(unsigned char *buf, int sect)
+/* Binary load segment */
+struct segment
 {
-        int offset;
+        int start; /* First address loaded (2E0=RUN, 2E2=INIT) */
         int size;
+        int init; /* INIT address loaded by this segment, or -1 */
+        int run; /* RUN address loaded by this segment, or -1 */
+        long offset; /* Offset of segment data in file */
+};
 
-        if (!sect) {
-                fprintf(stderr,"Oops, tried to read sector 0\n");
-                return -1;
-        }
-        sect -= 1;
+/* File stored internally for nice formatting */
+struct name
+{
+        char *name;
 
-        if (disk_dd) {
-                if (sect < 3) {
-                        size = SECTOR_SIZE;
-                        offset = SECTOR_SIZE * sect;
-                } else {
-                        size = DD_SECTOR_SIZE;
-                        offset = SECTOR_SIZE * 3 + DD_SECTOR_SIZE * (sect - 3);
-                }
-        } else {
-                size = SECTOR_SIZE;
-                offset = SECTOR_SIZE * sect;
-        }
+        /* From directory entry */
+        int locked; /* Set if write-protected */
+        int sector; /* Starting sector of file */
+        int sects; /* Sector count */
 
-        if (fseek(disk, offset + 16, SEEK_SET)) {
-                fprintf(stderr,"Oops, tried to seek past end (sector %d)\n", sect + 1);
-                status = 1;
-                return -1;
-        }
-        if (size != fread((char *)buf, 1, size, disk)) {
-                fprintf(stderr,"Oops, read error (sector %d)\n", sect + 1);
-                status = 1;
-                return -1;
-        }
-        return 0;
-}
+        int is_sys; /* Set if it's a .SYS file */
+        int is_cm; /* Set if it's a .COM file */
+        int is_dir; /* Set if it's a MyDOS subdirectory */
 
-void putsect(unsigned char *buf, int sect)
-{
-        int offset;
+        
+
+        /* From file itself */
+        struct segment *segments;
+        int nsegs;
         int size;
+};
 
-        if (!sect) {
-                fprintf(stderr,"Oops, requested sector 0\n");
-                exit(-1);
-        }
-        sect -= 1;
-        if (disk_dd) {
-                if (sect < 3) {
-                        size = SECTOR_SIZE;
-                        offset = SECTOR_SIZE * sect;
-                } else {
-                        size = DD_SECTOR_SIZE;
-                        offset = SECTOR_SIZE * 3 + DD_SECTOR_SIZE * (sect - 3);
-                }
-        } else {
-                size = SECTOR_SIZE;
-                offset = SECTOR_SIZE * sect;
-        }
+/* Where the boot sectors of a 256 byte sector image are.  Only the first
+ * 128 bytes of each are used. */
+#define LAYOUT_LOGICAL 0 /* 128 bytes each (the usual) */
+#define LAYOUT_PHYSICAL 1 /* 256 bytes each */
+#define LAYOUT_SIO 2 /* 128 bytes each, then 384 bytes of padding */
 
-        if (fseek(disk, offset + 16, SEEK_SET)) {
-                fprintf(stderr,"Oops, seek error during write (sector %d)\n", sect + 1);
-                exit(-1);
-        }
-        if (size != fwrite((char *)buf, 1, size, disk)) {
-                fprintf(stderr,"Oops, write error (sector %d)\n", sect + 1);
-                exit(-1);
+/* Sector cache entry */
+struct cache_ent {
+        unsigned char *data; /* Sector contents, or 0 if not loaded */
+        int dirty; /* Set if sector must be written back */
+};
+
+/* Maximum number of directory entries */
+#define MAX_NAMES ((SECTOR_DIR_SIZE * SECTOR_SIZE) / ENTRY_SIZE)
+
+/* Most entries a SpartaDOS directory can hold */
+#define SP_MAX_NAMES 1423
+
+/* Filesystems */
+#define FS_DOS2 0 /* DOS 2.0s, 2.5 or 2.0d */
+#define FS_MYDOS 1 /* MyDOS hard disk partition or other large volume */
+#define FS_SPARTA 2 /* SpartaDOS */
+
+/* Largest MyDOS volume */
+#define MYDOS_MAX_SECTS 65535
+
+/* Image sources */
+#define SRC_FILE 0 /* Plain image file */
+#define SRC_GZIP 1 /* gzip compressed (.atr.gz, .atz) */
+#define SRC_ZLIB 2 /* zlib compressed */
+#define SRC_ZIP 3 /* Member of a zip archive */
+#define SRC_IMD 4 /* ImageDisk image */
+
+/* Sector allocation policies for put and w */
+#define ALLOC_FIRST 0 /* Lowest free sectors, as DOS does */
+#define ALLOC_CONTIG 1 /* First run of free sectors the file fits in */
+#define ALLOC_SKEW 2 /* Next sector where the head will be after processing */
+
+/* Fix policies */
+#define FIX_ASK 0 /* Prompt for each fix */
+#define FIX_ALL 1 /* Make every fix */
+#define FIX_SAFE 2 /* Only fix counts, open flags and the VTOC header */
+#define FIX_NONE 3 /* Report only */
+
+/* Kinds of finding, for the policy */
+#define FIND_NOFIX 0 /* Can't be fixed */
+#define FIND_SAFE 1 /* Fix only touches counts, flags or the VTOC header */
+#define FIND_UNSAFE 2 /* Fix rewrites file sectors or the bitmap */
+
+/* An open disk image.  All filesystem state lives here, so any number of
+ * images can be open at once, each used by one thread at a time. */
+struct atr_volume {
+        FILE *disk;
+        unsigned char *disk_map; /* Memory mapped or inflated image, or 0 if we use stdio */
+        long disk_map_size; /* Size of image file */
+
+        int disk_src; /* Where image came from: SRC_... */
+        struct imd *imd; /* ImageDisk image, for SRC_IMD */
+
+        int disk_dd; /* True if disk is double-density */
+        int sector_size; /* Sector size in bytes */
+
+        /* Geometry of the image file, from its header (see atr_header()) */
+        int layout; /* LAYOUT_... */
+        int boot_stride; /* Bytes from one boot sector to the next */
+        long data_start; /* Offset of sector 4 */
+        long image_end; /* End of sector data */
+
+        int disk_size; /* Largest reachable sector + 1 */
+        int fs; /* FS_... */
+        int link16; /* Set if sector links are 16 bits and there are no file numbers */
+        int root_sect; /* First sector (or sector map) of main directory */
+        int dir_sect; /* First sector (or sector map) of current directory */
+        int sp_bitmap; /* SpartaDOS: first bitmap sector */
+        int sp_bitmap_sects; /* SpartaDOS: number of bitmap sectors */
+        long found_len; /* SpartaDOS: length of file last found by find_file() */
+
+        /* Offsets of fields within data sectors */
+        int data_size;
+        int data_file_num;
+        int data_next_high;
+        int data_next_low;
+        int data_bytes;
+
+        /* Sector cache, indexed by sector number */
+        struct cache_ent *cache;
+        int cache_size;
+
+        /* I/O counters: sectors actually read from / written to the
+         * image, and getsect() calls satisfied by the cache. */
+        long stat_reads;
+        long stat_writes;
+        long stat_hits;
+
+        int status; /* Error status */
+        int fixes; /* Set if fixes were made */
+        int vtoc_errors; /* Number of VTOC problems found by check */
+        int crosslinks; /* Number of cross-linked sectors found by check */
+        int fix; /* Set to offer fixes in check */
+        int fix_policy; /* FIX_... */
+        int fixes_applied; /* Number of fixes made */
+        FILE *json; /* If set, check writes a JSON record for each finding here */
+        int xlat; /* Text translation for cat, get, x and put: XLAT_... */
+        int alloc_policy; /* ALLOC_... */
+        int alloc_skew; /* Sector slots that pass while the drive processes one, or -1 */
+
+        char *extract_dir; /* Directory for x to extract into, or 0 for current */
+        char *disk_name; /* Image file name, for reports */
+
+        /* Directory read by read_dir() */
+        struct name *names[SP_MAX_NAMES];
+        int name_n;
+
+        /* Messages go here */
+        FILE *out;
+        FILE *err;
+};
+
+void set_density(struct atr_volume *vol, int dd)
+{
+        if (dd) {
+                vol->sector_size = DD_SECTOR_SIZE;
+                vol->data_size = DD_DATA_SIZE;
+                vol->data_file_num = DD_DATA_FILE_NUM;
+                vol->data_next_high = DD_DATA_NEXT_HIGH;
+                vol->data_next_low = DD_DATA_NEXT_LOW;
+                vol->data_bytes = DD_DATA_BYTES;
+                vol->disk_dd = 1;
+        } else {
+                vol->sector_size = SECTOR_SIZE;
+                vol->data_size = DATA_SIZE;
+                vol->data_file_num = DATA_FILE_NUM;
+                vol->data_next_high = DATA_NEXT_HIGH;
+                vol->data_next_low = DATA_NEXT_LOW;
+                vol->data_bytes = DATA_BYTES;
+                vol->disk_dd = 0;
         }
 }
 
-/* Count number of free sectors in a bitmap */
+/* Offset to sector 4 in the image data.  The three boot sectors are always
+ * 128 bytes, even on double density disks, so only sectors after them use
+ * sector_size. */
+#define BOOT_SECTS 3
+#define BOOT_SIZE (BOOT_SECTS * SECTOR_SIZE)
 
-int count_free(unsigned char *bitmap, int len)
+void set_layout(struct atr_volume *vol, int layout)
 {
-        int count = 0;
-        int x;
-        while (len--) {
-                for (x = 1; x != 256; x *= 2) {
-                        if (*bitmap & x)
-                                ++count;
-                }
-                ++bitmap;
-        }
-        return count;
+        vol->layout = layout;
+        vol->boot_stride = (layout == LAYOUT_PHYSICAL ? DD_SECTOR_SIZE : SECTOR_SIZE);
+        vol->data_start = 16 + (layout == LAYOUT_LOGICAL ? BOOT_SIZE : BOOT_SECTS * DD_SECTOR_SIZE);
 }
 
-/* Fix it? */
+/* Allocate a volume with single density defaults */
+
+struct atr_volume *new_volume()
+{
+        struct atr_volume *vol = (struct atr_volume *)calloc(1, sizeof(struct atr_volume));
+        vol->disk_size = SD_DISK_SIZE;
+        vol->root_sect = SECTOR_DIR;
+        vol->dir_sect = SECTOR_DIR;
+        set_density(vol, 0);
+        set_layout(vol, LAYOUT_LOGICAL);
+        vol->alloc_policy = ALLOC_FIRST;
+        vol->alloc_skew = -1;
+        vol->out = stdout;
+        vol->err = stderr;
+        return vol;
+}
 
-int fix;
+/* Find sector in image: returns offset from start of file, sets size */
 
-int fixit()
+long sect_offset(struct atr_volume *vol, int sect, int *size)
 {
-        if (!fix)
-                return 0;
-        for (;;) {
-                char buf[80];
-                printf("Fix it (y,n)? ");
-                fflush(stdout);
-                if (fgets(buf,sizeof(buf),stdin)) {
-                        if (buf[0] == 'y' || buf[0] == 'Y')
-                                return 1;
-                        else if (buf[0] == 'n' || buf[0] == 'N')
-                                return 0;
-                }
+        if (sect <= BOOT_SECTS) {
+                *size = SECTOR_SIZE;
+                return 16 + vol->boot_stride * (long)(sect - 1);
         }
+        *size = vol->sector_size;
+        return vol->data_start + vol->sector_size * (long)(sect - BOOT_SECTS - 1);
 }
 
-/* Get allocation bitmap */
+/* Number of whole sectors in image */
 
-void getmap(unsigned char *bitmap, int check)
+int image_sects(struct atr_volume *vol)
 {
-        unsigned char vtoc[DD_SECTOR_SIZE];
-        unsigned char vtoc2[DD_SECTOR_SIZE];
-        int upd = 0;
-
-        if (getsect(vtoc, SECTOR_VTOC)) {
-                fprintf(stderr," (trying to read VTOC)\n");
-                exit(-1);
-        }
-        memcpy(bitmap, vtoc + VTOC_BITMAP, SD_BITMAP_SIZE);
+        int size;
+        long end = (vol->image_end ? vol->image_end : vol->disk_map_size);
+        long n;
+        if (sect_offset(vol, BOOT_SECTS + 1, &size) > end)
+                for (n = 0; n != BOOT_SECTS && sect_offset(vol, n + 1, &size) + size <= end; ++n);
+        else
+                n = BOOT_SECTS + (end - sect_offset(vol, BOOT_SECTS + 1, &size)) / size;
+        return n;
+}
 
-        if (check) {
-                int count = count_free(bitmap, SD_BITMAP_SIZE);
-                int vtoc_count = vtoc[VTOC_NUM_UNUSED] + (256 * vtoc[VTOC_NUM_UNUSED + 1]);
-                int vtoc_total = vtoc[VTOC_NUM_SECTS] + (256 * vtoc[VTOC_NUM_SECTS + 1]);
-                int expected_size;
-                printf("  Checking that VTOC current free sector count matches bitmap...\n");
-                if (count != vtoc_count) {
-                        fprintf(stderr,"    ** It doesn't match: bitmap has %d free, but VTOC count is %d\n", count, vtoc_count);
-                        status = 1;
-                        if (fixit()) {
-                                vtoc[VTOC_NUM_UNUSED] = (0xFF & count);
-                                vtoc[VTOC_NUM_UNUSED + 1] = (0xFF & (count >> 8));
-                                upd = 1;
-                        }
-                } else {
-                        printf("    It's OK (count is %d)\n", count);
-                }
-                if (disk_size == ED_DISK_SIZE)
-                        expected_size = 1010; /* 1011 if we don't pre-allocate 720 */
-                else
-                        expected_size = 707;
-                printf("  Checking that VTOC initial free sector count is %d...\n", expected_size);
-                if (vtoc_total != expected_size) {
-                        fprintf(stderr,"    ** It's wrong, we found: %d\n", vtoc_total);
-                        status = 1;
-                        if (fixit()) {
-                                vtoc[VTOC_NUM_SECTS] = (0xFF & expected_size);
-                                vtoc[VTOC_NUM_SECTS + 1] = (0xFF & (expected_size >> 8));
-                                upd = 1;
-                        }
-                } else
-                        printf("    It's OK\n");
-                printf("  Checking that VTOC type code is 2...\n");
-                if (vtoc[VTOC_TYPE] == 2)
-                        printf("    It's OK\n");
-                else {
-                        fprintf(stderr, "    ** It's wrong, we found: %d\n", vtoc[VTOC_TYPE]);
-                        status = 1;
-                        if (fixit()) {
-                                vtoc[VTOC_TYPE] = 2;
-                                upd = 1;
-                        }
-                }
-                if (upd) {
-                        printf("Saving VTOC1 fixes...\n");
-                        putsect(vtoc, SECTOR_VTOC);
-                        printf("  done.\n");
-                        upd = 0;
-                        fixes = 1;
-                }
-        }
+/* True if name ends with .atr (any case) */
 
-        if (disk_size == ED_DISK_SIZE) {
-                if (getsect(vtoc2, SECTOR_VTOC2)) {
-                        printf(" (trying to read VTOC2)\n");
-                        exit(-1);
-                }
-                memcpy(
-                        bitmap + SD_BITMAP_SIZE,
-                        vtoc2 + (SD_BITMAP_SIZE - ED_BITMAP_START),
-                        ED_BITMAP_SIZE - SD_BITMAP_SIZE
-                );
-                if (check) {
-                        int count = count_free(bitmap + SD_BITMAP_SIZE, ED_BITMAP_SIZE - SD_BITMAP_SIZE);
-                        int vtoc2_count = vtoc2[VTOC2_NUM_UNUSED] + 256 * vtoc2[VTOC2_NUM_UNUSED + 1];
-                        printf("  Checking that VTOC2 current free sector count matches bitmap...\n");
-                        if (count != vtoc2_count) {
-                                fprintf(stderr,"    ** It doesn't match: bitmap has %d free, but VTOC2 count is %d\n", count, vtoc2_count);
-                                status = 1;
-                                if (fixit()) {
-                                        vtoc2[VTOC2_NUM_UNUSED] = (count & 0xFF);
-                                        vtoc2[VTOC2_NUM_UNUSED + 1] = (0xFF & (count >> 8));
-                                        upd = 1;
-                                }
-                        } else {
-                                printf("    It's OK (count is %d)\n", count);
-                        }
-                        if (upd) {
-                                printf("Saving VTOC2 fixes...\n");
-                                putsect(vtoc2, SECTOR_VTOC2);
-                                printf("  done.\n");
-                                upd = 0;
-                                fixes = 1;
-                        }
-                }
-        }
+int is_atr_name(const char *name)
+{
+        int len = strlen(name);
+        return len > 4 && !strcasecmp(name + len - 4, ".atr");
 }
 
-/* Write back allocation bitmap */
+/* True if name ends with .imd (any case) */
 
-void putmap(unsigned char *bitmap)
+int is_imd_name(const char *name)
 {
-        unsigned char vtoc[DD_SECTOR_SIZE];
-        int count;
-        unsigned char vtoc2[DD_SECTOR_SIZE];
+        int len = strlen(name);
+        return len > 4 && !strcasecmp(name + len - 4, ".imd");
+}
 
-        if (getsect(vtoc, SECTOR_VTOC)) {
-                fprintf(stderr," (trying to read VTOC)\n");
-                exit(-1);
-        }
-        memcpy(vtoc + VTOC_BITMAP, bitmap, SD_BITMAP_SIZE);
+/* True if name looks like an image we can open: .atr, .atr.gz, .atz, .zip or .imd */
 
-        /* Update free count */
-        count = count_free(bitmap, SD_BITMAP_SIZE);
-        vtoc[VTOC_NUM_UNUSED] = count;
-        vtoc[VTOC_NUM_UNUSED + 1] = (count >> 8);
+int is_image_name(const char *name)
+{
+        int len = strlen(name);
+        return is_atr_name(name) || (len > 7 && !strcasecmp(name + len - 7, ".atr.gz")) ||
+               (len > 4 && (!strcasecmp(name + len - 4, ".atz") || !strcasecmp(name + len - 4, ".zip"))) ||
+               is_imd_name(name);
+}
 
-        putsect(vtoc, SECTOR_VTOC);
+/* Image sources.  Plain images are memory mapped, or read and written with
+ * stdio if that fails.  Compressed images (gzip, which includes .atz, or a
+ * bare zlib stream) are inflated into memory as they are opened, so sector
+ * access is the same as for a mapped image.  If anything was written, the
+ * image is deflated back to the file when it is closed.  An image in a zip
+ * archive (archive.zip for its first .atr, or archive.zip:member) is read
+ * only.  ImageDisk images are indexed where they are by read_imd(), and
+ * sectors are read and written through the index (see imd_read()). */
 
-        if (disk_size == ED_DISK_SIZE) {
-                if (getsect(vtoc2, SECTOR_VTOC2)) {
-                        fprintf(stderr," (trying to read VTOC2)\n");
-                        exit(-1);
-                }
-                memcpy(vtoc2, bitmap + ED_BITMAP_START, ED_BITMAP_SIZE - ED_BITMAP_START);
+#define ZIP_EOCD 0x06054b50 /* End of central directory signature */
+#define ZIP_CENTRAL 0x02014b50 /* Central directory entry signature */
+#define ZIP_LOCAL 0x04034b50 /* Local file header signature */
 
-                /* Update free count */
-                count = count_free(bitmap + SD_BITMAP_SIZE, ED_BITMAP_SIZE - SD_BITMAP_SIZE);
-                vtoc2[VTOC2_NUM_UNUSED] = count;
-                vtoc2[VTOC2_NUM_UNUSED + 1] = (count >> 8);
+#define SRC_CHUNK 65536 /* Compressed bytes read or written at a time */
 
-                putsect(vtoc2, SECTOR_VTOC2);
-        }
+unsigned int get16(unsigned char *p)
+{
+        return p[0] + (p[1] << 8);
 }
 
-/* Segment list */
-struct segment
+unsigned long get32(unsigned char *p)
 {
-        struct segment *next;
-        int start; /* 2E0=RUN, 2E2=INIT */
-        int size;
-        int init;
-        int run;
-};
+        return get16(p) + ((unsigned long)get16(p + 2) << 16);
+}
 
-/* File stored internally for nice formatting */
-struct name
+long get24(unsigned char *p)
 {
-        char *name;
-
-        /* From directory entry */
-        int locked; /* Set if write-protected */
-        int sector; /* Starting sector of file */
-        int sects; /* Sector count */
-
-        int is_sys; /* Set if it's a .SYS file */
-        int is_cm; /* Set if it's a .COM file */
-
-        
+        return get16(p) + ((long)p[2] << 16);
+}
 
-        /* From file itself */
-        struct segment *segments;
-        int size;
-};
+void put16(unsigned char *p, int v)
+{
+        p[0] = (v & 0xFF);
+        p[1] = ((v >> 8) & 0xFF);
+}
 
-/* Array of internal file names for formatting */
-struct name *names[(SECTOR_DIR_SIZE * SECTOR_SIZE) / ENTRY_SIZE];
-int name_n;
+/* Which kind of image is this? */
 
-/* For qsort */
-int comp(struct name **l, struct name **r)
+int image_kind(FILE *f)
 {
-        return strcmp((*l)->name, (*r)->name);
+        unsigned char b[4];
+        int n = fread(b, 1, 4, f);
+        rewind(f);
+        if (n >= 2 && b[0] == 0x1F && b[1] == 0x8B)
+                return SRC_GZIP;
+        if (n == 4 && get32(b) == ZIP_LOCAL)
+                return SRC_ZIP;
+        /* zlib header: deflate, window up to 32K, check bits */
+        if (n >= 2 && (b[0] & 0x0F) == 8 && (b[0] >> 4) <= 7 && ((b[0] << 8) + b[1]) % 31 == 0)
+                return SRC_ZLIB;
+        return SRC_FILE;
 }
 
-/* Fine an empty directory entry to use for a new file */
+/* Inflate from current position of disk file into disk_map.  bits is the
+ * window bits for inflateInit2(); left is the number of compressed bytes to
+ * read, or -1 to read to the end. */
 
-int find_empty_entry()
+int inflate_image(struct atr_volume *vol, int bits, long left)
 {
-        unsigned char buf[DD_SECTOR_SIZE];
-        int x, y;
-        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
-                int y;
-                if (getsect(buf, x)) {
-                        fprintf(stderr," (trying to read directory sector)\n");
-                        exit(-1);
-                }
-                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
-                        struct dirent *d = (struct dirent *)(buf + y);
-                        if (!(d->flag & FLAG_IN_USE)) {
-                                return (x - SECTOR_DIR) * SECTOR_SIZE / ENTRY_SIZE + (y / ENTRY_SIZE);
+        z_stream z;
+        unsigned char in[SRC_CHUNK];
+        long size = 0;
+        long alloc = 256 * 1024;
+        int r = Z_OK;
+        memset(&z, 0, sizeof(z));
+        if (inflateInit2(&z, bits) != Z_OK)
+                return -1;
+        vol->disk_map = (unsigned char *)malloc(alloc);
+        while (r != Z_STREAM_END) {
+                int amnt = SRC_CHUNK;
+                if (left != -1 && amnt > left)
+                        amnt = left;
+                z.next_in = in;
+                z.avail_in = fread(in, 1, amnt, vol->disk);
+                if (!z.avail_in)
+                        break;
+                if (left != -1)
+                        left -= z.avail_in;
+                while (z.avail_in && r != Z_STREAM_END) {
+                        if (size == alloc) {
+                                alloc *= 2;
+                                vol->disk_map = (unsigned char *)realloc(vol->disk_map, alloc);
                         }
+                        z.next_out = vol->disk_map + size;
+                        z.avail_out = alloc - size;
+                        r = inflate(&z, Z_NO_FLUSH);
+                        size = alloc - z.avail_out;
+                        if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+                                break;
                 }
+                if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+                        break;
         }
-        return -1;
+        inflateEnd(&z);
+        vol->disk_map_size = size;
+        if (r != Z_STREAM_END) {
+                fprintf(vol->err, "Compressed image '%s' is damaged or truncated\n", vol->disk_name);
+                return -1;
+        }
+        return 0;
 }
 
-int lower(int c)
+/* Find member of zip archive (first .atr if member is 0) and inflate it */
+
+int unzip_image(struct atr_volume *vol, char *member)
 {
-        if (c >= 'A' && c <= 'Z')
-                return c - 'A' + 'a';
+        unsigned char tail[65536 + 22];
+        unsigned char ent[46];
+        char name[1024];
+        long file_size, pos, start;
+        unsigned long central;
+        int entries, n, x;
+
+        fseek(vol->disk, 0, SEEK_END);
+        file_size = ftell(vol->disk);
+        start = (file_size > (long)sizeof(tail) ? file_size - (long)sizeof(tail) : 0);
+        fseek(vol->disk, start, SEEK_SET);
+        n = fread(tail, 1, file_size - start, vol->disk);
+        for (x = n - 22; x >= 0 && get32(tail + x) != ZIP_EOCD; --x);
+        if (x < 0) {
+                fprintf(vol->err, "'%s' is not a zip archive\n", vol->disk_name);
+                return -1;
+        }
+        entries = get16(tail + x + 10);
+        central = get32(tail + x + 16);
+
+        /* Look through central directory */
+        pos = central;
+        while (entries--) {
+                int name_len, method;
+                unsigned long comp_size, local;
+                if (fseek(vol->disk, pos, SEEK_SET) || fread(ent, 1, 46, vol->disk) != 46 ||
+                    get32(ent) != ZIP_CENTRAL)
+                        break;
+                name_len = get16(ent + 28);
+                pos += 46 + name_len + get16(ent + 30) + get16(ent + 32);
+                if (name_len >= (int)sizeof(name) || fread(name, 1, name_len, vol->disk) != name_len)
+                        break;
+                name[name_len] = 0;
+                if (member ? strcmp(name, member) : !is_atr_name(name))
+                        continue;
+                method = get16(ent + 10);
+                comp_size = get32(ent + 20);
+                local = get32(ent + 42);
+                if (method != 0 && method != 8) {
+                        fprintf(vol->err, "'%s' in '%s' uses an unsupported compression method\n", name, vol->disk_name);
+                        return -1;
+                }
+                /* Data follows the local header, whose name and extra field lengths may differ */
+                if (fseek(vol->disk, local, SEEK_SET) || fread(ent, 1, 30, vol->disk) != 30 ||
+                    get32(ent) != ZIP_LOCAL ||
+                    fseek(vol->disk, local + 30 + get16(ent + 26) + get16(ent + 28), SEEK_SET))
+                        break;
+                if (method == 8)
+                        return inflate_image(vol, -15, comp_size);
+                vol->disk_map = (unsigned char *)malloc(comp_size + 1);
+                vol->disk_map_size = fread(vol->disk_map, 1, comp_size, vol->disk);
+                return vol->disk_map_size == comp_size ? 0 : -1;
+        }
+        if (member)
+                fprintf(vol->err, "No '%s' in '%s'\n", member, vol->disk_name);
         else
-                return c;
+                fprintf(vol->err, "No .atr file in '%s'\n", vol->disk_name);
+        return -1;
 }
 
-/* Convert file name from directory into UNIX zero-terminated C string name */
+/* Deflate image back to its file: written to a temporary file which then
+ * replaces the original. */
 
-char *getname(struct dirent *d)
+int deflate_image(struct atr_volume *vol)
 {
-        static char s[50];
-        int p = 0;
+        z_stream z;
+        unsigned char out[SRC_CHUNK];
+        char tmp[1100];
+        struct stat st;
+        FILE *f;
         int r;
-        int i;
-        /* Get name */
-        for (i = 0; i != sizeof(d->name); i++) {
-                s[p++] = lower(d->name[i]);
+        snprintf(tmp, sizeof(tmp), "%s.%d", vol->disk_name, (int)getpid());
+        f = fopen(tmp, "w");
+        if (!f) {
+                fprintf(vol->err, "Couldn't create '%s'\n", tmp);
+                return -1;
         }
-        /* Zap trailing spaces */
-        while (p && s[p - 1] == ' ') --p;
-        /* Append '.' */
-        s[p++] = '.';
-        r = p;
-        /* Get extension */
-        for (i = 0; i != sizeof(d->suffix); i++) {
-                s[p++] = lower(d->suffix[i]);
+        memset(&z, 0, sizeof(z));
+        deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, (vol->disk_src == SRC_GZIP ? 15 + 16 : 15),
+                     8, Z_DEFAULT_STRATEGY);
+        z.next_in = vol->disk_map;
+        z.avail_in = vol->disk_map_size;
+        do {
+                z.next_out = out;
+                z.avail_out = sizeof(out);
+                r = deflate(&z, Z_FINISH);
+                if (fwrite(out, 1, sizeof(out) - z.avail_out, f) != sizeof(out) - z.avail_out)
+                        r = Z_ERRNO;
+        } while (r == Z_OK);
+        deflateEnd(&z);
+        if (!fstat(fileno(vol->disk), &st))
+                fchmod(fileno(f), st.st_mode & 07777);
+        if (fclose(f) || r != Z_STREAM_END || rename(tmp, vol->disk_name)) {
+                fprintf(vol->err, "Couldn't write compressed image '%s'\n", vol->disk_name);
+                remove(tmp);
+                return -1;
         }
-        /* Zap tailing spaces */
-        while (p && s[p - 1] == ' ') --p;
-        /* Zap '.' if no extension */
-        if (p == r) --p;
-        /* Terminate */
-        s[p] = 0;
-        return s;
+        return 0;
 }
 
-/* Write UNIX name into Atari directory entry */
+/* Release image memory */
 
-void putname(struct dirent *d, char *name)
+void unmap_disk(struct atr_volume *vol)
 {
-        int x;
-        /* Copy file name into directory entry */
-        x = 0;
-        while (*name && *name != '.' && x < 8) {
-                if (*name >= 'a' && *name <= 'z')
-                        d->name[x++] = *name++ - 'a' + 'A';
-                else
-                        d->name[x++] = *name++;
-        }
-        while (x < 8) {
-                d->name[x++] = ' ';
-        }
-        x = 0;
-        while (*name && *name != '.')
-                ++name;
-        if (*name == '.') {
-                ++name;
-                while (*name && x < 3) {
-                        if (*name >= 'a' && *name <= 'z')
-                                d->suffix[x++] = *name++ - 'a' + 'A';
-                        else
-                                d->suffix[x++] = *name++;
-                }
-        }
-        while (x < 3) {
-                d->suffix[x++] = ' ';
+        if (vol->imd) {
+                free_imd(vol->imd);
+                vol->imd = 0;
         }
+        if (vol->disk_src != SRC_FILE)
+                free(vol->disk_map);
+        else if (vol->disk_map)
+                munmap(vol->disk_map, vol->disk_map_size);
+        vol->disk_map = 0;
 }
 
-/* Find a file, return number of its first sector */
-/* If del is set, mark directory for deletion */
+/* An ImageDisk image looks like the .atr image imd2atr would make of it
+ * (--physical, for double density), without the header.  Read bytes of that
+ * image. */
 
-int find_file(char *filename, int del, char *new_name)
+int imd_read(struct atr_volume *vol, long ofst, unsigned char *buf, int len)
 {
-        unsigned char buf[DD_SECTOR_SIZE];
-        int x, y;
-        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
-                int y;
-                if (getsect(buf, x)) {
-                        fprintf(stderr," (trying to read directory)\n");
-                        goto done;
-                }
-                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
-                        struct dirent *d = (struct dirent *)(buf + y);
-                        /* OSS OS/A+ disks put junk after first never used directory entry */
-                        if (!(d->flag & (FLAG_IN_USE | FLAG_DELETED)))
-                                goto done;
-                        if (d->flag & FLAG_IN_USE) {
-                                char *s = getname(d);
-                                if (!strcmp(s, filename)) {
-                                        if (del) {
-                                                d->flag = 0x80;
-                                                putsect(buf, x);
-                                        }
-                                        if (new_name) {
-                                                putname(d, new_name);
-                                                putsect(buf, x);
-                                        }
-                                        return (d->start_hi << 8) + d->start_lo;
-                                }
-                        }
+        unsigned char sect[DD_SECTOR_SIZE];
+        while (len) {
+                long start;
+                int n, size, amnt;
+                if (ofst < 16)
+                        return -1;
+                if (ofst < vol->data_start) {
+                        n = (ofst - 16) / vol->boot_stride;
+                        start = 16 + vol->boot_stride * (long)n;
+                        size = vol->boot_stride;
+                } else {
+                        n = BOOT_SECTS + (ofst - vol->data_start) / vol->sector_size;
+                        start = vol->data_start + vol->sector_size * (long)(n - BOOT_SECTS);
+                        size = vol->sector_size;
                 }
+                if (imd_get(vol->imd, n, sect) == -1)
+                        return -1;
+                amnt = size - (ofst - start);
+                if (amnt > len)
+                        amnt = len;
+                memcpy(buf, sect + (ofst - start), amnt);
+                buf += amnt;
+                ofst += amnt;
+                len -= amnt;
         }
-        done:
-        return -1;
+        return 0;
 }
 
-/* Read a file */
+/* Geometry of an ImageDisk image: every track has to have the same sector
+ * size, 128 or 256 bytes.  Returns the sector size, or 0. */
+
+int imd_geometry(struct atr_volume *vol)
+{
+        struct imd *imd = vol->imd;
+        int ss = (imd->ntracks ? imd->tracks[0].sec_size : 0);
+        int x;
+        for (x = 0; x != imd->ntracks; ++x)
+                if (imd->tracks[x].sec_size != ss)
+                        ss = 0;
+        if (ss != SECTOR_SIZE && ss != DD_SECTOR_SIZE)
+                return 0;
+        set_density(vol, ss == DD_SECTOR_SIZE);
+        set_layout(vol, ss == DD_SECTOR_SIZE ? LAYOUT_PHYSICAL : LAYOUT_LOGICAL);
+        if (imd->nsects <= BOOT_SECTS)
+                vol->image_end = 16 + vol->boot_stride * (long)imd->nsects;
+        else
+                vol->image_end = vol->data_start + ss * (long)(imd->nsects - BOOT_SECTS);
+        vol->disk_map_size = vol->image_end;
+        return ss;
+}
 
-int cvt_ending = 0;
+/* Read bytes from the image, before we know its geometry */
 
-void read_file(int sector, FILE *f)
+int image_read(struct atr_volume *vol, long ofst, unsigned char *buf, int len)
 {
-        int count = 0;
+        if (ofst + len > vol->disk_map_size)
+                return -1;
+        if (vol->imd)
+                return imd_read(vol, ofst, buf, len);
+        if (vol->disk_map)
+                memcpy(buf, vol->disk_map + ofst, len);
+        else if (fseek(vol->disk, ofst, SEEK_SET) || fread(buf, 1, len, vol->disk) != len)
+                return -1;
+        return 0;
+}
 
-        do {
-                unsigned char buf[DD_SECTOR_SIZE];
-                int next;
-                int file_no;
-                int bytes;
+/* True if bytes of image are all zero */
 
-                if (count == 2048) {
-                        fprintf(stderr," (file too long)\n");
-                        status = 1;
-                        break;
-                }
-                if (getsect(buf, sector)) {
-                        fprintf(stderr," (trying to read from file)\n");
-                        status = 1;
-                        return;
-                }
-                ++count;
+int image_zero(struct atr_volume *vol, long ofst, int len)
+{
+        unsigned char buf[BOOT_SECTS * SECTOR_SIZE];
+        int x;
+        if (image_read(vol, ofst, buf, len))
+                return 0;
+        for (x = 0; x != len; ++x)
+                if (buf[x])
+                        return 0;
+        return 1;
+}
 
-                next = (int)buf[data_next_low] + ((int)(0x3 & buf[data_next_high]) << 8);
-                file_no = ((buf[data_file_num] >> 2) & 0x3F);
-                bytes = buf[data_bytes];
+/* Geometry from the .atr header: sector size, where the sector data ends
+ * (the paragraph count, if the file isn't shorter) and, for 256 byte
+ * sectors, the layout of the boot sectors.  An image of 3 * 128 bytes plus
+ * whole sectors is logical.  Otherwise the boot sectors took 768 bytes: if
+ * the second half of the first one is empty, they are 256 bytes each
+ * (physical), else they are 128 bytes each followed by 384 bytes of padding
+ * (SIO).  Returns the sector size, or 0 if there is no header, in which case
+ * the size of the image has to tell us. */
 
-                // printf("Sector %d: next=%d, bytes=%d, file_no=%d, short=%d\n",
-                //        sector, next, bytes, file_no, short_sect);
-                
-                if (cvt_ending) {
-                        int x;
-                        for (x = 0; x != bytes; ++x)
-                                if (buf[x] == 0x9b) {
-                                        buf[x] = '\n';
-                                }
-                }
+int atr_header(struct atr_volume *vol)
+{
+        unsigned char hdr[16];
+        long len;
+        int ss;
+        vol->image_end = vol->disk_map_size;
+        if (image_read(vol, 0, hdr, 16) || hdr[0] != 0x96 || hdr[1] != 0x02)
+                return 0;
+        ss = get16(hdr + 4);
+        if (ss != SECTOR_SIZE && ss != DD_SECTOR_SIZE)
+                return 0;
+        len = 16 * (get16(hdr + 2) + ((long)hdr[6] << 16));
+        if (len && 16 + len < vol->image_end)
+                vol->image_end = 16 + len;
+        set_density(vol, ss == DD_SECTOR_SIZE);
+        len = vol->image_end - 16;
+        if (ss == DD_SECTOR_SIZE && len % DD_SECTOR_SIZE == 0 && len >= BOOT_SECTS * DD_SECTOR_SIZE) {
+                if (image_zero(vol, 16 + SECTOR_SIZE, SECTOR_SIZE))
+                        set_layout(vol, LAYOUT_PHYSICAL);
+                else if (image_zero(vol, 16 + BOOT_SIZE, BOOT_SIZE))
+                        set_layout(vol, LAYOUT_SIO);
+                else
+                        set_layout(vol, LAYOUT_PHYSICAL);
+        }
+        return ss;
+}
 
-                fwrite(buf, bytes, 1, f);
+/* Anything bigger than a DOS 2 disk is taken to be a MyDOS volume if the
+ * .ATR header gives a sector size we know (ss, from atr_header()).  Returns
+ * true if it did. */
 
-                sector = next;
-        } while(sector);
+int mydos_geometry(struct atr_volume *vol, int ss)
+{
+        int sects;
+        if (!ss)
+                return 0;
+        sects = image_sects(vol);
+        if (sects > MYDOS_MAX_SECTS)
+                sects = MYDOS_MAX_SECTS;
+        if (sects <= SECTOR_DIR + SECTOR_DIR_SIZE)
+                return 0;
+        vol->fs = FS_MYDOS;
+        vol->disk_size = sects + 1;
+        vol->link16 = (vol->disk_size > ED_DISK_SIZE);
+        return 1;
 }
 
-/* cat a file */
+/* SpartaDOS disks of any size are known by the volume information in the
+ * first boot sector.  It has to agree with itself (the bitmap is the right
+ * size for the volume, the sectors it names are on it) before we believe
+ * it.  Returns true if it does. */
 
-void cat(char *name)
+int sparta_geometry(struct atr_volume *vol)
 {
-        int sector = find_file(name, 0, NULL);
-        if (sector == -1) {
-                fprintf(stderr,"File '%s' not found\n", name);
-                exit(-1);
-        } else {
-                /* printf("Found file.  First sector of file is %d\n", sector); */
-                read_file(sector, stdout);
+        unsigned char boot[SECTOR_SIZE];
+        int total, nbm, ss, map, bm;
+        int dd = vol->disk_dd;
+        if (image_read(vol, 16, boot, SECTOR_SIZE))
+                return 0;
+        if (boot[SP_VERSION] != 0x11 && boot[SP_VERSION] != 0x20 && boot[SP_VERSION] != 0x21)
+                return 0;
+        if (boot[SP_SECTOR_SIZE] == 0x80)
+                ss = SECTOR_SIZE;
+        else if (boot[SP_SECTOR_SIZE] == 0x00)
+                ss = DD_SECTOR_SIZE;
+        else
+                return 0;
+        total = get16(boot + SP_NUM_SECTS);
+        nbm = boot[SP_BITMAP_SECTS];
+        map = get16(boot + SP_DIR_MAP);
+        bm = get16(boot + SP_BITMAP);
+        if (total <= BOOT_SECTS || get16(boot + SP_NUM_UNUSED) > total ||
+            nbm < (total + ss * 8 - 1) / (ss * 8) || nbm > (total + ss * 8) / (ss * 8) ||
+            map <= BOOT_SECTS || map > total || bm <= BOOT_SECTS || bm + nbm - 1 > total)
+                return 0;
+        set_density(vol, ss == DD_SECTOR_SIZE);
+        if (image_sects(vol) < total) {
+                set_density(vol, dd);
+                return 0;
         }
+        vol->fs = FS_SPARTA;
+        vol->disk_size = total + 1;
+        vol->root_sect = vol->dir_sect = map;
+        vol->sp_bitmap = bm;
+        vol->sp_bitmap_sects = nbm;
+        return 1;
 }
 
-/* get a file from the disk */
+/* Open disk image and determine its type.  Read-only commands get a
+ * read-only mapping, writers get a shared writable mapping so that
+ * flush_cache() goes straight to the file. */
 
-int get_file(char *atari_name, char *local_name)
+int open_disk(struct atr_volume *vol, char *disk_name, int writable)
 {
-        int sector = find_file(atari_name, 0, NULL);
-        if (sector == -1) {
-                fprintf(stderr,"File '%s' not found\n", atari_name);
+        struct stat st;
+        long size;
+        int ss;
+        char path[1024];
+        char *member = 0;
+        vol->disk = fopen(disk_name, writable ? "r+" : "r");
+        if (!vol->disk) {
+                /* archive.zip:member */
+                char *p;
+                snprintf(path, sizeof(path), "%s", disk_name);
+                for (p = strchr(path, ':'); p; p = strchr(p + 1, ':'))
+                        if (p - path >= 4 && !strncasecmp(p - 4, ".zip", 4)) {
+                                *p = 0;
+                                member = p + 1;
+                                vol->disk = fopen(path, "r");
+                                break;
+                        }
+        }
+        if (!vol->disk) {
+                fprintf(vol->err, "Couldn't open '%s'\n", disk_name);
                 return -1;
-        } else {
-                FILE *f = fopen(local_name, "w");
-                if (!f) {
-                        fprintf(stderr,"Couldn't open local file '%s'\n", local_name);
+        }
+        if (fstat(fileno(vol->disk), &st)) {
+                fprintf(vol->err, "Couldn't stat '%s'\n", disk_name);
+                fclose(vol->disk);
+                vol->disk = 0;
+                return -1;
+        }
+        vol->disk_name = disk_name;
+        vol->disk_map_size = st.st_size;
+        vol->disk_map = 0;
+        /* ImageDisk's header is free text (atr2imd's starts "ATR2IMD"), so go
+         * by the name */
+        vol->disk_src = (member ? SRC_ZIP : is_imd_name(disk_name) ? SRC_IMD : image_kind(vol->disk));
+        if (vol->disk_src == SRC_ZIP && writable) {
+                fprintf(vol->err, "Images in zip archives are read only\n");
+                fclose(vol->disk);
+                vol->disk = 0;
+                return -1;
+        }
+        if (vol->disk_src == SRC_IMD) {
+                vol->imd = read_imd(disk_name, vol->err);
+                if (!vol->imd || !imd_geometry(vol)) {
+                        if (vol->imd)
+                                fprintf(vol->err, "'%s' doesn't have 128 or 256 byte sectors throughout\n", disk_name);
+                        unmap_disk(vol);
+                        fclose(vol->disk);
+                        vol->disk = 0;
                         return -1;
                 }
-                /* printf("Found file.  First sector of file is %d\n", sector); */
-                read_file(sector, f);
-                if (fclose(f)) {
-                        fprintf(stderr,"Couldn't close local file '%s'\n", local_name);
+        } else if (vol->disk_src != SRC_FILE) {
+                int r;
+                if (vol->disk_src == SRC_ZIP)
+                        r = unzip_image(vol, member);
+                else
+                        r = inflate_image(vol, (vol->disk_src == SRC_GZIP ? 15 + 16 : 15), -1);
+                if (r) {
+                        unmap_disk(vol);
+                        fclose(vol->disk);
+                        vol->disk = 0;
                         return -1;
                 }
-                return status;
+        } else if (vol->disk_map_size) {
+                void *m = mmap(NULL, vol->disk_map_size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                               MAP_SHARED, fileno(vol->disk), 0);
+                if (m != MAP_FAILED)
+                        vol->disk_map = (unsigned char *)m;
         }
-}
-
-/* Mark a sector as allocated or free */
 
-void mark_space(unsigned char *bitmap, int start, int alloc)
-{
-        if (alloc) {
-                bitmap[start >> 3] &= ~(1 << (7 - (start & 7)));
+        /* Determine image type: the header says how the sectors are laid
+         * out, then what's on them or how many there are says the rest */
+        ss = (vol->imd ? vol->sector_size : atr_header(vol));
+        size = vol->image_end;
+        if (sparta_geometry(vol)) {
+                /* printf("SpartaDOS disk assumed\n"); */
+        } else if (ss == DD_SECTOR_SIZE && image_sects(vol) <= DD_DISK_SIZE) {
+                /* Header says double density: any of the three layouts */
+                vol->disk_size = DD_DISK_SIZE;
+                /* printf("Double density DOS 2.0D disk assumed\n"); */
+        } else if (!ss && size - 16 == 128*3 + 256*717) {
+                /* No header, but it's the size of a double density disk */
+                vol->disk_size = DD_DISK_SIZE;
+                set_density(vol, 1);
+//	} else if (size - 16 == 40 * 18 * 128) {
+        } else if (ss != DD_SECTOR_SIZE && size - 16 < 1024 * 128) {
+                /* Minimum size for enhanced density is 1024 sectors */
+                /* Anything less: assume single-density */
+                /* printf("Single density DOS 2.0S disk assumed\n"); */
+                vol->disk_size = SD_DISK_SIZE;
+//	} else if (size - 16 == 40 * 26 * 128) {
+        } else if (ss != DD_SECTOR_SIZE && size - 16 < 128*3 + 256*717) {
+                /* Minimum size of double density is 3 128 byte sectors + 717 256 byte sectors */
+                /* Anything less: assume enhanced density */
+                /* printf("Enhanced density DOS 2.5 disk assumed\n"); */
+                vol->disk_size = ED_DISK_SIZE;
+        } else if (mydos_geometry(vol, ss)) {
+                /* Large volume: MyDOS */
         } else {
-                bitmap[start >> 3] |= (1 << (7 - (start & 7)));
+                fprintf(vol->out, "Unknown disk size.  Expected:\n");
+                fprintf(vol->out, "  .ATR header is 16 bytes, so:\n");
+                fprintf(vol->out, "  16 + 40*18*128 = 92,176 bytes for DOS 2.0s single density\n");
+                fprintf(vol->out, "  16 + 40*26*128 = 133,136 bytes for DOS 2.5 enhanced density\n");
+                fprintf(vol->out, "  16 + 40*18*256 - 3*128 = 183,952 bytes for DOS 2.0d double density\n");
+                fprintf(vol->out, "  or anything larger with a 128 or 256 byte sector size in the header for MyDOS\n");
+                fprintf(vol->out, "  or any size for SpartaDOS, found by its boot sector\n");
+                unmap_disk(vol);
+                fclose(vol->disk);
+                vol->disk = 0;
+                return -1;
         }
+        return 0;
 }
 
-/* Delete file */
+/* Read sector from image (bypasses the cache) */
 
-int del_file(int sector)
+int read_sect(struct atr_volume *vol, unsigned char *buf, int sect)
 {
-        unsigned char bitmap[ED_BITMAP_SIZE];
-        int count = 0;
-        getmap(bitmap, 0);
+        long offset;
+        int size;
 
-        do {
-                unsigned char buf[DD_SECTOR_SIZE];
-                int next;
-                int file_no;
-                int bytes;
+        offset = sect_offset(vol, sect, &size);
+        ++vol->stat_reads;
 
-                if (count == 2048) {
-                        fprintf(stderr," (file too long)\n");
-                        break;
-                }
-                if (getsect(buf, sector)) {
-                        fprintf(stderr," (while deleting a file)\n");
-                        break;
+        if (vol->imd) {
+                unsigned char tmp[DD_SECTOR_SIZE];
+                if (imd_get(vol->imd, sect - 1, tmp) == -1) {
+                        fprintf(vol->err, "Oops, tried to seek past end (sector %d)\n", sect);
+                        vol->status = 1;
+                        return -1;
                 }
-                ++count;
-
-                next = (int)buf[data_next_low] + ((int)(0x3 & buf[data_next_high]) << 8);
-                file_no = ((buf[data_file_num] >> 2) & 0x3F);
-                bytes = buf[data_bytes];
-
-                // printf("Sector %d: next=%d, bytes=%d, file_no=%d, short=%d\n", sector, next, bytes, file_no, short_sect);
-
-                mark_space(bitmap, sector, 0);
+                memcpy(buf, tmp, size);
+                return 0;
+        }
 
-                sector = next;
-        } while(sector);
+        if (vol->disk_map) {
+                if (offset + size > vol->disk_map_size) {
+                        fprintf(vol->err, "Oops, tried to seek past end (sector %d)\n", sect);
+                        vol->status = 1;
+                        return -1;
+                }
+                memcpy(buf, vol->disk_map + offset, size);
+                return 0;
+        }
 
-        putmap(bitmap);
+        if (fseek(vol->disk, offset, SEEK_SET)) {
+                fprintf(vol->err, "Oops, tried to seek past end (sector %d)\n", sect);
+                vol->status = 1;
+                return -1;
+        }
+        if (size != fread((char *)buf, 1, size, vol->disk)) {
+                fprintf(vol->err, "Oops, read error (sector %d)\n", sect);
+                vol->status = 1;
+                return -1;
+        }
         return 0;
 }
 
-/* Delete file name */
+/* Write sector to image (bypasses the cache) */
 
-int rm(char *name, int ignore)
+int write_sect(struct atr_volume *vol, unsigned char *buf, int sect)
 {
-        int first_sect = find_file(name, 1, NULL);
-        if (first_sect != -1) {
-                if (del_file(first_sect)) {
-                        fprintf(stderr,"Error deleting file '%s'\n", name);
+        long offset;
+        int size;
+
+        offset = sect_offset(vol, sect, &size);
+        ++vol->stat_writes;
+
+        if (vol->imd) {
+                /* Boot sectors of double density images are 256 bytes:
+                 * keep the half we don't use */
+                unsigned char tmp[DD_SECTOR_SIZE];
+                if (imd_get(vol->imd, sect - 1, tmp) == -1) {
+                        fprintf(vol->err, "Oops, seek error during write (sector %d)\n", sect);
                         return -1;
-                } else {
-                        return status;
                 }
-        } else {
-                if (!ignore) {
-                        fprintf(stderr,"File '%s' not found\n", name);
-                        status = 1;
+                memcpy(tmp, buf, size);
+                if (imd_put(vol->imd, sect - 1, tmp)) {
+                        fprintf(vol->err, "Oops, sector %d is not in the track's sector map\n", sect);
+                        return -1;
+                }
+                return 0;
+        }
+
+        if (vol->disk_map) {
+                if (offset + size > vol->disk_map_size) {
+                        fprintf(vol->err, "Oops, seek error during write (sector %d)\n", sect);
+                        return -1;
                 }
+                memcpy(vol->disk_map + offset, buf, size);
+                return 0;
+        }
+
+        if (fseek(vol->disk, offset, SEEK_SET)) {
+                fprintf(vol->err, "Oops, seek error during write (sector %d)\n", sect);
+                return -1;
+        }
+        if (size != fwrite((char *)buf, 1, size, vol->disk)) {
+                fprintf(vol->err, "Oops, write error (sector %d)\n", sect);
                 return -1;
         }
+        return 0;
 }
 
-/* Count free sectors */
+/* Sector cache: each sector is read from the image at most once.  putsect()
+ * only updates the cache and marks the sector dirty, flush_cache() writes
+ * dirty sectors back once (in ascending order) when the command is done. */
 
-int amount_free(unsigned char *bitmap)
-{
-        int total = 0;
-        int x;
+/* Find cache entry for a sector, growing cache as needed */
 
-        for (x = 0; x != disk_size; ++x) {
-                if (bitmap[(x >> 3)] & (1 << (7 - (x & 7))))
-                        ++total;
+struct cache_ent *cache_ent(struct atr_volume *vol, int sect)
+{
+        if (sect >= vol->cache_size) {
+                int new_size = vol->cache_size ? vol->cache_size : 1024;
+                while (new_size <= sect)
+                        new_size *= 2;
+                vol->cache = (struct cache_ent *)realloc(vol->cache, new_size * sizeof(struct cache_ent));
+                memset(vol->cache + vol->cache_size, 0, (new_size - vol->cache_size) * sizeof(struct cache_ent));
+                vol->cache_size = new_size;
         }
-        return total;
+        return vol->cache + sect;
 }
 
-/* Free command */
+int getsect(struct atr_volume *vol, unsigned char *buf, int sect)
+{
+        struct cache_ent *e;
+        int size;
+
+        if (!sect) {
+                fprintf(vol->err, "Oops, tried to read sector 0\n");
+                return -1;
+        }
+
+        sect_offset(vol, sect, &size);
+        e = cache_ent(vol, sect);
+        if (e->data) {
+                ++vol->stat_hits;
+        } else {
+                unsigned char *data = (unsigned char *)malloc(DD_SECTOR_SIZE);
+                if (read_sect(vol, data, sect)) {
+                        free(data);
+                        return -1;
+                }
+                e->data = data;
+        }
+        memcpy(buf, e->data, size);
+        return 0;
+}
 
-int do_free(void)
+int putsect(struct atr_volume *vol, unsigned char *buf, int sect)
 {
-        int amount;
-        unsigned char bitmap[ED_BITMAP_SIZE];
-        getmap(bitmap, 0);
-        amount = amount_free(bitmap);
-        printf("%d free sectors, %d free bytes\n", amount, amount * sector_size);
+        struct cache_ent *e;
+        int size;
+
+        if (!sect) {
+                fprintf(vol->err, "Oops, requested sector 0\n");
+                vol->status = 1;
+                return -1;
+        }
+
+        sect_offset(vol, sect, &size);
+        e = cache_ent(vol, sect);
+        if (!e->data)
+                e->data = (unsigned char *)malloc(DD_SECTOR_SIZE);
+        memcpy(e->data, buf, size);
+        e->dirty = 1;
         return 0;
 }
 
-/* Check a single file */
+/* Write back dirty sectors */
 
-int check_file(struct dirent *d, int y, int x, char *map, char *name[])
+int flush_cache(struct atr_volume *vol)
 {
-        unsigned char fbuf[DD_SECTOR_SIZE];
-        char *filename = strdup(getname(d));
-        int upddir = 0;
-        int sector;
-        int sects;
-        int count = 0;
-        int upd = 0;
-        int file_no = (y / ENTRY_SIZE) + ((x - SECTOR_DIR) * SECTOR_SIZE / ENTRY_SIZE);
-        sector = (d->start_hi << 8) + d->start_lo;
-        sects = (d->count_hi << 8) + d->count_lo;
-        printf("Checking %s (file_no %d)\n", filename, file_no);
-        if (d->flag & FLAG_OPENED) {
-                printf("  ** Warning: file is marked as opened\n");
-                if (fixit()) {
-                        d->flag &= ~FLAG_OPENED;
-                        upddir = 1;
-                }
-        }
-        do {
-                int next;
-                int sector_file_no;
-                ++count;
-                if (count == 2048) {
-                        fprintf(stderr," (file too long)\n");
-                        status = 1;
-                        break;
-                }
-                if (getsect(fbuf, sector)) {
-                        fprintf(stderr," (reading file)\n");
-                        exit(-1);
-                }
-                if (map[sector] != -1) {
-                        fprintf(stderr,"  ** Uh oh.. sector %d already in use by %s (%d)\n", sector, name[sector] ? name[sector] : "reserved", map[sector]);
-                        status = 1;
-                }
-                if (map[sector] == file_no) {
-                        fprintf(stderr,"  ** Warning: Infinite linked list detected\n");
-                        status = 1;
-                        break;
-                } else {
-                        int dsize;
-                        map[sector] = file_no;
-                        name[sector] = filename;
-                        next = (int)fbuf[data_next_low] + ((int)(0x3 & fbuf[data_next_high]) << 8);
-                        sector_file_no = ((int)fbuf[data_file_num] >> 2);
-                        if (sector_file_no != file_no) {
-                                fprintf(stderr,"  ** Warning: Sector %d claims to belong to file %d\n", sector, sector_file_no);
-                                status = 1;
-                                if (fixit()) {
-                                        fbuf[data_file_num] = (fbuf[data_file_num] & 0x3) | (file_no << 2);
-                                        upd = 1;
-                                }
-                        }
-                        dsize = (int)fbuf[data_bytes];
-                        if (next) {
-                                if (dsize != data_size) {
-                                        fprintf(stderr, "  ** Warning: Sector %d is short\n", sector);
-                                }
-                        } else {
-                                if (dsize == 0) {
-                                        fprintf(stderr, "  ** Warning: Sector %d (last sector of file) is empty\n", sector);
-                                }
+        int x;
+        int rtn = 0;
+        for (x = 0; x != vol->cache_size; ++x)
+                if (vol->cache[x].dirty) {
+                        if (write_sect(vol, vol->cache[x].data, x)) {
+                                vol->status = 1;
+                                rtn = -1;
                         }
+                        vol->cache[x].dirty = 0;
                 }
-                if (upd) {
-                        putsect(fbuf, sector);
-                        fixes = 1;
-                        upd = 0;
-                }
-                sector = next;
-        } while (sector);
-        if (count != sects) {
-                fprintf(stderr,"  ** Warning: size in directory (%d) does not match size on disk (%d) for file %s\n",
-                       sects, count, filename);
-                status = 1;
-                if (fixit()) {
-                        d->count_hi = (0xFF & (count >> 8));
-                        d->count_lo = (0xFF & count);
-                        upddir = 1;
-                }
-        }
-        printf("  Found %d sectors\n", count);
-        return upddir;
+        return rtn;
 }
 
-/* Check disk: regen bit map */
+/* Flush cache and close disk image */
 
-int do_check()
+int close_disk(struct atr_volume *vol)
 {
-        unsigned char bitmap[ED_BITMAP_SIZE];
-        unsigned char buf[DD_SECTOR_SIZE];
-        int x, y;
-        int total;
-        int ok;
-        int found_eod = 0;
-        char map[ED_DISK_SIZE];
-        char *name[ED_DISK_SIZE];
-
-        if (disk_size == ED_DISK_SIZE)
-                printf("Checking DOS 2.5 enhanced density disk...\n");
-        else if (disk_dd)
-                printf("Checking DOS 2.0d double density disk...\n");
-        else
-                printf("Checking DOS 2.0s single density disk...\n");
-
-        /* Mark all as free */
-        for (x = 0; x != ED_DISK_SIZE; ++x) {
-                map[x] = -1;
-                name[x] = 0;
+        int rtn = flush_cache(vol);
+        int x;
+        for (x = 0; x != vol->cache_size; ++x)
+                if (vol->cache[x].data)
+                        free(vol->cache[x].data);
+        free(vol->cache);
+        vol->cache = 0;
+        vol->cache_size = 0;
+        if (vol->imd) {
+                if (vol->imd->written && imd_save(vol->imd, vol->disk_name, vol->err))
+                        rtn = -1;
+        } else if (vol->disk_src != SRC_FILE && vol->stat_writes && deflate_image(vol)) {
+                rtn = -1;
+        }
+        unmap_disk(vol);
+        if (vol->disk && fclose(vol->disk)) {
+                fprintf(vol->err, "Couldn't close disk image\n");
+                rtn = -1;
         }
+        vol->disk = 0;
+        return rtn;
+}
 
-        /* Mark non-existent sector 0 as allocated */
-        map[0] = 64;
+/* Free volume and directory read into it */
 
-        /* Mark VTOC and DIR */
-        map[SECTOR_VTOC] = 64;
-        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x)
-                map[x] = 64;
+void free_volume(struct atr_volume *vol)
+{
+        int x;
+        for (x = 0; x != vol->name_n; ++x) {
+                free(vol->names[x]->segments);
+                free(vol->names[x]->name);
+                free(vol->names[x]);
+        }
+        free(vol);
+}
 
-        /* Boot loader */
-        map[1] = 64;
-        map[2] = 64;
-        map[3] = 64;
+/* Sector links.  DOS 2 keeps a 10-bit link, with the file number in the
+ * upper 6 bits of the high byte; large MyDOS volumes use both bytes for the
+ * link and have no file number. */
 
-        /* Sector 720 if we have an ED disk */
-        if (disk_size == ED_DISK_SIZE)
-                map[720] = 64;
+int get_link(struct atr_volume *vol, unsigned char *buf)
+{
+        if (vol->link16)
+                return (buf[vol->data_next_high] << 8) + buf[vol->data_next_low];
+        return buf[vol->data_next_low] + ((buf[vol->data_next_high] & 0x3) << 8);
+}
 
-        /* Step through each file */
-        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
-                int y;
-                int upd = 0;
-                if (getsect(buf, x)) {
-                        fprintf(stderr," (reading directory)\n");
-                        exit(-1);
-                }
-                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
-                        struct dirent *d = (struct dirent *)(buf + y);
-                        if (!(d->flag & (FLAG_IN_USE | FLAG_DELETED))) {
-                                found_eod = 1;
-                        }
-                        if (d->flag & FLAG_IN_USE) {
-                                if (found_eod == 1) {
-                                        fprintf(stderr,"** Error: found in use directory entry after end of directory mark:\n");
-                                        status = 1;
-                                        found_eod = 2;
-                                }
-                                upd |= check_file(d, y, x, map, name);
-                        }
-                }
-                if (upd) {
-                        printf("Writing back modified directory sector...\n");
-                        putsect(buf, x);
-                        printf("  done.\n");
-                        fixes = 1;
-                }
-        }
-        done:
-        total = 0;
-        for (x = 0; x != disk_size; ++x) {
-                if (map[x] != -1) {
-                        ++total;
-//                        if (map[x] == 64)
-//                                printf("%d reserved\n", x);
-//                        else {
-//                                printf("%d file number %d (%s)\n", x, map[x], name[x]);
-//                        }
-                }
-        }
-        printf("%d sectors in use, %d sectors free\n", total, disk_size - total);
+/* Set link, keeping file number */
 
-        printf("Checking VTOC header...\n");
-        getmap(bitmap, 1);
-        printf("Compare VTOC bitmap with reconstructed bitmap from files...\n");
-        ok = 1;
-        for (x = 0; x != disk_size; ++x) {
-                int is_alloc;
-                if (bitmap[x >> 3] & (1 << (7 - (x & 7))))
-                        is_alloc = 0;
-                else
-                        is_alloc = 1;
-                if (is_alloc && map[x] == -1) {
-                        fprintf(stderr,"  ** VTOC shows sector %d allocated, but it should be free\n", x);
-                        status = 1;
-                        ok = 0;
-                }
-                if (!is_alloc && map[x] != -1) {
-                        fprintf(stderr,"  ** VTOC shows sector %d free, but it should be allocated\n", x);
-                        status = 1;
-                        ok = 0;
-                }
-        }
-        if (ok) {
-                printf("  It's OK.\n");
-        } else if (fixit()) {
-                memset(bitmap, 0xFF, ED_BITMAP_SIZE);
-                for (x = 0; x != ED_DISK_SIZE; ++x) {
-                        if (map[x] != -1) {
-                                bitmap[x >> 3] &= ~(1 << (7 - (x & 7)));
-                        }
-                }
-                printf("Updating allocation bitmap...\n");
-                putmap(bitmap);
-                printf("  done.\n");
-                fixes = 1;
-        }
-        printf("All done.\n");
-        if (status)
-                fprintf(stderr, "Errors were detected\n");
-        if (fixes)
-                printf("Fixes were made - recommend you rerun check\n");
-        return status;
+void set_link(struct atr_volume *vol, unsigned char *buf, int next)
+{
+        if (vol->link16)
+                buf[vol->data_next_high] = (next >> 8);
+        else
+                buf[vol->data_next_high] = (buf[vol->data_next_high] & ~0x3) | ((next >> 8) & 0x3);
+        buf[vol->data_next_low] = next;
 }
 
-/* Allocate space for file */
+/* File number in sector, or -1 if there isn't one */
 
-int alloc_space(unsigned char *bitmap, int *list, int sects)
+int get_file_no(struct atr_volume *vol, unsigned char *buf)
 {
-        while (sects) {
-                int x;
-                for (x = 1; x != disk_size; ++x) {
-                        if (bitmap[x >> 3] & (1 << (7 - (x & 7)))) {
-                                *list++ = x;
-                                bitmap[x >> 3] &= ~(1 << (7 - (x & 7)));
-                                break;
-                        }
-                }
-                if (x == disk_size) {
-                        fprintf(stderr, "Not enough space\n");
-                        status = 1;
-                        return -1;
-                }
-                --sects;
-        }
-        return 0;
+        if (vol->link16)
+                return -1;
+        return buf[vol->data_file_num] >> 2;
+}
+
+void set_file_no(struct atr_volume *vol, unsigned char *buf, int file_no)
+{
+        if (!vol->link16)
+                buf[vol->data_file_num] = (buf[vol->data_file_num] & 0x3) | (file_no << 2);
 }
 
-/* Write a file */
+/* Longest chain we follow before calling a file too long */
 
-int write_file(unsigned char *bitmap, char *buf, int sects, int file_no, int size)
+int max_chain(struct atr_volume *vol)
 {
-        int x;
-        int first_sect;
-        unsigned char bf[DD_SECTOR_SIZE];
-        int list[ED_DISK_SIZE];
-        memset(list, 0, sizeof(list));
+        return vol->disk_size > 2048 ? vol->disk_size : 2048;
+}
 
-        if (alloc_space(bitmap, list, sects))
-                return -1;
+/* Allocation bitmap
+ *
+ * The VTOC keeps one bit per sector, MSB first, with 1 meaning free.  In
+ * memory we keep the same bits in 64-bit words with sector n at bit (n & 63)
+ * of word (n >> 6), so that counting, searching and comparing work on 64
+ * sectors at a time.  Bytes are bit-reversed on the way in and out.
+ */
 
-        for (x = 0; x != sects; ++x) {
-                memcpy(bf, buf + (data_size) * x, data_size);
-                if (x + 1 == sects) {
-                        // Last sector
-                        bf[data_next_low] = 0;
-                        bf[data_next_high] = 0;
-                        bf[data_bytes] = size;
-                } else {
-                        bf[data_next_low] = list[x + 1];
-                        bf[data_next_high] = (list[x + 1] >> 8);
-                        bf[data_bytes] = data_size;
-                }
-                bf[data_file_num] |= (file_no << 2);
-                size -= data_size;
-                // printf("Writing sector %d %d %d %d\n", list[x], bf[125], bf[126], bf[127]);
-                putsect(bf, list[x]);
-        }
-        return list[0];
+#define BITMAP_MAX 65536 /* Largest number of sectors we can describe */
+#define BITMAP_WORDS (BITMAP_MAX / 64)
+
+struct bitmap {
+        int size; /* Number of sectors covered */
+        uint64_t w[BITMAP_WORDS];
+};
+
+/* These compile to POPCNT / TZCNT (or BSF) when the target has them */
+
+#ifdef __GNUC__
+#define popcount64(x) __builtin_popcountll(x)
+#define ctz64(x) __builtin_ctzll(x)
+#else
+int popcount64(uint64_t x)
+{
+        x = x - ((x >> 1) & 0x5555555555555555ULL);
+        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+        x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        return (int)((x * 0x0101010101010101ULL) >> 56);
+}
+
+/* x must not be zero */
+int ctz64(uint64_t x)
+{
+        return popcount64((x & -x) - 1);
 }
+#endif
 
-/* Write directory entry */
+/* Reverse bits of a byte */
 
-int write_dir(int file_no, char *name, int first_sect, int sects)
+unsigned char rev8(unsigned char c)
 {
-        struct dirent d[1];
-        unsigned char dir_buf[DD_SECTOR_SIZE];
+        c = (c >> 4) | (c << 4);
+        c = ((c & 0xCC) >> 2) | ((c & 0x33) << 2);
+        c = ((c & 0xAA) >> 1) | ((c & 0x55) << 1);
+        return c;
+}
 
-        /* Copy file name into directory entry */
-        putname(d, name);
-
-        d->start_hi = (first_sect >> 8);
-        d->start_lo = first_sect;
-        d->count_hi = (sects >> 8);
-        d->count_lo = sects;
-        /* DOS complains on some file operations if FLAG_DOS2 is not there: */
-        d->flag = FLAG_IN_USE | FLAG_DOS2;
-        
-        if (getsect(dir_buf, SECTOR_DIR + file_no / (SECTOR_SIZE / ENTRY_SIZE))) {
-                fprintf(stderr, " (trying to read directory)\n");
-                exit(-1);
+/* Mask of bits lo..63 and 0..hi of a word */
+#define MASK_FROM(lo) (~0ULL << ((lo) & 63))
+#define MASK_UPTO(hi) (~0ULL >> (63 - ((hi) & 63)))
+
+/* Set up bitmap for size sectors, all free or all allocated */
+
+void bitmap_init(struct bitmap *bm, int size, int free)
+{
+        int x;
+        memset(bm->w, 0, sizeof(bm->w));
+        bm->size = size;
+        if (free && size) {
+                for (x = 0; x != (size - 1) >> 6; ++x)
+                        bm->w[x] = ~0ULL;
+                bm->w[x] = MASK_UPTO(size - 1);
         }
-        memcpy(dir_buf + ENTRY_SIZE * (file_no % (SECTOR_SIZE / ENTRY_SIZE)), d, ENTRY_SIZE);
-        putsect(dir_buf, SECTOR_DIR + file_no / (SECTOR_SIZE / ENTRY_SIZE));
-        return 0;
 }
 
-/* Put a file on the disk */
+/* Load len bytes of VTOC bitmap describing sectors starting at first (a
+ * multiple of 8) */
 
-int put_file(char *local_name, char *atari_name)
+void bitmap_load(struct bitmap *bm, unsigned char *bytes, int first, int len)
 {
-        FILE *f = fopen(local_name, "r");
-        long size;
-        long up;
-        long x;
-        unsigned char *buf;
-        unsigned char bitmap[ED_BITMAP_SIZE];
-        int first_sect;
-        int file_no;
-        int num_sects;
-        if (!f) {
-                fprintf(stderr, "Couldn't open '%s'\n", local_name);
-                return -1;
-        }
-        if (fseek(f, 0, SEEK_END)) {
-                fprintf(stderr,"Couldn't get file size of '%s'\n", local_name);
-                status = 1;
-                fclose(f);
-                return -1;
-        }
-        size = ftell(f);
-        if (size < 0)  {
-                fprintf(stderr, "Couldn't get file size of '%s'\n", local_name);
-                status = 1;
-                fclose(f);
-                return -1;
-        }
-        rewind(f);
-        // Round up to a multiple of (DATA_SIZE)
-        up = size + (data_size) - 1;
-        up -= up % (data_size);
-        num_sects = up / data_size;
-        buf = (unsigned char *)malloc(up);
-        if (size != fread(buf, 1, size, f)) {
-                fprintf(stderr, "Couldn't read file '%s'\n", local_name);
-                status = 1;
-                fclose(f);
-                free(buf);
-                return -1;
+        while (len--) {
+                bm->w[first >> 6] &= ~(0xFFULL << (first & 63));
+                bm->w[first >> 6] |= (uint64_t)rev8(*bytes++) << (first & 63);
+                first += 8;
         }
-        fclose(f);
+}
 
-        if (cvt_ending) {
-                /* Convert UNIX line endings to Atari */
-                for (x = 0; x != size; ++x)
-                        if (buf[x] == '\n')
-                                buf[x] = 0x9b;
+/* Store len bytes of VTOC bitmap describing sectors starting at first */
+
+void bitmap_store(struct bitmap *bm, unsigned char *bytes, int first, int len)
+{
+        while (len--) {
+                *bytes++ = rev8((unsigned char)(bm->w[first >> 6] >> (first & 63)));
+                first += 8;
         }
+}
 
-        /* Fill with NULs to end of sector */
-        for (x = size; x != up; ++x)
-                buf[x] = 0;
+/* Count number of free sectors in lo..hi-1 */
 
-        /* Delete existing file */
-        rm(atari_name, 1);
+int count_free(struct bitmap *bm, int lo, int hi)
+{
+        int count = 0;
+        int x;
+        if (lo >= hi)
+                return 0;
+        for (x = lo >> 6; x <= (hi - 1) >> 6; ++x) {
+                uint64_t w = bm->w[x];
+                if (x == lo >> 6)
+                        w &= MASK_FROM(lo);
+                if (x == (hi - 1) >> 6)
+                        w &= MASK_UPTO(hi - 1);
+                count += popcount64(w);
+        }
+        return count;
+}
 
-        /* Get bitmap... */
-        getmap(bitmap, 0);
+/* Find first set bit (free sector) in from..to-1, or -1 if there is none */
 
-        /* Prepare directory entry */
-        file_no = find_empty_entry();
-        if (file_no == -1) {
+int bitmap_next(struct bitmap *bm, int from, int to)
+{
+        int x;
+        uint64_t w;
+        if (from >= to)
                 return -1;
+        x = from >> 6;
+        w = bm->w[x] & MASK_FROM(from);
+        for (;;) {
+                if (w) {
+                        int sect = (x << 6) + ctz64(w);
+                        return sect < to ? sect : -1;
+                }
+                if (++x > (to - 1) >> 6)
+                        return -1;
+                w = bm->w[x];
         }
+}
 
-        /* Allocate space and write file */
-        first_sect = write_file(bitmap, buf, num_sects, file_no, size);
+/* Find end of run of free sectors starting at from: the first allocated
+ * sector in from..to-1, or to if there is none */
 
-        if (first_sect == -1) {
-                fprintf(stderr, "Couldn't write file\n");
-                status = 1;
-                return -1;
+int bitmap_run(struct bitmap *bm, int from, int to)
+{
+        int x;
+        uint64_t w;
+        if (from >= to)
+                return to;
+        x = from >> 6;
+        w = ~bm->w[x] & MASK_FROM(from);
+        for (;;) {
+                if (w) {
+                        int sect = (x << 6) + ctz64(w);
+                        return sect < to ? sect : to;
+                }
+                if (++x > (to - 1) >> 6)
+                        return to;
+                w = ~bm->w[x];
         }
+}
 
-        if (write_dir(file_no, atari_name, first_sect, num_sects)) {
-                fprintf(stderr, "Couldn't write directory entry\n");
-                status = 1;
-                return -1;
-        }
+/* Set diff to the sectors where a and b disagree, return how many there are */
 
-        /* Success! */
-        putmap(bitmap);
-        return status;
+int bitmap_diff(struct bitmap *diff, struct bitmap *a, struct bitmap *b)
+{
+        int x;
+        int n = (a->size + 63) >> 6;
+        bitmap_init(diff, a->size, 0);
+        for (x = 0; x != n; ++x)
+                diff->w[x] = a->w[x] ^ b->w[x];
+        if (n && (a->size & 63))
+                diff->w[n - 1] &= MASK_UPTO(a->size - 1);
+        return count_free(diff, 0, a->size);
 }
 
-/* Rename a file */
+/* Mark a sector as allocated or free */
 
-int atari_rename(char *old_name, char *new_name)
+void mark_space(struct bitmap *bm, int start, int alloc)
 {
-        if (find_file(new_name, 0, NULL) != -1) {
-                fprintf(stderr, "'%s' already exists\n", new_name);
-                return -1;
-        }
-        return find_file(old_name, 0, new_name);
+        if (alloc)
+                bm->w[start >> 6] &= ~(1ULL << (start & 63));
+        else
+                bm->w[start >> 6] |= (1ULL << (start & 63));
 }
 
-/* Get info about file: actual size, etc. */
+/* Check if a sector is free */
 
-void get_info(struct name *nam)
+int is_free(struct bitmap *bm, int sect)
 {
-        unsigned char bigbuf[65536 * 2];
-        unsigned char membuf[65536];
-        int total = 0;
-        int sector = nam->sector;
-        unsigned char bf[6];
-        int ptr = 0;
-        struct segment *lastseg = 0;
-        do {
-                unsigned char buf[DD_SECTOR_SIZE];
-                int next;
-                int file_no;
-                int bytes;
+        return (int)((bm->w[sect >> 6] >> (sect & 63)) & 1);
+}
 
-                if (total + 125 >= sizeof(bigbuf)) {
-                        fprintf(stderr, " (file %s too long)\n", nam->name);
-                        status = 1;
-                        break;
-                }
-                if (getsect(buf, sector)) {
-                        fprintf(stderr, " (trying to read file %s)\n", nam->name);
-                        break;
-                }
+/* Mark the sectors DOS keeps for itself as allocated */
 
-                next = (int)buf[data_next_low] + ((int)(0x3 & buf[data_next_high]) << 8);
-                file_no = ((buf[data_file_num] >> 2) & 0x3F);
-                bytes = buf[data_bytes];
+void reserve_space(struct bitmap *bm)
+{
+        int n;
+        mark_space(bm, 0, 1); /* Sector zero */
+        mark_space(bm, 1, 1); /* Boot sectors */
+        mark_space(bm, 2, 1);
+        mark_space(bm, 3, 1);
+        mark_space(bm, SECTOR_VTOC, 1); /* VTOC */
+        for (n = 0; n != SECTOR_DIR_SIZE; ++n) /* DIR */
+                mark_space(bm, SECTOR_DIR + n, 1);
+        mark_space(bm, 720, 1); /* Reserved */
+}
 
-                if (bytes && total + bytes <= sizeof(bigbuf)) {
-                        memcpy(bigbuf + total, buf, bytes);
-                }
+/* Print part of check's text report.  There is none with --json: vol->out
+ * is 0 then. */
 
-                total += bytes;
+void report(struct atr_volume *vol, char *fmt, ...)
+{
+        va_list ap;
+        if (!vol->out)
+                return;
+        va_start(ap, fmt);
+        vfprintf(vol->out, fmt, ap);
+        va_end(ap);
+}
 
-                sector = next;
-        } while(sector);
+/* Fix it?  safe is FIND_SAFE for fixes which only touch counts, flags and
+ * the VTOC header, FIND_UNSAFE for ones which rewrite sectors or the bitmap.
+ * Without a policy we ask. */
 
-        nam->size = total;
-        nam->segments = 0;
-
-        // Look at file...
-        if (total >= 2 && bigbuf[0] == 0xFF && bigbuf[1] == 0xFF) { /* Magic number for binary file */
-                int idx;
-                int ok = 1;
-                int segsize;
-                for (idx = 0; ok && idx < total; idx += segsize) {
-                        segsize = 0;
-                        ok = 0;
-                        /* Each segment can optionally start with 0xFFFF, skip it */
-                        if (idx + 2 <= total && bigbuf[idx] == 0xFF && bigbuf[idx + 1] == 0xFF) {
-                                idx += 2;
-                                ok = 1;
-                        }
-                        /* Get header */
-                        if (idx + 4 <= total) {
-                                struct segment *segment;
-                                int first = (int)bigbuf[idx + 0] + ((int)bigbuf[idx + 1] << 8);
-                                int last = (int)bigbuf[idx + 2] + ((int)bigbuf[idx + 3] << 8);
-                                segsize = last - first + 1;
-                                idx += 4;
-                                ok = 1;
-                                if (segsize < 1) { /* Bad load format? */
-                                        break;
-                                }
-                                /* Ignore short segments (DUP.SYS loader will not skip them) */
-                                if (segsize > 1) {
-                                        segment = (struct segment *)malloc(sizeof(struct segment));
-                                        segment->start = first;
-                                        segment->size = segsize;
-                                        segment->next = 0;
-                                        segment->init = -1;
-                                        segment->run = -1;
-                                        if (!nam->segments)
-                                                nam->segments = segment;
-                                        if (lastseg)
-                                                lastseg->next = segment;
-                                        lastseg = segment;
-                                        membuf[0x2e0] = 0xFE;
-                                        membuf[0x2e1] = 0xFE;
-                                        membuf[0x2e2] = 0xFE;
-                                        membuf[0x2e3] = 0xFE;
-                                        memcpy(membuf + first, bigbuf + idx, segsize);
-                                        if (membuf[0x2e0]!=0xFE || membuf[0x2e1]!=0xFE)
-                                                segment->run = (int)membuf[0x2e0] + ((int)membuf[0x2e1] << 8);
-                                        if (membuf[0x2e2]!=0xFE || membuf[0x2e3]!=0xFE)
-                                                segment->init = (int)membuf[0x2e2] + ((int)membuf[0x2e3] << 8);
-                                }
+int fixit(struct atr_volume *vol, int safe)
+{
+        if (!vol->fix)
+                return 0;
+        if (vol->fix_policy == FIX_ASK) {
+                for (;;) {
+                        char buf[80];
+                        fprintf(vol->out, "Fix it (y,n)? ");
+                        fflush(vol->out);
+                        if (fgets(buf,sizeof(buf),stdin)) {
+                                if (buf[0] == 'y' || buf[0] == 'Y')
+                                        return 1;
+                                else if (buf[0] == 'n' || buf[0] == 'N')
+                                        return 0;
                         }
                 }
         }
+        return vol->fix_policy == FIX_ALL || (vol->fix_policy == FIX_SAFE && safe == FIND_SAFE);
 }
 
-/* Read directory into names/name_n array
- * If info_flg is set, read file to measure it real length
- * If all_flg is set, included system files in
- */
+/* Parse a --policy= argument */
 
-void read_dir(int all_flg, int info_flg)
+int set_policy(struct atr_volume *vol, char *s)
 {
-        unsigned char buf[DD_SECTOR_SIZE];
-        int x;
-        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
-                int y;
-                if (getsect(buf, x)) {
-                        fprintf(stderr," (trying to read directory)\n");
-                        break;
+        if (!strcmp(s, "all"))
+                vol->fix_policy = FIX_ALL;
+        else if (!strcmp(s, "safe"))
+                vol->fix_policy = FIX_SAFE;
+        else if (!strcmp(s, "none"))
+                vol->fix_policy = FIX_NONE;
+        else {
+                fprintf(vol->err, "Unknown fix policy '%s': use all, safe or none\n", s);
+                return -1;
+        }
+        return 0;
+}
+
+/* Write string as a JSON string */
+
+void json_str(FILE *f, char *s)
+{
+        if (!s) {
+                fprintf(f, "null");
+                return;
+        }
+        fputc('"', f);
+        for (; *s; ++s) {
+                unsigned char c = *s;
+                if (c == '"' || c == '\\')
+                        fprintf(f, "\\%c", c);
+                else if (c < 0x20)
+                        fprintf(f, "\\u%04x", c);
+                else
+                        fputc(c, f);
+        }
+        fputc('"', f);
+}
+
+/* Write record for an image which couldn't be checked: the error is the
+ * messages in buf, run together on one line */
+
+void json_error(FILE *f, char *image, char *buf, size_t len)
+{
+        char msg[256];
+        size_t x;
+        int n = 0;
+        for (x = 0; x != len && n + 1 != (int)sizeof(msg); ++x)
+                if (buf[x] != '\n' && (buf[x] != ' ' || (n && msg[n - 1] != ' ')))
+                        msg[n++] = buf[x];
+                else if (n && msg[n - 1] != ' ')
+                        msg[n++] = ' ';
+        while (n && msg[n - 1] == ' ')
+                --n;
+        msg[n] = 0;
+        fprintf(f, "{\"image\":");
+        json_str(f, image);
+        fprintf(f, ",\"error\":");
+        json_str(f, n ? msg : "failed");
+        fprintf(f, "}\n");
+}
+
+/* Record a finding of check.  The text message has already been printed;
+ * this offers the fix (unless safe is FIND_NOFIX) and, with --json, writes
+ * one JSON record for it.  file and sector are left out of the record when
+ * 0, found and expected when -1.  Returns true if the fix should be made. */
+
+int finding(struct atr_volume *vol, char *kind, char *file, int sector, int found, int expected, int safe)
+{
+        int fixed = (safe != FIND_NOFIX && fixit(vol, safe));
+        if (fixed)
+                ++vol->fixes_applied;
+        if (vol->json) {
+                fprintf(vol->json, "{\"image\":");
+                json_str(vol->json, vol->disk_name);
+                fprintf(vol->json, ",\"finding\":\"%s\"", kind);
+                if (file) {
+                        fprintf(vol->json, ",\"file\":");
+                        json_str(vol->json, file);
                 }
-                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
-                        struct dirent *d = (struct dirent *)(buf + y);
+                if (sector > 0)
+                        fprintf(vol->json, ",\"sector\":%d", sector);
+                if (found != -1)
+                        fprintf(vol->json, ",\"found\":%d", found);
+                if (expected != -1)
+                        fprintf(vol->json, ",\"expected\":%d", expected);
+                fprintf(vol->json, ",\"fix\":\"%s\"}\n",
+                        safe == FIND_NOFIX ? "none" : fixed ? "applied" : "skipped");
+        }
+        return fixed;
+}
 
-                        if (!(d->flag & (FLAG_IN_USE | FLAG_DELETED)))
-                                goto done;
+/* Number of sectors holding the MyDOS bitmap: 360 and the ones below it */
 
-                        if (d->flag & FLAG_IN_USE) {
-                                struct name *nam;
-                                char *s = getname(d);
-                                nam = (struct name *)malloc(sizeof(struct name));
-                                nam->name = strdup(s);
-                                if (d->flag & FLAG_LOCKED)
-                                        nam->locked = 1;
-                                else
-                                        nam->locked = 0;
-                                nam->sector = d->start_lo + (d->start_hi * 256);
-                                nam->sects = d->count_lo + (d->count_hi * 256);
-                                nam->segments = 0;
-                                nam->size = -1;
-                                if (info_flg)
-                                        get_info(nam);
+int mydos_vtoc_sects(struct atr_volume *vol)
+{
+        int len = (vol->disk_size + 7) / 8 - (vol->sector_size - VTOC_BITMAP);
+        if (len <= 0)
+                return 1;
+        return 1 + (len + vol->sector_size - 1) / vol->sector_size;
+}
 
-                                if (d->suffix[0] == 'S' && d->suffix[1] == 'Y' && d->suffix[2] == 'S')
-                                        nam->is_sys = 1;
-                                else
-                                        nam->is_sys = 0;
+/* Load (or store) the MyDOS bitmap.  vtoc is sector 360, the rest are read
+ * (or read, updated and written) here. */
 
-                                if ((all_flg || !nam->is_sys))
-                                        names[name_n++] = nam;
-                        }
+int mydos_map(struct atr_volume *vol, struct bitmap *bitmap, unsigned char *vtoc, int store)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int len = (vol->disk_size + 7) / 8;
+        int first = 0;
+        int x;
+        for (x = 0; first != len * 8; ++x) {
+                unsigned char *p = (x ? buf : vtoc + VTOC_BITMAP);
+                int amnt = (x ? vol->sector_size : vol->sector_size - VTOC_BITMAP);
+                if (amnt > len - first / 8)
+                        amnt = len - first / 8;
+                if (x && getsect(vol, buf, SECTOR_VTOC - x)) {
+                        fprintf(vol->err, " (trying to read VTOC)\n");
+                        vol->status = 1;
+                        return -1;
                 }
+                if (store) {
+                        bitmap_store(bitmap, p, first, amnt);
+                        if (x)
+                                putsect(vol, buf, SECTOR_VTOC - x);
+                } else {
+                        bitmap_load(bitmap, p, first, amnt);
+                }
+                first += amnt * 8;
         }
-        done:;
+        return 0;
 }
 
-#define FLUSHLINE do { \
-        if (strlen(linebuf) + 15 >= 78) { \
-                int n; \
-                printf("%s\n", linebuf); \
-                for (n = 0; n != ofst; ++n) linebuf[n] = ' '; \
-                linebuf[n] = 0; \
-        } \
-} while (0)
+/* Load (or store) the SpartaDOS bitmap */
 
-void atari_dir(int all, int full, int single)
+int sparta_map(struct atr_volume *vol, struct bitmap *bitmap, int store)
 {
         unsigned char buf[DD_SECTOR_SIZE];
-        int x, y;
-        int rows;
-        int cols = (80 / 13);
-        read_dir(all, 1);
+        int len = (vol->disk_size + 7) / 8;
+        int first = 0;
+        int x;
+        for (x = 0; x != vol->sp_bitmap_sects && first != len * 8; ++x) {
+                int amnt = vol->sector_size;
+                if (amnt > len - first / 8)
+                        amnt = len - first / 8;
+                if (getsect(vol, buf, vol->sp_bitmap + x)) {
+                        fprintf(vol->err, " (trying to read bitmap)\n");
+                        vol->status = 1;
+                        return -1;
+                }
+                if (store) {
+                        bitmap_store(bitmap, buf, first, amnt);
+                        putsect(vol, buf, vol->sp_bitmap + x);
+                } else {
+                        bitmap_load(bitmap, buf, first, amnt);
+                }
+                first += amnt * 8;
+        }
+        return 0;
+}
 
-        qsort(names, name_n, sizeof(struct name *), (int (*)(const void *, const void *))comp);
+/* Get allocation bitmap */
 
-        if (full) {
-                int totals = 0;
-                int total_bytes = 0;
-                printf("\n");
-                for (x = 0; x != name_n; ++x) {
-                        char linebuf[100];
-                        int ofst;
-                        int extra = 0;
-                        struct segment *seg;
-                        sprintf(linebuf, "-r%c%c%c %6d (%3d) %-13s",
-                               (names[x]->locked ? '-' : 'w'),
-                               (names[x]->is_cm ? 'x' : '-'),
-                               (names[x]->is_sys ? 's' : '-'),
-                               names[x]->size, names[x]->sects, names[x]->name);
-                        ofst = strlen(linebuf) + 1;
-                        for (seg = names[x]->segments; seg; seg = seg->next) {
-                                if (!extra) {
-                                        strcat(linebuf, " (");
-                                        extra = 1;
-                                } else {
-                                        strcat(linebuf, " ");
-                                }
-                                FLUSHLINE;
-                                sprintf(linebuf + strlen(linebuf), "load=%x-%x", seg->start, seg->start + seg->size - 1);
-                                if (seg->init != -1) {
+int getmap(struct atr_volume *vol, struct bitmap *bitmap, int check)
+{
+        unsigned char vtoc[DD_SECTOR_SIZE];
+        unsigned char vtoc2[DD_SECTOR_SIZE];
+        int upd = 0;
+        /* SpartaDOS keeps the free count in the boot sector */
+        int vtoc_sect = (vol->fs == FS_SPARTA ? 1 : SECTOR_VTOC);
+        int count_ofst = (vol->fs == FS_SPARTA ? SP_NUM_UNUSED : VTOC_NUM_UNUSED);
+        char *what = (vol->fs == FS_SPARTA ? "boot sector" : "VTOC");
+
+        if (getsect(vol, vtoc, vtoc_sect)) {
+                fprintf(vol->err, " (trying to read %s)\n", what);
+                vol->status = 1;
+                return -1;
+        }
+        bitmap_init(bitmap, vol->disk_size, 0);
+        if (vol->fs == FS_SPARTA) {
+                if (sparta_map(vol, bitmap, 0))
+                        return -1;
+        } else if (vol->fs == FS_MYDOS) {
+                if (mydos_map(vol, bitmap, vtoc, 0))
+                        return -1;
+        } else {
+                bitmap_load(bitmap, vtoc + VTOC_BITMAP, 0, SD_BITMAP_SIZE);
+        }
+
+        if (check && vol->fs != FS_DOS2) {
+                /* The free count is all there is to check in the header */
+                int count = count_free(bitmap, 0, vol->disk_size);
+                int vtoc_count = vtoc[count_ofst] + (256 * vtoc[count_ofst + 1]);
+                report(vol, "  Checking that %s current free sector count matches bitmap...\n", what);
+                if (count != vtoc_count) {
+                        fprintf(vol->err, "    ** It doesn't match: bitmap has %d free, but %s count is %d\n", count, what, vtoc_count);
+                        ++vol->vtoc_errors;
+                        vol->status = 1;
+                        if (finding(vol, "vtoc_free", 0, vtoc_sect, vtoc_count, count, FIND_SAFE)) {
+                                vtoc[count_ofst] = (0xFF & count);
+                                vtoc[count_ofst + 1] = (0xFF & (count >> 8));
+                                report(vol, "Saving %s fixes...\n", (vol->fs == FS_SPARTA ? "boot sector" : "VTOC1"));
+                                putsect(vol, vtoc, vtoc_sect);
+                                report(vol, "  done.\n");
+                                vol->fixes = 1;
+                        }
+                } else {
+                        report(vol, "    It's OK (count is %d)\n", count);
+                }
+        } else if (check) {
+                int count = count_free(bitmap, 0, SD_BITMAP_SIZE * 8);
+                int vtoc_count = vtoc[VTOC_NUM_UNUSED] + (256 * vtoc[VTOC_NUM_UNUSED + 1]);
+                int vtoc_total = vtoc[VTOC_NUM_SECTS] + (256 * vtoc[VTOC_NUM_SECTS + 1]);
+                int expected_size;
+                report(vol, "  Checking that VTOC current free sector count matches bitmap...\n");
+                if (count != vtoc_count) {
+                        fprintf(vol->err, "    ** It doesn't match: bitmap has %d free, but VTOC count is %d\n", count, vtoc_count);
+                        ++vol->vtoc_errors;
+                        vol->status = 1;
+                        if (finding(vol, "vtoc_free", 0, SECTOR_VTOC, vtoc_count, count, FIND_SAFE)) {
+                                vtoc[VTOC_NUM_UNUSED] = (0xFF & count);
+                                vtoc[VTOC_NUM_UNUSED + 1] = (0xFF & (count >> 8));
+                                upd = 1;
+                        }
+                } else {
+                        report(vol, "    It's OK (count is %d)\n", count);
+                }
+                if (vol->disk_size == ED_DISK_SIZE)
+                        expected_size = 1010; /* 1011 if we don't pre-allocate 720 */
+                else
+                        expected_size = 707;
+                report(vol, "  Checking that VTOC initial free sector count is %d...\n", expected_size);
+                if (vtoc_total != expected_size) {
+                        fprintf(vol->err, "    ** It's wrong, we found: %d\n", vtoc_total);
+                        ++vol->vtoc_errors;
+                        vol->status = 1;
+                        if (finding(vol, "vtoc_total", 0, SECTOR_VTOC, vtoc_total, expected_size, FIND_SAFE)) {
+                                vtoc[VTOC_NUM_SECTS] = (0xFF & expected_size);
+                                vtoc[VTOC_NUM_SECTS + 1] = (0xFF & (expected_size >> 8));
+                                upd = 1;
+                        }
+                } else
+                        report(vol, "    It's OK\n");
+                report(vol, "  Checking that VTOC type code is 2...\n");
+                if (vtoc[VTOC_TYPE] == 2)
+                        report(vol, "    It's OK\n");
+                else {
+                        fprintf(vol->err, "    ** It's wrong, we found: %d\n", vtoc[VTOC_TYPE]);
+                        ++vol->vtoc_errors;
+                        vol->status = 1;
+                        if (finding(vol, "vtoc_type", 0, SECTOR_VTOC, vtoc[VTOC_TYPE], 2, FIND_SAFE)) {
+                                vtoc[VTOC_TYPE] = 2;
+                                upd = 1;
+                        }
+                }
+                if (upd) {
+                        report(vol, "Saving VTOC1 fixes...\n");
+                        putsect(vol, vtoc, SECTOR_VTOC);
+                        report(vol, "  done.\n");
+                        upd = 0;
+                        vol->fixes = 1;
+                }
+        }
+
+        if (vol->fs == FS_DOS2 && vol->disk_size == ED_DISK_SIZE) {
+                if (getsect(vol, vtoc2, SECTOR_VTOC2)) {
+                        report(vol, " (trying to read VTOC2)\n");
+                        vol->status = 1;
+                        return -1;
+                }
+                bitmap_load(
+                        bitmap,
+                        vtoc2 + (SD_BITMAP_SIZE - ED_BITMAP_START),
+                        SD_BITMAP_SIZE * 8,
+                        ED_BITMAP_SIZE - SD_BITMAP_SIZE
+                );
+                if (check) {
+                        int count = count_free(bitmap, SD_BITMAP_SIZE * 8, ED_BITMAP_SIZE * 8);
+                        int vtoc2_count = vtoc2[VTOC2_NUM_UNUSED] + 256 * vtoc2[VTOC2_NUM_UNUSED + 1];
+                        report(vol, "  Checking that VTOC2 current free sector count matches bitmap...\n");
+                        if (count != vtoc2_count) {
+                                fprintf(vol->err, "    ** It doesn't match: bitmap has %d free, but VTOC2 count is %d\n", count, vtoc2_count);
+                                ++vol->vtoc_errors;
+                                vol->status = 1;
+                                if (finding(vol, "vtoc2_free", 0, SECTOR_VTOC2, vtoc2_count, count, FIND_SAFE)) {
+                                        vtoc2[VTOC2_NUM_UNUSED] = (count & 0xFF);
+                                        vtoc2[VTOC2_NUM_UNUSED + 1] = (0xFF & (count >> 8));
+                                        upd = 1;
+                                }
+                        } else {
+                                report(vol, "    It's OK (count is %d)\n", count);
+                        }
+                        if (upd) {
+                                report(vol, "Saving VTOC2 fixes...\n");
+                                putsect(vol, vtoc2, SECTOR_VTOC2);
+                                report(vol, "  done.\n");
+                                upd = 0;
+                                vol->fixes = 1;
+                        }
+                }
+        }
+        return 0;
+}
+
+/* Write back allocation bitmap */
+
+int putmap(struct atr_volume *vol, struct bitmap *bitmap)
+{
+        unsigned char vtoc[DD_SECTOR_SIZE];
+        int count;
+        unsigned char vtoc2[DD_SECTOR_SIZE];
+
+        if (vol->fs == FS_SPARTA) {
+                if (sparta_map(vol, bitmap, 1) || getsect(vol, vtoc, 1)) {
+                        fprintf(vol->err, " (trying to read boot sector)\n");
+                        vol->status = 1;
+                        return -1;
+                }
+                count = count_free(bitmap, 0, vol->disk_size);
+                vtoc[SP_NUM_UNUSED] = count;
+                vtoc[SP_NUM_UNUSED + 1] = (count >> 8);
+                putsect(vol, vtoc, 1);
+                return 0;
+        }
+
+        if (getsect(vol, vtoc, SECTOR_VTOC)) {
+                fprintf(vol->err, " (trying to read VTOC)\n");
+                vol->status = 1;
+                return -1;
+        }
+        if (vol->fs == FS_MYDOS) {
+                if (mydos_map(vol, bitmap, vtoc, 1))
+                        return -1;
+                count = count_free(bitmap, 0, vol->disk_size);
+        } else {
+                bitmap_store(bitmap, vtoc + VTOC_BITMAP, 0, SD_BITMAP_SIZE);
+                count = count_free(bitmap, 0, SD_BITMAP_SIZE * 8);
+        }
+
+        /* Update free count */
+        vtoc[VTOC_NUM_UNUSED] = count;
+        vtoc[VTOC_NUM_UNUSED + 1] = (count >> 8);
+
+        putsect(vol, vtoc, SECTOR_VTOC);
+
+        if (vol->fs == FS_DOS2 && vol->disk_size == ED_DISK_SIZE) {
+                if (getsect(vol, vtoc2, SECTOR_VTOC2)) {
+                        fprintf(vol->err, " (trying to read VTOC2)\n");
+                        vol->status = 1;
+                        return -1;
+                }
+                bitmap_store(bitmap, vtoc2, ED_BITMAP_START * 8, ED_BITMAP_SIZE - ED_BITMAP_START);
+
+                /* Update free count */
+                count = count_free(bitmap, SD_BITMAP_SIZE * 8, ED_BITMAP_SIZE * 8);
+                vtoc2[VTOC2_NUM_UNUSED] = count;
+                vtoc2[VTOC2_NUM_UNUSED + 1] = (count >> 8);
+
+                putsect(vol, vtoc2, SECTOR_VTOC2);
+        }
+        return 0;
+}
+
+/* For qsort */
+int comp(struct name **l, struct name **r)
+{
+        return strcmp((*l)->name, (*r)->name);
+}
+
+int lower(int c)
+{
+        if (c >= 'A' && c <= 'Z')
+                return c - 'A' + 'a';
+        else
+                return c;
+}
+
+/* Convert file name from directory into UNIX zero-terminated C string name.
+ * s must have space for NAME_SIZE bytes. */
+
+#define NAME_SIZE 50
+
+char *getname(struct dirent *d, char *s)
+{
+        int p = 0;
+        int r;
+        int i;
+        /* Get name */
+        for (i = 0; i != sizeof(d->name); i++) {
+                s[p++] = lower(d->name[i]);
+        }
+        /* Zap trailing spaces */
+        while (p && s[p - 1] == ' ') --p;
+        /* Append '.' */
+        s[p++] = '.';
+        r = p;
+        /* Get extension */
+        for (i = 0; i != sizeof(d->suffix); i++) {
+                s[p++] = lower(d->suffix[i]);
+        }
+        /* Zap tailing spaces */
+        while (p && s[p - 1] == ' ') --p;
+        /* Zap '.' if no extension */
+        if (p == r) --p;
+        /* Terminate */
+        s[p] = 0;
+        return s;
+}
+
+/* Write UNIX name into Atari directory entry */
+
+void putname(struct dirent *d, char *name)
+{
+        int x;
+        /* Copy file name into directory entry */
+        x = 0;
+        while (*name && *name != '.' && x < 8) {
+                if (*name >= 'a' && *name <= 'z')
+                        d->name[x++] = *name++ - 'a' + 'A';
+                else
+                        d->name[x++] = *name++;
+        }
+        while (x < 8) {
+                d->name[x++] = ' ';
+        }
+        x = 0;
+        while (*name && *name != '.')
+                ++name;
+        if (*name == '.') {
+                ++name;
+                while (*name && x < 3) {
+                        if (*name >= 'a' && *name <= 'z')
+                                d->suffix[x++] = *name++ - 'a' + 'A';
+                        else
+                                d->suffix[x++] = *name++;
+                }
+        }
+        while (x < 3) {
+                d->suffix[x++] = ' ';
+        }
+}
+
+/* SpartaDOS files and directories are reached through their sector maps
+ * (see top).  The map chain is loaded into a list of data sectors, so any
+ * byte of a file can be read without going through the ones before it. */
+
+struct sp_file {
+        int *data; /* Data sectors in file order, 0 for a hole */
+        int ndata;
+        int *maps; /* Map sectors */
+        int nmaps;
+};
+
+void sp_free(struct sp_file *f)
+{
+        free(f->data);
+        free(f->maps);
+        memset(f, 0, sizeof(struct sp_file));
+}
+
+/* Load the map chain starting at map (0 for an empty file) */
+
+int sp_load(struct atr_volume *vol, int map, struct sp_file *f)
+{
+        int per = (vol->sector_size - SP_MAP_DATA) / 2;
+        memset(f, 0, sizeof(struct sp_file));
+        while (map) {
+                unsigned char buf[DD_SECTOR_SIZE];
+                int x;
+                for (x = 0; x != f->nmaps && f->maps[x] != map; ++x);
+                if (x != f->nmaps || map >= vol->disk_size) {
+                        fprintf(vol->err, " (bad sector map %d)\n", map);
+                        vol->status = 1;
+                        return -1;
+                }
+                if (getsect(vol, buf, map)) {
+                        fprintf(vol->err, " (trying to read sector map)\n");
+                        vol->status = 1;
+                        return -1;
+                }
+                f->maps = (int *)realloc(f->maps, (f->nmaps + 1) * sizeof(int));
+                f->maps[f->nmaps++] = map;
+                f->data = (int *)realloc(f->data, (f->ndata + per) * sizeof(int));
+                for (x = 0; x != per; ++x)
+                        f->data[f->ndata++] = get16(buf + SP_MAP_DATA + 2 * x);
+                map = get16(buf + SP_MAP_NEXT);
+        }
+        /* Last map sector is only filled as far as the file goes */
+        while (f->ndata && !f->data[f->ndata - 1])
+                --f->ndata;
+        return 0;
+}
+
+/* Read len bytes from pos.  Holes read as zeros.  Returns number of bytes
+ * read, which is short if the file has no more sectors, or -1. */
+
+long sp_read(struct atr_volume *vol, struct sp_file *f, long pos, unsigned char *buf, long len)
+{
+        long done = 0;
+        while (done != len) {
+                unsigned char sect[DD_SECTOR_SIZE];
+                long n = (pos + done) / vol->sector_size;
+                int ofst = (pos + done) % vol->sector_size;
+                int amnt = vol->sector_size - ofst;
+                if (amnt > len - done)
+                        amnt = len - done;
+                if (n >= f->ndata)
+                        break;
+                if (!f->data[n]) {
+                        memset(sect, 0, vol->sector_size);
+                } else if (f->data[n] >= vol->disk_size || getsect(vol, sect, f->data[n])) {
+                        fprintf(vol->err, " (trying to read sector %d of file)\n", f->data[n]);
+                        vol->status = 1;
+                        return -1;
+                }
+                memcpy(buf + done, sect + ofst, amnt);
+                done += amnt;
+        }
+        return done;
+}
+
+/* Write len bytes at pos into sectors the file already has */
+
+int sp_write(struct atr_volume *vol, struct sp_file *f, long pos, unsigned char *buf, long len)
+{
+        long done = 0;
+        while (done != len) {
+                unsigned char sect[DD_SECTOR_SIZE];
+                long n = (pos + done) / vol->sector_size;
+                int ofst = (pos + done) % vol->sector_size;
+                int amnt = vol->sector_size - ofst;
+                if (amnt > len - done)
+                        amnt = len - done;
+                if (n >= f->ndata || !f->data[n] || f->data[n] >= vol->disk_size ||
+                    getsect(vol, sect, f->data[n])) {
+                        fprintf(vol->err, " (trying to write file)\n");
+                        vol->status = 1;
+                        return -1;
+                }
+                memcpy(sect + ofst, buf + done, amnt);
+                putsect(vol, sect, f->data[n]);
+                done += amnt;
+        }
+        return 0;
+}
+
+/* A directory loaded into memory.  Entry 0 is the header. */
+
+struct sp_dir {
+        struct sp_file f;
+        unsigned char *buf;
+        long len; /* From header */
+};
+
+#define SP_ENTRY(dir, n) ((struct sp_dirent *)((dir)->buf + SP_ENTRY_SIZE * (n)))
+
+void sp_close_dir(struct sp_dir *dir)
+{
+        sp_free(&dir->f);
+        free(dir->buf);
+        dir->buf = 0;
+}
+
+int sp_open_dir(struct atr_volume *vol, int map, struct sp_dir *dir)
+{
+        unsigned char hdr[SP_ENTRY_SIZE];
+        dir->buf = 0;
+        if (sp_load(vol, map, &dir->f))
+                return -1;
+        if (sp_read(vol, &dir->f, 0, hdr, SP_ENTRY_SIZE) != SP_ENTRY_SIZE ||
+            (dir->len = get24(((struct sp_dirent *)hdr)->len)) < SP_ENTRY_SIZE ||
+            dir->len > SP_ENTRY_SIZE * (SP_MAX_NAMES + 1L)) {
+                fprintf(vol->err, " (bad directory header in map %d)\n", map);
+                vol->status = 1;
+                return -1;
+        }
+        dir->buf = (unsigned char *)malloc(dir->len);
+        if (sp_read(vol, &dir->f, 0, dir->buf, dir->len) != dir->len) {
+                fprintf(vol->err, " (directory in map %d is shorter than its header says)\n", map);
+                vol->status = 1;
+                return -1;
+        }
+        return 0;
+}
+
+/* Number of entries, including the header, up to the end mark */
+
+int sp_entries(struct sp_dir *dir)
+{
+        int n;
+        for (n = 1; n != dir->len / SP_ENTRY_SIZE && SP_ENTRY(dir, n)->flag; ++n);
+        return n;
+}
+
+int sp_in_use(struct sp_dirent *e)
+{
+        return (e->flag & (SP_FLAG_IN_USE | SP_FLAG_DELETED)) == SP_FLAG_IN_USE;
+}
+
+char *sp_getname(struct sp_dirent *e, char *s)
+{
+        struct dirent d;
+        memcpy(d.name, e->name, sizeof(d.name));
+        memcpy(d.suffix, e->suffix, sizeof(d.suffix));
+        return getname(&d, s);
+}
+
+void sp_putname(struct sp_dirent *e, char *name)
+{
+        struct dirent d;
+        putname(&d, name);
+        memcpy(e->name, d.name, sizeof(e->name));
+        memcpy(e->suffix, d.suffix, sizeof(e->suffix));
+}
+
+/* Find entry for name in a loaded directory, or -1 */
+
+int sp_find(struct sp_dir *dir, char *name)
+{
+        char s[NAME_SIZE];
+        int n;
+        for (n = 1; n != sp_entries(dir); ++n)
+                if (sp_in_use(SP_ENTRY(dir, n)) && !strcmp(sp_getname(SP_ENTRY(dir, n), s), name))
+                        return n;
+        return -1;
+}
+
+/* find_file() and find_dir() for SpartaDOS: subdir is SP_FLAG_SUBDIR to
+ * find a directory, else 0.  Returns the sector map. */
+
+int sp_find_file(struct atr_volume *vol, char *name, int subdir, int del, char *new_name)
+{
+        struct sp_dir dir;
+        struct sp_dirent *e;
+        int n, map = -1;
+        if (sp_open_dir(vol, vol->dir_sect, &dir)) {
+                fprintf(vol->err, " (trying to read directory)\n");
+                sp_close_dir(&dir);
+                return -1;
+        }
+        n = sp_find(&dir, name);
+        if (n != -1 && (SP_ENTRY(&dir, n)->flag & SP_FLAG_SUBDIR) == subdir) {
+                e = SP_ENTRY(&dir, n);
+                map = get16(&e->map_lo);
+                vol->found_len = get24(e->len);
+                if (del)
+                        e->flag = SP_FLAG_DELETED;
+                if (new_name)
+                        sp_putname(e, new_name);
+                if (del || new_name)
+                        sp_write(vol, &dir.f, (long)n * SP_ENTRY_SIZE, (unsigned char *)e, SP_ENTRY_SIZE);
+        }
+        sp_close_dir(&dir);
+        return map;
+}
+
+/* Find a file, return number of its first sector */
+/* If del is set, mark directory for deletion */
+
+int find_file(struct atr_volume *vol, char *filename, int del, char *new_name)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int x, y;
+        if (vol->fs == FS_SPARTA)
+                return sp_find_file(vol, filename, 0, del, new_name);
+        for (x = vol->dir_sect; x != vol->dir_sect + SECTOR_DIR_SIZE; ++x) {
+                int y;
+                if (getsect(vol, buf, x)) {
+                        fprintf(vol->err, " (trying to read directory)\n");
+                        goto done;
+                }
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(buf + y);
+                        /* OSS OS/A+ disks put junk after first never used directory entry */
+                        if (!(d->flag & (FLAG_IN_USE | FLAG_DELETED)))
+                                goto done;
+                        if ((d->flag & FLAG_IN_USE) && !(d->flag & FLAG_SUBDIR)) {
+                                char s[NAME_SIZE];
+                                if (!strcmp(getname(d, s), filename)) {
+                                        if (del) {
+                                                d->flag = 0x80;
+                                                putsect(vol, buf, x);
+                                        }
+                                        if (new_name) {
+                                                putname(d, new_name);
+                                                putsect(vol, buf, x);
+                                        }
+                                        return (d->start_hi << 8) + d->start_lo;
+                                }
+                        }
+                }
+        }
+        done:
+        return -1;
+}
+
+/* Find a subdirectory in the current directory, return its first sector */
+
+int find_dir(struct atr_volume *vol, char *name)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int x, y;
+        if (vol->fs == FS_SPARTA)
+                return sp_find_file(vol, name, SP_FLAG_SUBDIR, 0, NULL);
+        for (x = vol->dir_sect; x != vol->dir_sect + SECTOR_DIR_SIZE; ++x) {
+                if (getsect(vol, buf, x)) {
+                        fprintf(vol->err, " (trying to read directory)\n");
+                        return -1;
+                }
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(buf + y);
+                        char s[NAME_SIZE];
+                        if (!(d->flag & (FLAG_IN_USE | FLAG_DELETED)))
+                                return -1;
+                        if ((d->flag & FLAG_IN_USE) && (d->flag & FLAG_SUBDIR) && !strcmp(getname(d, s), name))
+                                return (d->start_hi << 8) + d->start_lo;
+                }
+        }
+        return -1;
+}
+
+/* Go into a subdirectory of the current directory */
+
+int sub_dir(struct atr_volume *vol, char *name)
+{
+        int sect = find_dir(vol, name);
+        if (sect <= 0 || sect + (vol->fs == FS_SPARTA ? 1 : SECTOR_DIR_SIZE) > vol->disk_size) {
+                fprintf(vol->err, "Directory '%s' not found\n", name);
+                vol->status = 1;
+                return -1;
+        }
+        vol->dir_sect = sect;
+        return 0;
+}
+
+/* Follow a MyDOS or SpartaDOS path (names separated by '/' or '>') from
+ * the root directory.  The last directory named becomes the current
+ * directory and the rest of the path is returned, or 0 if a directory
+ * isn't there. */
+
+char *enter_path(struct atr_volume *vol, char *path)
+{
+        char name[NAME_SIZE];
+        char *p;
+        vol->dir_sect = vol->root_sect;
+        while ((p = strpbrk(path, "/>"))) {
+                int len = p - path;
+                snprintf(name, sizeof(name), "%.*s", len, path);
+                if (len && sub_dir(vol, name))
+                        return 0;
+                path = p + 1;
+        }
+        return path;
+}
+
+/* Make the directory named by path the current directory */
+
+int change_dir(struct atr_volume *vol, char *path)
+{
+        char *name = enter_path(vol, path);
+        if (!name)
+                return -1;
+        if (*name && sub_dir(vol, name))
+                return -1;
+        return 0;
+}
+
+/* Text translation
+ *
+ * Files are translated in chunks of several sectors: on the way out the data
+ * bytes of consecutive sectors are gathered into one buffer, on the way in
+ * the local file is read a buffer at a time and then handed out a sector at
+ * a time.  The EOL and tab swaps use SSE2 where we have it and 64-bit SWAR
+ * otherwise.
+ */
+
+#define XLAT_RAW 0 /* No translation */
+#define XLAT_EOL 1 /* 0x9B <-> 0x0A (-l) */
+#define XLAT_TAB 2 /* Same plus 0x7F <-> 0x09 (-t) */
+#define XLAT_UTF8 3 /* ATASCII <-> UTF-8, including EOL and tab (-u) */
+
+#define XLAT_CHUNK 8192 /* Bytes translated at a time */
+
+#define ATASCII_EOL 0x9B
+#define ATASCII_TAB 0x7F
+
+/* Unicode for ATASCII 0x00 - 0x7F.  Unicode has no inverse video, so
+ * inverse video characters (0x80 - 0xFF, other than EOL) go to the private
+ * use area at ATASCII_INVERSE + the character: U+E080 - U+E0FF.  They come
+ * back from there on the way in. */
+
+#define ATASCII_INVERSE 0xE000
+
+unsigned short atascii_uni[128] = {
+        0x2665, 0x251C, 0x2595, 0x2518, 0x2524, 0x2510, 0x2571, 0x2572, /* 00 */
+        0x25E2, 0x2597, 0x25E3, 0x259D, 0x2598, 0x2594, 0x2581, 0x2596,
+        0x2663, 0x250C, 0x2500, 0x253C, 0x25CF, 0x2584, 0x258E, 0x252C, /* 10 */
+        0x2534, 0x258C, 0x2514, 0x241B, 0x2191, 0x2193, 0x2190, 0x2192,
+        ' ', '!', '"', '#', '$', '%', '&', '\'', '(', ')', '*', '+', ',', '-', '.', '/',
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', ':', ';', '<', '=', '>', '?',
+        '@', 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
+        'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', '[', '\\', ']', '^', '_',
+        0x25C6, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+        'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', 0x2660, '|', 0x21B0, 0x25C0, 0x25B6
+};
+
+/* Replace every from byte with to */
+
+void xlat_replace(unsigned char *buf, int len, unsigned char from, unsigned char to)
+{
+        int x = 0;
+#ifdef __SSE2__
+        __m128i f = _mm_set1_epi8((char)from);
+        __m128i t = _mm_set1_epi8((char)to);
+        for (; x + 16 <= len; x += 16) {
+                __m128i v = _mm_loadu_si128((__m128i *)(buf + x));
+                __m128i m = _mm_cmpeq_epi8(v, f);
+                v = _mm_or_si128(_mm_andnot_si128(m, v), _mm_and_si128(m, t));
+                _mm_storeu_si128((__m128i *)(buf + x), v);
+        }
+#else
+        uint64_t lo7 = 0x7F7F7F7F7F7F7F7FULL;
+        uint64_t f = from * 0x0101010101010101ULL;
+        uint64_t t = to * 0x0101010101010101ULL;
+        for (; x + 8 <= len; x += 8) {
+                uint64_t v, z, m;
+                memcpy(&v, buf + x, 8);
+                z = v ^ f;
+                /* High bit set in each byte of z that is zero */
+                m = ~(((z & lo7) + lo7) | z | lo7);
+                if (m) {
+                        m = (m >> 7) * 0xFF;
+                        v = (v & ~m) | (t & m);
+                        memcpy(buf + x, &v, 8);
+                }
+        }
+#endif
+        for (; x != len; ++x)
+                if (buf[x] == from)
+                        buf[x] = to;
+}
+
+/* Output side: ATASCII to local text */
+
+struct xlat_out {
+        FILE *f;
+        int mode;
+        int len;
+        unsigned char buf[XLAT_CHUNK];
+};
+
+void xlat_out_init(struct xlat_out *out, FILE *f, int mode)
+{
+        out->f = f;
+        out->mode = mode;
+        out->len = 0;
+}
+
+int xlat_flush(struct xlat_out *out)
+{
+        int len = out->len;
+        out->len = 0;
+        if (!len)
+                return 0;
+        if (out->mode == XLAT_UTF8) {
+                unsigned char u[XLAT_CHUNK * 3];
+                int n = 0;
+                int x;
+                for (x = 0; x != len; ++x) {
+                        int c = out->buf[x];
+                        int uc;
+                        if (c == ATASCII_EOL)
+                                uc = '\n';
+                        else if (c == ATASCII_TAB)
+                                uc = '\t';
+                        else if (c & 0x80)
+                                uc = ATASCII_INVERSE + c;
+                        else
+                                uc = atascii_uni[c];
+                        if (uc < 0x80) {
+                                u[n++] = uc;
+                        } else if (uc < 0x800) {
+                                u[n++] = 0xC0 | (uc >> 6);
+                                u[n++] = 0x80 | (uc & 0x3F);
+                        } else {
+                                u[n++] = 0xE0 | (uc >> 12);
+                                u[n++] = 0x80 | ((uc >> 6) & 0x3F);
+                                u[n++] = 0x80 | (uc & 0x3F);
+                        }
+                }
+                return (n == fwrite(u, 1, n, out->f)) ? 0 : -1;
+        }
+        if (out->mode != XLAT_RAW)
+                xlat_replace(out->buf, len, ATASCII_EOL, '\n');
+        if (out->mode == XLAT_TAB)
+                xlat_replace(out->buf, len, ATASCII_TAB, '\t');
+        return (len == fwrite(out->buf, 1, len, out->f)) ? 0 : -1;
+}
+
+int xlat_write(struct xlat_out *out, unsigned char *data, int len)
+{
+        while (len) {
+                int amnt = XLAT_CHUNK - out->len;
+                if (amnt > len)
+                        amnt = len;
+                memcpy(out->buf + out->len, data, amnt);
+                out->len += amnt;
+                data += amnt;
+                len -= amnt;
+                if (out->len == XLAT_CHUNK && xlat_flush(out))
+                        return -1;
+        }
+        return 0;
+}
+
+/* Input side: local text to ATASCII */
+
+struct xlat_in {
+        FILE *f;
+        int mode;
+        int len; /* Translated bytes in buf */
+        int pos; /* Next one to hand out */
+        int uni; /* Partial UTF-8 character */
+        int need; /* Continuation bytes it still needs */
+        unsigned char buf[XLAT_CHUNK];
+};
+
+void xlat_in_init(struct xlat_in *in, FILE *f, int mode)
+{
+        in->f = f;
+        in->mode = mode;
+        in->len = 0;
+        in->pos = 0;
+        in->uni = 0;
+        in->need = 0;
+}
+
+/* Map a Unicode character to ATASCII */
+
+int uni_atascii(int uc)
+{
+        int x;
+        if (uc == '\n')
+                return ATASCII_EOL;
+        if (uc == '\t')
+                return ATASCII_TAB;
+        if (uc < 0x80)
+                return uc;
+        if (uc >= ATASCII_INVERSE + 0x80 && uc <= ATASCII_INVERSE + 0xFF)
+                return uc - ATASCII_INVERSE;
+        for (x = 0; x != 128; ++x)
+                if (atascii_uni[x] == uc)
+                        return x;
+        return '?';
+}
+
+/* Decode UTF-8 in place.  Each character becomes one byte, so the output
+ * never overtakes the input.  Bytes that are not valid UTF-8 pass through. */
+
+int xlat_utf8(struct xlat_in *in, unsigned char *buf, int len)
+{
+        int n = 0;
+        int x;
+        for (x = 0; x != len; ++x) {
+                int c = buf[x];
+                if (in->need) {
+                        if ((c & 0xC0) == 0x80) {
+                                in->uni = (in->uni << 6) | (c & 0x3F);
+                                if (!--in->need)
+                                        buf[n++] = uni_atascii(in->uni);
+                                continue;
+                        }
+                        /* Truncated sequence */
+                        in->need = 0;
+                        buf[n++] = '?';
+                }
+                if (c < 0x80) {
+                        buf[n++] = uni_atascii(c);
+                } else if ((c & 0xE0) == 0xC0) {
+                        in->uni = (c & 0x1F);
+                        in->need = 1;
+                } else if ((c & 0xF0) == 0xE0) {
+                        in->uni = (c & 0x0F);
+                        in->need = 2;
+                } else if ((c & 0xF8) == 0xF0) {
+                        in->uni = (c & 0x07);
+                        in->need = 3;
+                } else {
+                        buf[n++] = c;
+                }
+        }
+        return n;
+}
+
+/* Read up to len translated bytes, returns number read (0 at end of file) */
+
+int xlat_read(struct xlat_in *in, unsigned char *data, int len)
+{
+        int got = 0;
+        while (got != len) {
+                int amnt;
+                if (in->pos == in->len) {
+                        in->pos = 0;
+                        in->len = fread(in->buf, 1, XLAT_CHUNK, in->f);
+                        if (!in->len)
+                                break;
+                        if (in->mode == XLAT_UTF8) {
+                                in->len = xlat_utf8(in, in->buf, in->len);
+                                continue;
+                        }
+                        if (in->mode != XLAT_RAW)
+                                xlat_replace(in->buf, in->len, '\n', ATASCII_EOL);
+                        if (in->mode == XLAT_TAB)
+                                xlat_replace(in->buf, in->len, '\t', ATASCII_TAB);
+                }
+                amnt = in->len - in->pos;
+                if (amnt > len - got)
+                        amnt = len - got;
+                memcpy(data + got, in->buf + in->pos, amnt);
+                in->pos += amnt;
+                got += amnt;
+        }
+        return got;
+}
+
+/* Parse a translation option, returns true if it was one */
+
+int xlat_opt(struct atr_volume *vol, char *s)
+{
+        if (!strcmp(s, "-l"))
+                vol->xlat = XLAT_EOL;
+        else if (!strcmp(s, "-t"))
+                vol->xlat = XLAT_TAB;
+        else if (!strcmp(s, "-u"))
+                vol->xlat = XLAT_UTF8;
+        else
+                return 0;
+        return 1;
+}
+
+/* Read a file */
+
+void read_file(struct atr_volume *vol, int sector, FILE *f)
+{
+        struct xlat_out out;
+        int count = 0;
+
+        xlat_out_init(&out, f, vol->xlat);
+
+        if (vol->fs == FS_SPARTA) {
+                /* Length is in the directory entry, the map only has sectors */
+                struct sp_file sf;
+                unsigned char buf[XLAT_CHUNK];
+                long pos;
+                if (!sp_load(vol, sector, &sf))
+                        for (pos = 0; pos < vol->found_len; pos += XLAT_CHUNK) {
+                                long len = vol->found_len - pos < XLAT_CHUNK ? vol->found_len - pos : XLAT_CHUNK;
+                                long got = sp_read(vol, &sf, pos, buf, len);
+                                if (got > 0)
+                                        xlat_write(&out, buf, got);
+                                if (got != len) {
+                                        fprintf(vol->err, " (file is shorter than its directory entry says)\n");
+                                        vol->status = 1;
+                                        break;
+                                }
+                        }
+                sp_free(&sf);
+                xlat_flush(&out);
+                return;
+        }
+
+        do {
+                unsigned char buf[DD_SECTOR_SIZE];
+                int next;
+                int file_no;
+                int bytes;
+
+                if (count == max_chain(vol)) {
+                        fprintf(vol->err, " (file too long)\n");
+                        vol->status = 1;
+                        break;
+                }
+                if (getsect(vol, buf, sector)) {
+                        fprintf(vol->err, " (trying to read from file)\n");
+                        vol->status = 1;
+                        break;
+                }
+                ++count;
+
+                next = get_link(vol, buf);
+                file_no = ((buf[vol->data_file_num] >> 2) & 0x3F);
+                bytes = buf[vol->data_bytes];
+
+                // printf("Sector %d: next=%d, bytes=%d, file_no=%d, short=%d\n",
+                //        sector, next, bytes, file_no, short_sect);
+
+                xlat_write(&out, buf, bytes);
+
+                sector = next;
+        } while(sector);
+        xlat_flush(&out);
+}
+
+/* cat a file */
+
+int cat(struct atr_volume *vol, char *name)
+{
+        int sector = find_file(vol, name, 0, NULL);
+        if (sector == -1) {
+                fprintf(vol->err, "File '%s' not found\n", name);
+                return -1;
+        } else {
+                /* printf("Found file.  First sector of file is %d\n", sector); */
+                read_file(vol, sector, vol->out);
+                return vol->status;
+        }
+}
+
+/* get a file from the disk */
+
+int get_file(struct atr_volume *vol, char *atari_name, char *local_name)
+{
+        int sector = find_file(vol, atari_name, 0, NULL);
+        if (sector == -1) {
+                fprintf(vol->err, "File '%s' not found\n", atari_name);
+                return -1;
+        } else {
+                FILE *f = fopen(local_name, "w");
+                if (!f) {
+                        fprintf(vol->err, "Couldn't open local file '%s'\n", local_name);
+                        return -1;
+                }
+                /* printf("Found file.  First sector of file is %d\n", sector); */
+                read_file(vol, sector, f);
+                if (fclose(f)) {
+                        fprintf(vol->err, "Couldn't close local file '%s'\n", local_name);
+                        return -1;
+                }
+                return vol->status;
+        }
+}
+
+/* Mark sectors of a file free in bitmap */
+
+void free_chain(struct atr_volume *vol, struct bitmap *bitmap, int sector)
+{
+        int count = 0;
+
+        if (vol->fs == FS_SPARTA) {
+                /* sector is the first map sector */
+                struct sp_file sf;
+                int x;
+                if (sp_load(vol, sector, &sf))
+                        fprintf(vol->err, " (while deleting a file)\n");
+                for (x = 0; x != sf.ndata; ++x)
+                        if (sf.data[x] && sf.data[x] < vol->disk_size)
+                                mark_space(bitmap, sf.data[x], 0);
+                for (x = 0; x != sf.nmaps; ++x)
+                        mark_space(bitmap, sf.maps[x], 0);
+                sp_free(&sf);
+                return;
+        }
+
+        do {
+                unsigned char buf[DD_SECTOR_SIZE];
+                int next;
+
+                if (count == max_chain(vol)) {
+                        fprintf(vol->err, " (file too long)\n");
+                        break;
+                }
+                if (getsect(vol, buf, sector)) {
+                        fprintf(vol->err, " (while deleting a file)\n");
+                        break;
+                }
+                ++count;
+
+                next = get_link(vol, buf);
+
+                mark_space(bitmap, sector, 0);
+
+                sector = next;
+        } while(sector);
+}
+
+/* Delete file */
+
+int del_file(struct atr_volume *vol, int sector)
+{
+        struct bitmap bitmap;
+        if (getmap(vol, &bitmap, 0))
+                return -1;
+        free_chain(vol, &bitmap, sector);
+        return putmap(vol, &bitmap);
+}
+
+/* Delete file name */
+
+int rm(struct atr_volume *vol, char *name, int ignore)
+{
+        int first_sect = find_file(vol, name, 1, NULL);
+        if (first_sect != -1) {
+                if (del_file(vol, first_sect)) {
+                        fprintf(vol->err, "Error deleting file '%s'\n", name);
+                        return -1;
+                } else {
+                        return vol->status;
+                }
+        } else {
+                if (!ignore) {
+                        fprintf(vol->err, "File '%s' not found\n", name);
+                        vol->status = 1;
+                }
+                return -1;
+        }
+}
+
+/* Count free sectors */
+
+int amount_free(struct atr_volume *vol, struct bitmap *bitmap)
+{
+        return count_free(bitmap, 0, vol->disk_size);
+}
+
+/* Free command */
+
+int do_free(struct atr_volume *vol)
+{
+        int amount;
+        struct bitmap bitmap;
+        if (getmap(vol, &bitmap, 0))
+                return -1;
+        amount = amount_free(vol, &bitmap);
+        fprintf(vol->out, "%d free sectors, %d free bytes\n", amount, amount * vol->sector_size);
+        return 0;
+}
+
+/* Check reads every sector of the image once, in order, and keeps just the
+ * link fields.  Files are then followed through this table, so nothing is
+ * read twice and the disk is never read out of order.  A MyDOS volume may be
+ * mostly empty, so there only the sectors the files use are read, as the
+ * chains reach them. */
+
+#define LINK_SECTS 1024 /* Sectors a 10-bit link can reach */
+
+struct check_sect {
+        int next; /* Next sector in chain */
+        unsigned char file_no; /* File number in sector */
+        unsigned char bytes; /* Data bytes in sector */
+        char ok; /* Set if sector is in the image */
+        char owner; /* File which uses sector, 64 if reserved, -1 if free */
+        char *name; /* Name of that file */
+};
+
+/* Number of table entries: every sector a link can reach */
+
+int check_size(struct atr_volume *vol)
+{
+        return vol->disk_size > LINK_SECTS ? vol->disk_size : LINK_SECTS;
+}
+
+/* Fill in table entry for a sector, returns false if it's not in the image */
+
+int read_link(struct atr_volume *vol, struct check_sect *tab, int x)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int size;
+        if (sect_offset(vol, x, &size) + size > vol->disk_map_size || getsect(vol, buf, x))
+                return 0;
+        tab[x].next = get_link(vol, buf);
+        tab[x].file_no = get_file_no(vol, buf);
+        tab[x].bytes = buf[vol->data_bytes];
+        tab[x].ok = 1;
+        return 1;
+}
+
+void read_links(struct atr_volume *vol, struct check_sect *tab)
+{
+        int x;
+        for (x = 0; x != check_size(vol); ++x) {
+                tab[x].ok = 0;
+                tab[x].owner = -1;
+                tab[x].name = 0;
+        }
+        if (vol->fs == FS_DOS2)
+                for (x = 1; x != LINK_SECTS; ++x)
+                        if (!read_link(vol, tab, x))
+                                break;
+}
+
+/* Check a single file */
+
+int check_file(struct atr_volume *vol, struct dirent *d, int file_no, struct check_sect *tab)
+{
+        unsigned char fbuf[DD_SECTOR_SIZE];
+        char namebuf[NAME_SIZE];
+        char *filename = strdup(getname(d, namebuf));
+        int upddir = 0;
+        int sector;
+        int sects;
+        int count = 0;
+        sector = (d->start_hi << 8) + d->start_lo;
+        sects = (d->count_hi << 8) + d->count_lo;
+        report(vol, "Checking %s (file_no %d)\n", filename, file_no);
+        if (d->flag & FLAG_OPENED) {
+                report(vol, "  ** Warning: file is marked as opened\n");
+                if (finding(vol, "opened", filename, 0, -1, -1, FIND_SAFE)) {
+                        d->flag &= ~FLAG_OPENED;
+                        upddir = 1;
+                }
+        }
+        do {
+                struct check_sect *t;
+                int next;
+                ++count;
+                if (count == max_chain(vol)) {
+                        fprintf(vol->err, " (file too long)\n");
+                        finding(vol, "too_long", filename, 0, -1, -1, FIND_NOFIX);
+                        vol->status = 1;
+                        break;
+                }
+                if (sector >= check_size(vol) ||
+                    (!tab[sector].ok && (vol->fs == FS_DOS2 || !sector || !read_link(vol, tab, sector)))) {
+                        /* Not in the image: let getsect() say why */
+                        getsect(vol, fbuf, sector);
+                        fprintf(vol->err, " (reading file)\n");
+                        free(filename);
+                        return -1;
+                }
+                t = &tab[sector];
+                if (t->owner != -1) {
+                        fprintf(vol->err, "  ** Uh oh.. sector %d already in use by %s (%d)\n", sector, t->name ? t->name : "reserved", t->owner);
+                        ++vol->crosslinks;
+                        vol->status = 1;
+                        finding(vol, "crosslink", filename, sector, t->owner, -1, FIND_NOFIX);
+                }
+                if (t->name == filename) {
+                        fprintf(vol->err, "  ** Warning: Infinite linked list detected\n");
+                        finding(vol, "loop", filename, sector, -1, -1, FIND_NOFIX);
+                        vol->status = 1;
+                        break;
+                }
+                t->owner = file_no;
+                t->name = filename;
+                next = t->next;
+                if (!vol->link16 && t->file_no != file_no) {
+                        fprintf(vol->err, "  ** Warning: Sector %d claims to belong to file %d\n", sector, t->file_no);
+                        vol->status = 1;
+                        if (finding(vol, "file_no", filename, sector, t->file_no, file_no, FIND_UNSAFE) &&
+                            !getsect(vol, fbuf, sector)) {
+                                set_file_no(vol, fbuf, file_no);
+                                putsect(vol, fbuf, sector);
+                                t->file_no = file_no;
+                                vol->fixes = 1;
+                        }
+                }
+                if (next) {
+                        if (t->bytes != vol->data_size) {
+                                fprintf(vol->err, "  ** Warning: Sector %d is short\n", sector);
+                                finding(vol, "short", filename, sector, t->bytes, vol->data_size, FIND_NOFIX);
+                        }
+                } else {
+                        if (t->bytes == 0) {
+                                fprintf(vol->err, "  ** Warning: Sector %d (last sector of file) is empty\n", sector);
+                                finding(vol, "empty", filename, sector, -1, -1, FIND_NOFIX);
+                        }
+                }
+                sector = next;
+        } while (sector);
+        if (count != sects) {
+                fprintf(vol->err, "  ** Warning: size in directory (%d) does not match size on disk (%d) for file %s\n",
+                       sects, count, filename);
+                vol->status = 1;
+                if (finding(vol, "size", filename, 0, sects, count, FIND_SAFE)) {
+                        d->count_hi = (0xFF & (count >> 8));
+                        d->count_lo = (0xFF & count);
+                        upddir = 1;
+                }
+        }
+        report(vol, "  Found %d sectors\n", count);
+        return upddir;
+}
+
+/* Check a MyDOS subdirectory entry: its directory sectors belong to it.
+ * Returns the first of them, or 0 if we shouldn't go in. */
+
+int check_subdir(struct atr_volume *vol, struct dirent *d, int file_no, struct check_sect *tab)
+{
+        char namebuf[NAME_SIZE];
+        char *name = strdup(getname(d, namebuf));
+        int sector = (d->start_hi << 8) + d->start_lo;
+        int x;
+        report(vol, "Checking directory %s (file_no %d)\n", name, file_no);
+        if (sector <= 0 || sector + SECTOR_DIR_SIZE > vol->disk_size) {
+                fprintf(vol->err, "  ** Directory sector %d is out of range\n", sector);
+                finding(vol, "dir_range", name, sector, -1, -1, FIND_NOFIX);
+                vol->status = 1;
+                return 0;
+        }
+        for (x = sector; x != sector + SECTOR_DIR_SIZE; ++x)
+                if (tab[x].owner != -1) {
+                        /* Don't go in: it could be one we are already in */
+                        fprintf(vol->err, "  ** Uh oh.. sector %d already in use by %s (%d)\n", x, tab[x].name ? tab[x].name : "reserved", tab[x].owner);
+                        ++vol->crosslinks;
+                        vol->status = 1;
+                        finding(vol, "crosslink", name, x, tab[x].owner, -1, FIND_NOFIX);
+                        return 0;
+                }
+        for (x = sector; x != sector + SECTOR_DIR_SIZE; ++x) {
+                tab[x].owner = file_no;
+                tab[x].name = name;
+        }
+        return sector;
+}
+
+/* Check the files in a directory, and in its subdirectories */
+
+int check_dir(struct atr_volume *vol, struct check_sect *tab, int dir_sect)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int found_eod = 0;
+        int x;
+
+        for (x = dir_sect; x != dir_sect + SECTOR_DIR_SIZE; ++x) {
+                int y;
+                int upd = 0;
+                if (getsect(vol, buf, x)) {
+                        fprintf(vol->err, " (reading directory)\n");
+                        return -1;
+                }
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(buf + y);
+                        int file_no = (y / ENTRY_SIZE) + ((x - dir_sect) * SECTOR_SIZE / ENTRY_SIZE);
+                        if (!(d->flag & (FLAG_IN_USE | FLAG_DELETED))) {
+                                found_eod = 1;
+                        }
+                        if (d->flag & FLAG_IN_USE) {
+                                int r;
+                                if (found_eod == 1) {
+                                        char namebuf[NAME_SIZE];
+                                        fprintf(vol->err, "** Error: found in use directory entry after end of directory mark:\n");
+                                        finding(vol, "after_end", getname(d, namebuf), 0, -1, -1, FIND_NOFIX);
+                                        vol->status = 1;
+                                        found_eod = 2;
+                                }
+                                if (!(d->flag & FLAG_SUBDIR))
+                                        r = check_file(vol, d, file_no, tab);
+                                else if ((r = check_subdir(vol, d, file_no, tab)))
+                                        r = check_dir(vol, tab, r);
+                                if (r < 0)
+                                        return -1;
+                                upd |= r;
+                        }
+                }
+                if (upd) {
+                        report(vol, "Writing back modified directory sector...\n");
+                        putsect(vol, buf, x);
+                        report(vol, "  done.\n");
+                        vol->fixes = 1;
+                }
+        }
+        return 0;
+}
+
+/* Claim the map and data sectors of a SpartaDOS file for it.  Returns the
+ * number of sectors, or -1 if any was already in use. */
+
+int sp_claim(struct atr_volume *vol, struct check_sect *tab, struct sp_file *f, char *name)
+{
+        int count = 0;
+        int crossed = 0;
+        int x;
+        for (x = 0; x != f->nmaps + f->ndata; ++x) {
+                int sector = (x < f->nmaps ? f->maps[x] : f->data[x - f->nmaps]);
+                if (!sector)
+                        continue;
+                if (sector >= vol->disk_size) {
+                        fprintf(vol->err, "  ** Sector %d is out of range\n", sector);
+                        finding(vol, "range", name, sector, -1, -1, FIND_NOFIX);
+                        vol->status = 1;
+                        continue;
+                }
+                if (tab[sector].owner != -1) {
+                        fprintf(vol->err, "  ** Uh oh.. sector %d already in use by %s (%d)\n", sector, tab[sector].name ? tab[sector].name : "reserved", tab[sector].owner);
+                        ++vol->crosslinks;
+                        vol->status = 1;
+                        finding(vol, "crosslink", name, sector, tab[sector].owner, -1, FIND_NOFIX);
+                        crossed = 1;
+                        continue;
+                }
+                tab[sector].owner = 0;
+                tab[sector].name = name;
+                ++count;
+        }
+        return crossed ? -1 : count;
+}
+
+/* Check a SpartaDOS file: its sectors are its own and hold its length */
+
+int sp_check_file(struct atr_volume *vol, struct check_sect *tab, struct sp_dirent *e, char *name)
+{
+        struct sp_file f;
+        long len = get24(e->len);
+        int upd = 0;
+        int count;
+        report(vol, "Checking %s\n", name);
+        if (e->flag & SP_FLAG_OPENED) {
+                report(vol, "  ** Warning: file is marked as opened\n");
+                if (finding(vol, "opened", name, 0, -1, -1, FIND_SAFE)) {
+                        e->flag &= ~SP_FLAG_OPENED;
+                        upd = 1;
+                }
+        }
+        if (sp_load(vol, get16(&e->map_lo), &f)) {
+                fprintf(vol->err, "  ** Sector map of %s is bad\n", name);
+                finding(vol, "range", name, get16(&e->map_lo), -1, -1, FIND_NOFIX);
+        }
+        count = sp_claim(vol, tab, &f, name);
+        if ((long)f.ndata * vol->sector_size < len) {
+                fprintf(vol->err, "  ** Warning: length in directory (%ld) is more than its %d sectors hold\n",
+                        len, f.ndata);
+                vol->status = 1;
+                finding(vol, "size", name, 0, f.ndata, (len + vol->sector_size - 1) / vol->sector_size, FIND_NOFIX);
+        }
+        if (count >= 0)
+                report(vol, "  Found %d sectors\n", count);
+        sp_free(&f);
+        return upd;
+}
+
+/* Check the files in a SpartaDOS directory, and in its subdirectories */
+
+int sp_check_dir(struct atr_volume *vol, struct check_sect *tab, int map, char *name)
+{
+        struct sp_dir dir;
+        char namebuf[NAME_SIZE];
+        int upd = 0;
+        int n;
+
+        if (sp_open_dir(vol, map, &dir)) {
+                fprintf(vol->err, " (reading directory)\n");
+                sp_close_dir(&dir);
+                return -1;
+        }
+        /* Don't go in if it's crosslinked: it could be one we are already in */
+        if (sp_claim(vol, tab, &dir.f, name) < 0) {
+                sp_close_dir(&dir);
+                return 0;
+        }
+        for (n = 1; n != sp_entries(&dir); ++n) {
+                struct sp_dirent *e = SP_ENTRY(&dir, n);
+                char *filename;
+                int r;
+                if (!sp_in_use(e))
+                        continue;
+                filename = strdup(sp_getname(e, namebuf));
+                if (e->flag & SP_FLAG_SUBDIR) {
+                        report(vol, "Checking directory %s\n", filename);
+                        r = sp_check_dir(vol, tab, get16(&e->map_lo), filename);
+                } else {
+                        r = sp_check_file(vol, tab, e, filename);
+                }
+                if (r < 0) {
+                        sp_close_dir(&dir);
+                        return -1;
+                }
+                upd |= r;
+        }
+        if (upd) {
+                report(vol, "Writing back modified directory...\n");
+                sp_write(vol, &dir.f, 0, dir.buf, dir.len);
+                report(vol, "  done.\n");
+                vol->fixes = 1;
+        }
+        sp_close_dir(&dir);
+        return 0;
+}
+
+/* Check disk: regen bit map */
+
+int do_check(struct atr_volume *vol)
+{
+        struct bitmap bitmap;
+        struct bitmap rebuilt;
+        struct bitmap diff;
+        struct check_sect *tab;
+        int x, y;
+        int total;
+        int ok;
+        int rtn = -1;
+
+        if (vol->fs == FS_SPARTA)
+                report(vol, "Checking SpartaDOS volume (%d sectors of %d bytes)...\n", vol->disk_size - 1, vol->sector_size);
+        else if (vol->fs == FS_MYDOS)
+                report(vol, "Checking MyDOS volume (%d sectors of %d bytes)...\n", vol->disk_size - 1, vol->sector_size);
+        else if (vol->disk_size == ED_DISK_SIZE)
+                report(vol, "Checking DOS 2.5 enhanced density disk...\n");
+        else if (vol->disk_dd)
+                report(vol, "Checking DOS 2.0d double density disk...\n");
+        else
+                report(vol, "Checking DOS 2.0s single density disk...\n");
+
+        /* One pass over the image, all marked as free */
+        tab = (struct check_sect *)malloc(check_size(vol) * sizeof(struct check_sect));
+        read_links(vol, tab);
+
+        /* Mark non-existent sector 0 as allocated */
+        tab[0].owner = 64;
+
+        /* Mark VTOC and DIR, or SpartaDOS bitmap */
+        if (vol->fs == FS_SPARTA) {
+                for (x = 0; x != vol->sp_bitmap_sects; ++x)
+                        tab[vol->sp_bitmap + x].owner = 64;
+        } else {
+                tab[SECTOR_VTOC].owner = 64;
+                for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x)
+                        tab[x].owner = 64;
+        }
+
+        /* Boot loader */
+        tab[1].owner = 64;
+        tab[2].owner = 64;
+        tab[3].owner = 64;
+
+        /* Sector 720 if we have an ED disk */
+        if (vol->fs == FS_DOS2 && vol->disk_size == ED_DISK_SIZE)
+                tab[720].owner = 64;
+
+        /* Rest of the MyDOS bitmap */
+        if (vol->fs == FS_MYDOS)
+                for (x = 1; x != mydos_vtoc_sects(vol); ++x)
+                        tab[SECTOR_VTOC - x].owner = 64;
+
+        /* Step through each file */
+        if (vol->fs == FS_SPARTA ? sp_check_dir(vol, tab, vol->root_sect, "main directory") :
+            check_dir(vol, tab, SECTOR_DIR))
+                goto bad;
+
+        total = 0;
+        for (x = 0; x != vol->disk_size; ++x) {
+                if (tab[x].owner != -1) {
+                        ++total;
+//                        if (tab[x].owner == 64)
+//                                printf("%d reserved\n", x);
+//                        else {
+//                                printf("%d file number %d (%s)\n", x, tab[x].owner, tab[x].name);
+//                        }
+                }
+        }
+        report(vol, "%d sectors in use, %d sectors free\n", total, vol->disk_size - total);
+
+        report(vol, "Checking VTOC header...\n");
+        if (getmap(vol, &bitmap, 1))
+                goto bad;
+        report(vol, "Compare VTOC bitmap with reconstructed bitmap from files...\n");
+        bitmap_init(&rebuilt, vol->disk_size, 1);
+        for (x = 0; x != vol->disk_size; ++x)
+                if (tab[x].owner != -1)
+                        mark_space(&rebuilt, x, 1);
+        ok = !bitmap_diff(&diff, &bitmap, &rebuilt);
+        y = 0;
+        for (x = bitmap_next(&diff, 0, vol->disk_size); x != -1; x = bitmap_next(&diff, x + 1, vol->disk_size)) {
+                if (is_free(&bitmap, x))
+                        fprintf(vol->err, "  ** VTOC shows sector %d free, but it should be allocated\n", x);
+                else
+                        fprintf(vol->err, "  ** VTOC shows sector %d allocated, but it should be free\n", x);
+                ++vol->vtoc_errors;
+                vol->status = 1;
+                ++y;
+        }
+        if (ok) {
+                report(vol, "  It's OK.\n");
+        } else if (finding(vol, "bitmap", 0, 0, y, -1, FIND_UNSAFE)) {
+                report(vol, "Updating allocation bitmap...\n");
+                putmap(vol, &rebuilt);
+                report(vol, "  done.\n");
+                vol->fixes = 1;
+        }
+        report(vol, "All done.\n");
+        if (vol->status)
+                fprintf(vol->err, "Errors were detected\n");
+        if (vol->fixes)
+                report(vol, "Fixes were made - recommend you rerun check\n");
+        if (vol->json) {
+                fprintf(vol->json, "{\"image\":");
+                json_str(vol->json, vol->disk_name);
+                fprintf(vol->json, ",\"done\":true,\"errors\":%s,\"fixes\":%d}\n",
+                        vol->status ? "true" : "false", vol->fixes_applied);
+        }
+        rtn = vol->status;
+        bad:
+        free(tab);
+        return rtn;
+}
+
+/* Allocate space for file
+ *
+ * The free sectors are first checked to be enough, so the policies below
+ * never fail part way through.  Each fills in list[0..sects-1] in chain
+ * order and marks the sectors allocated.
+ */
+
+/* Lowest free sectors first, as DOS does */
+
+void alloc_first(struct atr_volume *vol, struct bitmap *bitmap, int *list, int sects)
+{
+        int x = 1;
+        while (sects--) {
+                x = bitmap_next(bitmap, x, vol->disk_size);
+                *list++ = x;
+                mark_space(bitmap, x, 1);
+        }
+}
+
+/* Free run of sectors */
+struct run {
+        int start;
+        int len;
+        int take; /* Number of sectors we use from it */
+};
+
+int comp_run(const void *l, const void *r)
+{
+        const struct run *a = *(const struct run **)l;
+        const struct run *b = *(const struct run **)r;
+        if (a->len != b->len)
+                return b->len - a->len;
+        return a->start - b->start;
+}
+
+/* Find the runs of free sectors in one pass */
+
+struct run *find_runs(struct atr_volume *vol, struct bitmap *bitmap, int *nruns)
+{
+        struct run *runs = (struct run *)malloc((vol->disk_size / 2 + 1) * sizeof(struct run));
+        int n = 0;
+        int x;
+        for (x = bitmap_next(bitmap, 1, vol->disk_size); x != -1;) {
+                int end = bitmap_run(bitmap, x, vol->disk_size);
+                runs[n].start = x;
+                runs[n].len = end - x;
+                runs[n].take = 0;
+                ++n;
+                x = bitmap_next(bitmap, end, vol->disk_size);
+        }
+        *nruns = n;
+        return runs;
+}
+
+/* First run the file fits in.  If there isn't one, use the fewest (largest)
+ * runs that hold it, chained in disk order. */
+
+void alloc_contig(struct atr_volume *vol, struct bitmap *bitmap, int *list, int sects)
+{
+        int nruns;
+        struct run *runs = find_runs(vol, bitmap, &nruns);
+        int x, y;
+
+        for (x = 0; x != nruns; ++x)
+                if (runs[x].len >= sects)
+                        break;
+        if (x != nruns) {
+                runs[x].take = sects;
+        } else {
+                struct run **by_len = (struct run **)malloc(nruns * sizeof(struct run *));
+                int left = sects;
+                for (x = 0; x != nruns; ++x)
+                        by_len[x] = &runs[x];
+                qsort(by_len, nruns, sizeof(struct run *), comp_run);
+                for (x = 0; left; ++x) {
+                        by_len[x]->take = (by_len[x]->len < left ? by_len[x]->len : left);
+                        left -= by_len[x]->take;
+                }
+                free(by_len);
+        }
+
+        for (x = 0; x != nruns; ++x)
+                for (y = 0; y != runs[x].take; ++y) {
+                        *list++ = runs[x].start + y;
+                        mark_space(bitmap, runs[x].start + y, 1);
+                }
+        free(runs);
+}
+
+/* Follow the rotation of the disk: after each sector, skip alloc_skew
+ * physical slots (the time the drive spends processing the sector) and take
+ * the first free sector the head reaches, moving to the next track when the
+ * current one has no free sectors left.  The default skew is the one built
+ * into the interleave map, which gives consecutive sectors where they are
+ * free; a smaller skew suits faster drives. */
+
+/* Sector to follow cur, or -1 if the disk is full */
+
+int skew_next(struct atr_volume *vol, struct bitmap *bitmap, int cur)
+{
+        int *map;
+        int track_size;
+        int pos[26]; /* Physical slot of each sector on the track */
+        int skew;
+        int track, slot;
+        int x;
+
+        if (vol->fs != FS_DOS2) {
+                /* No tracks to follow on a partition: next free sector */
+                x = bitmap_next(bitmap, cur + 1, vol->disk_size);
+                if (x == -1)
+                        x = bitmap_next(bitmap, 1, vol->disk_size);
+                return x;
+        }
+        if (vol->disk_size == ED_DISK_SIZE) {
+                map = dd_map;
+                track_size = 26;
+        } else if (vol->disk_dd) {
+                map = hd_map;
+                track_size = 18;
+        } else {
+                map = sd_map;
+                track_size = 18;
+        }
+        for (x = 0; x != track_size; ++x)
+                pos[map[x] - 1] = x;
+        if (vol->alloc_skew >= 0)
+                skew = vol->alloc_skew;
+        else
+                skew = pos[1] - pos[0] - 1;
+
+        /* Rest of this track, in the order the head reaches it */
+        track = (cur - 1) / track_size;
+        slot = pos[(cur - 1) % track_size] + 1 + skew;
+        for (x = 0; x != track_size; ++x) {
+                int sect = track * track_size + map[(slot + x) % track_size];
+                if (sect < vol->disk_size && is_free(bitmap, sect))
+                        return sect;
+        }
+
+        /* Else the next track with free space.  Tracks are not skewed
+         * against each other, so take its lowest free sector. */
+        x = bitmap_next(bitmap, (track + 1) * track_size + 1, vol->disk_size);
+        if (x == -1)
+                x = bitmap_next(bitmap, 1, vol->disk_size);
+        return x;
+}
+
+/* The file starts where alloc_contig would put it */
+
+void alloc_skew(struct atr_volume *vol, struct bitmap *bitmap, int *list, int sects)
+{
+        int nruns;
+        struct run *runs = find_runs(vol, bitmap, &nruns);
+        int cur;
+        int x;
+
+        for (x = 0; x != nruns; ++x)
+                if (runs[x].len >= sects)
+                        break;
+        cur = (x != nruns ? runs[x].start : runs[0].start);
+        free(runs);
+
+        for (;;) {
+                *list++ = cur;
+                mark_space(bitmap, cur, 1);
+                if (!--sects)
+                        break;
+                cur = skew_next(vol, bitmap, cur);
+        }
+}
+
+/* Allocate one more sector for a file of unknown size: prev is the last
+ * sector allocated to it, or 0 for the first.  Without the size we start
+ * at the largest free run.  Returns -1 if the disk is full. */
+
+int alloc_next(struct atr_volume *vol, struct bitmap *bitmap, int prev)
+{
+        int sect;
+        if (vol->alloc_policy == ALLOC_FIRST) {
+                sect = bitmap_next(bitmap, 1, vol->disk_size);
+        } else if (!prev) {
+                int nruns;
+                struct run *runs = find_runs(vol, bitmap, &nruns);
+                int x, best = 0;
+                for (x = 1; x < nruns; ++x)
+                        if (runs[x].len > runs[best].len)
+                                best = x;
+                sect = (nruns ? runs[best].start : -1);
+                free(runs);
+        } else if (vol->alloc_policy == ALLOC_SKEW) {
+                sect = skew_next(vol, bitmap, prev);
+        } else {
+                sect = bitmap_next(bitmap, prev + 1, vol->disk_size);
+                if (sect == -1)
+                        sect = bitmap_next(bitmap, 1, vol->disk_size);
+        }
+        if (sect != -1)
+                mark_space(bitmap, sect, 1);
+        return sect;
+}
+
+int alloc_space(struct atr_volume *vol, struct bitmap *bitmap, int *list, int sects)
+{
+        if (count_free(bitmap, 1, vol->disk_size) < sects) {
+                fprintf(vol->err, "Not enough space\n");
+                vol->status = 1;
+                return -1;
+        }
+        if (!sects)
+                return 0;
+        switch (vol->alloc_policy) {
+                case ALLOC_FIRST:
+                        alloc_first(vol, bitmap, list, sects);
+                        break;
+                case ALLOC_SKEW:
+                        alloc_skew(vol, bitmap, list, sects);
+                        break;
+                default:
+                        alloc_contig(vol, bitmap, list, sects);
+                        break;
+        }
+        return 0;
+}
+
+/* Parse allocation policy: first, contig, skew or skew:N */
+
+int set_alloc(struct atr_volume *vol, char *s)
+{
+        if (!strcmp(s, "first"))
+                vol->alloc_policy = ALLOC_FIRST;
+        else if (!strcmp(s, "contig"))
+                vol->alloc_policy = ALLOC_CONTIG;
+        else if (!strcmp(s, "skew"))
+                vol->alloc_policy = ALLOC_SKEW;
+        else if (!strncmp(s, "skew:", 5) && s[5] >= '0' && s[5] <= '9') {
+                vol->alloc_policy = ALLOC_SKEW;
+                vol->alloc_skew = atoi(s + 5);
+        } else {
+                fprintf(vol->err, "Unknown allocation policy '%s'\n", s);
+                return -1;
+        }
+        return 0;
+}
+
+/* Writing files is done as one transaction: the directory and bitmap are
+ * loaded once, every file is planned (old copy deleted, directory entry and
+ * sectors allocated), then the data is written.  The directory sectors and
+ * VTOC are written once at the end.  Sectors go through the cache, so they
+ * reach the image in ascending order when it is flushed. */
+
+struct put_plan {
+        char *local_name;
+        char *atari_name;
+        long size; /* Size of local file */
+        int sects; /* Number of sectors */
+        int file_no; /* Directory entry, -1 if file is skipped */
+        int old_flag; /* What was in the directory entry before */
+        int *list; /* Allocated sectors */
+        int stream; /* Set if size is unknown (stdin or a pipe) */
+        int start; /* First sector of a stream */
+};
+
+/* Write data of a planned file */
+
+int write_plan(struct atr_volume *vol, struct put_plan *plan)
+{
+        FILE *f = fopen(plan->local_name, "r");
+        struct xlat_in in;
+        long size = plan->size;
+        int x;
+        if (!f) {
+                fprintf(vol->err, "Couldn't open '%s'\n", plan->local_name);
+                vol->status = 1;
+                return -1;
+        }
+        xlat_in_init(&in, f, vol->xlat);
+        for (x = 0; x != plan->sects; ++x) {
+                unsigned char bf[DD_SECTOR_SIZE];
+                int len = size < vol->data_size ? size : vol->data_size;
+                memset(bf, 0, sizeof(bf));
+                if (len != xlat_read(&in, bf, len)) {
+                        fprintf(vol->err, "Couldn't read file '%s'\n", plan->local_name);
+                        vol->status = 1;
+                }
+                if (x + 1 == plan->sects) {
+                        // Last sector
+                        set_link(vol, bf, 0);
+                } else {
+                        set_link(vol, bf, plan->list[x + 1]);
+                }
+                bf[vol->data_bytes] = len;
+                set_file_no(vol, bf, plan->file_no);
+                size -= len;
+                putsect(vol, bf, plan->list[x]);
+        }
+        fclose(f);
+        return 0;
+}
+
+/* Write a file whose size we don't know.  Sectors are allocated as the data
+ * arrives; each is held back until the next chunk shows where its link
+ * should point. */
+
+int write_stream(struct atr_volume *vol, struct put_plan *plan, struct bitmap *bitmap)
+{
+        FILE *f = (strcmp(plan->local_name, "-") ? fopen(plan->local_name, "r") : stdin);
+        struct xlat_in in;
+        unsigned char bf[DD_SECTOR_SIZE]; /* Last sector, not yet written */
+        int prev = 0;
+        if (!f) {
+                fprintf(vol->err, "Couldn't open '%s'\n", plan->local_name);
+                vol->status = 1;
+                return -1;
+        }
+        xlat_in_init(&in, f, vol->xlat);
+        plan->start = 0;
+        plan->sects = 0;
+        plan->size = 0;
+        for (;;) {
+                unsigned char nbf[DD_SECTOR_SIZE];
+                int sect;
+                int len;
+                memset(nbf, 0, sizeof(nbf));
+                len = xlat_read(&in, nbf, vol->data_size);
+                if (!len)
+                        break;
+                sect = alloc_next(vol, bitmap, prev);
+                if (sect == -1) {
+                        fprintf(vol->err, "Not enough space\n");
+                        vol->status = 1;
+                        /* Give back what we got */
+                        if (prev) {
+                                set_link(vol, bf, 0);
+                                putsect(vol, bf, prev);
+                                free_chain(vol, bitmap, plan->start);
+                        }
+                        if (f != stdin)
+                                fclose(f);
+                        return -1;
+                }
+                nbf[vol->data_bytes] = len;
+                set_file_no(vol, nbf, plan->file_no);
+                if (prev) {
+                        set_link(vol, bf, sect);
+                        putsect(vol, bf, prev);
+                } else {
+                        plan->start = sect;
+                }
+                memcpy(bf, nbf, sizeof(bf));
+                prev = sect;
+                plan->size += len;
+                ++plan->sects;
+        }
+        if (prev)
+                putsect(vol, bf, prev);
+        if (ferror(f)) {
+                fprintf(vol->err, "Couldn't read file '%s'\n", plan->local_name);
+                vol->status = 1;
+        }
+        if (f != stdin)
+                fclose(f);
+        return 0;
+}
+
+/* Add sectors to a SpartaDOS file until it has ndata data sectors, and
+ * write its sector map.  f may be empty, for a new file.  The new data
+ * sectors are cleared.  If the disk fills up the file is left as it was. */
+
+int sp_grow(struct atr_volume *vol, struct bitmap *bitmap, struct sp_file *f, int ndata)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int per = (vol->sector_size - SP_MAP_DATA) / 2;
+        int nmaps = (ndata ? (ndata + per - 1) / per : 1);
+        int old_ndata = f->ndata;
+        int old_nmaps = f->nmaps;
+        int prev = (f->ndata ? f->data[f->ndata - 1] : 0);
+        int x, y;
+
+        if (nmaps < f->nmaps)
+                nmaps = f->nmaps;
+        f->data = (int *)realloc(f->data, (ndata + 1) * sizeof(int));
+        f->maps = (int *)realloc(f->maps, nmaps * sizeof(int));
+        while (f->nmaps != nmaps) {
+                int sect = alloc_next(vol, bitmap, f->nmaps ? f->maps[f->nmaps - 1] : prev);
+                if (sect == -1)
+                        goto full;
+                f->maps[f->nmaps++] = sect;
+        }
+        memset(buf, 0, sizeof(buf));
+        while (f->ndata != ndata) {
+                int sect = alloc_next(vol, bitmap, prev ? prev : f->maps[f->nmaps - 1]);
+                if (sect == -1)
+                        goto full;
+                f->data[f->ndata++] = prev = sect;
+                putsect(vol, buf, sect);
+        }
+
+        for (x = 0; x != f->nmaps; ++x) {
+                memset(buf, 0, sizeof(buf));
+                put16(buf + SP_MAP_NEXT, x + 1 != f->nmaps ? f->maps[x + 1] : 0);
+                put16(buf + SP_MAP_PREV, x ? f->maps[x - 1] : 0);
+                for (y = 0; y != per && x * per + y < f->ndata; ++y)
+                        put16(buf + SP_MAP_DATA + 2 * y, f->data[x * per + y]);
+                putsect(vol, buf, f->maps[x]);
+        }
+        return 0;
+
+        full:
+        fprintf(vol->err, "Not enough space\n");
+        vol->status = 1;
+        for (x = old_ndata; x != f->ndata; ++x)
+                mark_space(bitmap, f->data[x], 0);
+        for (x = old_nmaps; x != f->nmaps; ++x)
+                mark_space(bitmap, f->maps[x], 0);
+        f->ndata = old_ndata;
+        f->nmaps = old_nmaps;
+        return -1;
+}
+
+/* A directory grew: its length is also in its entry in the parent */
+
+int sp_set_dir_len(struct atr_volume *vol, struct sp_dir *dir, int map)
+{
+        struct sp_dir parent;
+        int parent_map = get16(&SP_ENTRY(dir, 0)->map_lo);
+        int n;
+        if (!parent_map)
+                return 0;
+        if (sp_open_dir(vol, parent_map, &parent)) {
+                fprintf(vol->err, " (trying to read parent directory)\n");
+                sp_close_dir(&parent);
+                return -1;
+        }
+        for (n = 1; n != sp_entries(&parent); ++n) {
+                struct sp_dirent *e = SP_ENTRY(&parent, n);
+                if (sp_in_use(e) && (e->flag & SP_FLAG_SUBDIR) && get16(&e->map_lo) == map) {
+                        e->len[0] = dir->len;
+                        e->len[1] = (dir->len >> 8);
+                        e->len[2] = (dir->len >> 16);
+                        sp_write(vol, &parent.f, (long)n * SP_ENTRY_SIZE, (unsigned char *)e, SP_ENTRY_SIZE);
+                        break;
+                }
+        }
+        sp_close_dir(&parent);
+        return 0;
+}
+
+/* Put one file on a SpartaDOS disk.  It's read into memory first, since
+ * its length goes in the directory entry. */
+
+int sp_put(struct atr_volume *vol, struct bitmap *bitmap, char *local_name, char *atari_name)
+{
+        FILE *f;
+        struct xlat_in in;
+        struct sp_dir dir;
+        struct sp_file sf;
+        struct sp_dirent *e;
+        struct stat st;
+        struct tm *tm;
+        time_t now;
+        unsigned char *data = 0;
+        long size = 0;
+        long alloc = 0;
+        int len, n, x;
+        int rtn = -1;
+
+        if (strcmp(local_name, "-") && (stat(local_name, &st) || S_ISDIR(st.st_mode))) {
+                fprintf(vol->err, "Couldn't get file size of '%s'\n", local_name);
+                vol->status = 1;
+                return -1;
+        }
+        f = (strcmp(local_name, "-") ? fopen(local_name, "r") : stdin);
+        if (!f) {
+                fprintf(vol->err, "Couldn't open '%s'\n", local_name);
+                vol->status = 1;
+                return -1;
+        }
+        xlat_in_init(&in, f, vol->xlat);
+        do {
+                if (size == alloc) {
+                        alloc = alloc ? alloc * 2 : XLAT_CHUNK;
+                        data = (unsigned char *)realloc(data, alloc);
+                }
+                len = xlat_read(&in, data + size, alloc - size);
+                size += len;
+        } while (len);
+        if (ferror(f) || size > 0xFFFFFF) {
+                fprintf(vol->err, "Couldn't read file '%s'\n", local_name);
+                vol->status = 1;
+                if (f != stdin)
+                        fclose(f);
+                free(data);
+                return -1;
+        }
+        if (f != stdin)
+                fclose(f);
+
+        memset(&sf, 0, sizeof(sf));
+        if (sp_open_dir(vol, vol->dir_sect, &dir)) {
+                fprintf(vol->err, " (trying to read directory)\n");
+                goto done;
+        }
+
+        /* Delete existing file, else find a free entry */
+        n = sp_find(&dir, atari_name);
+        if (n != -1) {
+                e = SP_ENTRY(&dir, n);
+                if (e->flag & SP_FLAG_SUBDIR) {
+                        fprintf(vol->err, "'%s' is a directory\n", atari_name);
+                        vol->status = 1;
+                        goto done;
+                }
+                free_chain(vol, bitmap, get16(&e->map_lo));
+                e->flag = SP_FLAG_DELETED;
+        } else {
+                for (n = 1; n != sp_entries(&dir) && sp_in_use(SP_ENTRY(&dir, n)); ++n);
+                if (n > SP_MAX_NAMES) {
+                        fprintf(vol->err, "Directory is full, couldn't write '%s'\n", atari_name);
+                        vol->status = 1;
+                        goto done;
+                }
+                if ((n + 1L) * SP_ENTRY_SIZE > dir.len) {
+                        /* Add an entry to the directory */
+                        long new_len = (n + 1L) * SP_ENTRY_SIZE;
+                        if (sp_grow(vol, bitmap, &dir.f, (new_len + vol->sector_size - 1) / vol->sector_size)) {
+                                fprintf(vol->err, "Couldn't write '%s'\n", atari_name);
+                                goto done;
+                        }
+                        dir.buf = (unsigned char *)realloc(dir.buf, new_len);
+                        memset(dir.buf + dir.len, 0, new_len - dir.len);
+                        dir.len = new_len;
+                        SP_ENTRY(&dir, 0)->len[0] = new_len;
+                        SP_ENTRY(&dir, 0)->len[1] = (new_len >> 8);
+                        SP_ENTRY(&dir, 0)->len[2] = (new_len >> 16);
+                        sp_set_dir_len(vol, &dir, vol->dir_sect);
+                }
+        }
+        e = SP_ENTRY(&dir, n);
+
+        /* Allocate and write the data */
+        if (!sp_grow(vol, bitmap, &sf, (size + vol->sector_size - 1) / vol->sector_size)) {
+                for (x = 0; x != sf.ndata; ++x) {
+                        unsigned char buf[DD_SECTOR_SIZE];
+                        long ofst = (long)x * vol->sector_size;
+                        memset(buf, 0, sizeof(buf));
+                        memcpy(buf, data + ofst, size - ofst < vol->sector_size ? size - ofst : vol->sector_size);
+                        putsect(vol, buf, sf.data[x]);
+                }
+                memset(e, 0, SP_ENTRY_SIZE);
+                e->flag = SP_FLAG_IN_USE;
+                put16(&e->map_lo, sf.maps[0]);
+                e->len[0] = size;
+                e->len[1] = (size >> 8);
+                e->len[2] = (size >> 16);
+                sp_putname(e, atari_name);
+                now = time(0);
+                tm = localtime(&now);
+                e->date[0] = tm->tm_mday;
+                e->date[1] = tm->tm_mon + 1;
+                e->date[2] = tm->tm_year % 100;
+                e->time[0] = tm->tm_hour;
+                e->time[1] = tm->tm_min;
+                e->time[2] = tm->tm_sec;
+                rtn = 0;
+        } else {
+                fprintf(vol->err, "Couldn't write file\n");
+        }
+
+        /* Directory entry is written either way: an old file of the same
+         * name is gone */
+        if (sp_write(vol, &dir.f, 0, dir.buf, dir.len))
+                rtn = -1;
+
+        done:
+        sp_close_dir(&dir);
+        sp_free(&sf);
+        free(data);
+        return rtn;
+}
+
+/* put_files() for SpartaDOS */
+
+int sp_put_files(struct atr_volume *vol, int n, char **local_names, char **atari_names)
+{
+        struct bitmap bitmap;
+        int rtn = 0;
+        int i;
+        if (getmap(vol, &bitmap, 0))
+                return -1;
+        for (i = 0; i != n; ++i)
+                if (sp_put(vol, &bitmap, local_names[i], atari_names[i]))
+                        rtn = -1;
+        if (putmap(vol, &bitmap))
+                rtn = -1;
+        return rtn ? rtn : vol->status;
+}
+
+/* Find directory entry in loaded directory */
+
+#define DIR_ENTRY(dir, n) ((struct dirent *)((dir)[(n) / (SECTOR_SIZE / ENTRY_SIZE)] + ENTRY_SIZE * ((n) % (SECTOR_SIZE / ENTRY_SIZE))))
+
+/* Put files on the disk */
+
+int put_files(struct atr_volume *vol, int n, char **local_names, char **atari_names)
+{
+        unsigned char dir[SECTOR_DIR_SIZE][DD_SECTOR_SIZE];
+        int dir_upd[SECTOR_DIR_SIZE];
+        struct bitmap bitmap;
+        struct put_plan *plans;
+        int rtn = 0;
+        int x, i;
+
+        if (vol->fs == FS_SPARTA)
+                return sp_put_files(vol, n, local_names, atari_names);
+
+        /* Load directory and bitmap */
+        for (x = 0; x != SECTOR_DIR_SIZE; ++x) {
+                dir_upd[x] = 0;
+                if (getsect(vol, dir[x], vol->dir_sect + x)) {
+                        fprintf(vol->err, " (trying to read directory)\n");
+                        vol->status = 1;
+                        return -1;
+                }
+        }
+        if (getmap(vol, &bitmap, 0))
+                return -1;
+
+        plans = (struct put_plan *)calloc(n, sizeof(struct put_plan));
+
+        /* Plan each file */
+        for (i = 0; i != n; ++i) {
+                struct put_plan *plan = &plans[i];
+                struct dirent *d;
+                struct stat st;
+                char s[NAME_SIZE];
+                int is_dir = 0; /* Set if the name is a subdirectory */
+                plan->local_name = local_names[i];
+                plan->atari_name = atari_names[i];
+                plan->file_no = -1;
+
+                if (!strcmp(plan->local_name, "-")) {
+                        plan->stream = 1;
+                } else if (stat(plan->local_name, &st) || S_ISDIR(st.st_mode)) {
+                        fprintf(vol->err, "Couldn't get file size of '%s'\n", plan->local_name);
+                        vol->status = 1;
+                        rtn = -1;
+                        continue;
+                } else if (!S_ISREG(st.st_mode) || vol->xlat == XLAT_UTF8) {
+                        /* Pipe or device, or UTF-8 which changes the size:
+                         * we find the size as we write it */
+                        plan->stream = 1;
+                } else {
+                        plan->size = st.st_size;
+                        // Round up to a multiple of (DATA_SIZE)
+                        plan->sects = (plan->size + vol->data_size - 1) / vol->data_size;
+                }
+
+                /* Delete existing file */
+                for (x = 0; x != MAX_NAMES; ++x) {
+                        d = DIR_ENTRY(dir, x);
+                        /* OSS OS/A+ disks put junk after first never used directory entry */
+                        if (!(d->flag & (FLAG_IN_USE | FLAG_DELETED)))
+                                break;
+                        if ((d->flag & FLAG_IN_USE) && !strcmp(getname(d, s), plan->atari_name)) {
+                                int y;
+                                if (d->flag & FLAG_SUBDIR) {
+                                        is_dir = 1;
+                                        break;
+                                }
+                                d->flag = FLAG_DELETED;
+                                dir_upd[x / (SECTOR_SIZE / ENTRY_SIZE)] = 1;
+                                for (y = 0; y != i; ++y)
+                                        if (plans[y].file_no == x)
+                                                break;
+                                if (y != i) {
+                                        /* Written earlier in this batch: just drop it */
+                                        int z;
+                                        for (z = 0; z != plans[y].sects; ++z)
+                                                mark_space(&bitmap, plans[y].list[z], 0);
+                                        plans[y].file_no = -1;
+                                } else if ((d->start_hi << 8) + d->start_lo) {
+                                        free_chain(vol, &bitmap, (d->start_hi << 8) + d->start_lo);
+                                }
+                                break;
+                        }
+                }
+
+                if (is_dir) {
+                        fprintf(vol->err, "'%s' is a directory\n", plan->atari_name);
+                        vol->status = 1;
+                        rtn = -1;
+                        continue;
+                }
+
+                /* Prepare directory entry */
+                for (x = 0; x != MAX_NAMES; ++x)
+                        if (!(DIR_ENTRY(dir, x)->flag & FLAG_IN_USE))
+                                break;
+                if (x == MAX_NAMES) {
+                        fprintf(vol->err, "Directory is full, couldn't write '%s'\n", plan->atari_name);
+                        vol->status = 1;
+                        rtn = -1;
+                        continue;
+                }
+
+                /* Allocate space, except for streams which get it as they
+                 * are written */
+                plan->list = (int *)malloc((plan->sects + 1) * sizeof(int));
+                plan->list[0] = 0;
+                if (alloc_space(vol, &bitmap, plan->list, plan->sects)) {
+                        fprintf(vol->err, "Couldn't write file\n");
+                        rtn = -1;
+                        continue;
+                }
+                plan->file_no = x;
+
+                /* Fill in directory entry */
+                d = DIR_ENTRY(dir, x);
+                plan->old_flag = d->flag;
+                putname(d, plan->atari_name);
+                d->start_hi = (plan->list[0] >> 8);
+                d->start_lo = plan->list[0];
+                d->count_hi = (plan->sects >> 8);
+                d->count_lo = plan->sects;
+                /* DOS complains on some file operations if FLAG_DOS2 is not there: */
+                d->flag = FLAG_IN_USE | FLAG_DOS2 | (vol->link16 ? FLAG_NOFILENO : 0);
+                dir_upd[x / (SECTOR_SIZE / ENTRY_SIZE)] = 1;
+        }
+
+        /* Write data */
+        for (i = 0; i != n; ++i) {
+                struct put_plan *plan = &plans[i];
+                struct dirent *d;
+                if (plan->file_no == -1)
+                        continue;
+                if (!plan->stream) {
+                        if (write_plan(vol, plan))
+                                rtn = -1;
+                        continue;
+                }
+                d = DIR_ENTRY(dir, plan->file_no);
+                if (write_stream(vol, plan, &bitmap)) {
+                        fprintf(vol->err, "Couldn't write file\n");
+                        d->flag = plan->old_flag;
+                        rtn = -1;
+                        continue;
+                }
+                d->start_hi = (plan->start >> 8);
+                d->start_lo = plan->start;
+                d->count_hi = (plan->sects >> 8);
+                d->count_lo = plan->sects;
+        }
+
+        /* Commit directory and VTOC */
+        for (x = 0; x != SECTOR_DIR_SIZE; ++x)
+                if (dir_upd[x])
+                        putsect(vol, dir[x], vol->dir_sect + x);
+        if (putmap(vol, &bitmap))
+                rtn = -1;
+
+        for (i = 0; i != n; ++i)
+                if (plans[i].list)
+                        free(plans[i].list);
+        free(plans);
+        return rtn ? rtn : vol->status;
+}
+
+/* Put a file on the disk */
+
+int put_file(struct atr_volume *vol, char *local_name, char *atari_name)
+{
+        return put_files(vol, 1, &local_name, &atari_name);
+}
+
+/* Defragment: rewrite every file as one run of sectors, in directory order.
+ *
+ * All file chains are read first (one read of each sector) and checked as
+ * check_file does; anything odd and we stop without changing the image.
+ * Then the files' sectors are released in the VTOC bitmap, the new layout
+ * is allocated from it and the sectors are written with new links and file
+ * numbers.  The writes go through the cache,
+ * so they reach the image in one ascending pass.
+ */
+
+/* Boot sector fields used by DOS 2 to find DOS.SYS */
+#define BOOT_DFSFLG 0x0E /* Non-zero if DOS.SYS is present */
+#define BOOT_DFLINK 0x0F /* First sector of DOS.SYS */
+
+int defrag(struct atr_volume *vol, int dry_run)
+{
+        unsigned char dir[SECTOR_DIR_SIZE][DD_SECTOR_SIZE];
+        int dir_upd[SECTOR_DIR_SIZE];
+        unsigned char boot[DD_SECTOR_SIZE];
+        struct bitmap reserved; /* Only the sectors DOS keeps for itself */
+        struct bitmap map; /* VTOC bitmap */
+        char *used; /* Set for sectors found in a chain */
+        unsigned char *data; /* File sectors, in directory then chain order */
+        int *old_sect; /* Where each of them is now */
+        int *new_sect; /* Where each goes */
+        int first[MAX_NAMES]; /* Index of first sector of each file in the above */
+        int count[MAX_NAMES]; /* Number of sectors in each file, -1 if no file */
+        int total = 0;
+        int moved = 0;
+        int rtn = -1;
+        int x, n;
+
+        if (vol->fs != FS_DOS2) {
+                fprintf(vol->err, "defrag only handles DOS 2 disks\n");
+                return -1;
+        }
+        for (x = 0; x != SECTOR_DIR_SIZE; ++x) {
+                dir_upd[x] = 0;
+                if (getsect(vol, dir[x], SECTOR_DIR + x)) {
+                        fprintf(vol->err, " (trying to read directory)\n");
+                        vol->status = 1;
+                        return -1;
+                }
+        }
+        if (getsect(vol, boot, 1)) {
+                fprintf(vol->err, " (trying to read boot sector)\n");
+                vol->status = 1;
+                return -1;
+        }
+
+        /* Sectors the VTOC says are in use but no file owns (boot code past
+         * sector 3, data written by a loader) stay where they are: only the
+         * files' own sectors are released and handed out again */
+        if (getmap(vol, &map, 0))
+                return -1;
+        bitmap_init(&reserved, vol->disk_size, 1);
+        reserve_space(&reserved);
+
+        used = (char *)calloc(vol->disk_size, 1);
+        data = (unsigned char *)malloc(vol->disk_size * vol->sector_size);
+        old_sect = (int *)malloc(vol->disk_size * sizeof(int));
+        new_sect = (int *)malloc(vol->disk_size * sizeof(int));
+
+        /* Read pass */
+        for (n = 0; n != MAX_NAMES; ++n) {
+                struct dirent *d = DIR_ENTRY(dir, n);
+                char s[NAME_SIZE];
+                int sector = (d->start_hi << 8) + d->start_lo;
+                count[n] = -1;
+                if (!(d->flag & FLAG_IN_USE))
+                        continue;
+                getname(d, s);
+                first[n] = total;
+                count[n] = 0;
+                while (sector) {
+                        unsigned char *buf = data + total * vol->sector_size;
+                        int file_no;
+                        if (sector >= vol->disk_size || !is_free(&reserved, sector)) {
+                                fprintf(vol->err, "** %s: sector %d is out of range or reserved\n", s, sector);
+                                goto bad;
+                        }
+                        if (used[sector]) {
+                                fprintf(vol->err, "** %s: sector %d is used twice\n", s, sector);
+                                goto bad;
+                        }
+                        if (getsect(vol, buf, sector)) {
+                                fprintf(vol->err, " (reading file)\n");
+                                goto bad;
+                        }
+                        file_no = get_file_no(vol, buf);
+                        if (file_no != n) {
+                                fprintf(vol->err, "** %s: sector %d claims to belong to file %d\n", s, sector, file_no);
+                                goto bad;
+                        }
+                        used[sector] = 1;
+                        old_sect[total++] = sector;
+                        ++count[n];
+                        sector = get_link(vol, buf);
+                }
+        }
+
+        /* New layout: files one after another from the lowest free sector */
+        for (x = 0; x != total; ++x)
+                mark_space(&map, old_sect[x], 0);
+        for (n = 0; n != MAX_NAMES; ++n)
+                if (count[n] > 0)
+                        alloc_first(vol, &map, new_sect + first[n], count[n]);
+        for (x = 0; x != total; ++x)
+                if (new_sect[x] != old_sect[x])
+                        ++moved;
+
+        if (dry_run) {
+                fprintf(vol->out, "%d of %d file sectors would move\n", moved, total);
+                rtn = 0;
+                goto done;
+        }
+
+        /* Write pass */
+        for (n = 0; n != MAX_NAMES; ++n) {
+                struct dirent *d = DIR_ENTRY(dir, n);
+                int old_start = (d->start_hi << 8) + d->start_lo;
+                int new_start;
+                if (count[n] == -1)
+                        continue;
+                new_start = (count[n] ? new_sect[first[n]] : 0);
+                for (x = first[n]; x != first[n] + count[n]; ++x) {
+                        unsigned char *buf = data + x * vol->sector_size;
+                        int next = (x + 1 != first[n] + count[n] ? new_sect[x + 1] : 0);
+                        unsigned char orig[DD_SECTOR_SIZE];
+                        memcpy(orig, buf, vol->sector_size);
+                        set_file_no(vol, buf, n);
+                        set_link(vol, buf, next);
+                        if (new_sect[x] != old_sect[x] || memcmp(orig, buf, vol->sector_size))
+                                putsect(vol, buf, new_sect[x]);
+                }
+                if (new_start != old_start || count[n] != (d->count_hi << 8) + d->count_lo) {
+                        d->start_hi = (new_start >> 8);
+                        d->start_lo = new_start;
+                        d->count_hi = (count[n] >> 8);
+                        d->count_lo = count[n];
+                        dir_upd[n / (SECTOR_SIZE / ENTRY_SIZE)] = 1;
+                }
+                /* Keep the boot sector pointing at DOS.SYS */
+                if (boot[BOOT_DFSFLG] && old_start && new_start != old_start &&
+                    boot[BOOT_DFLINK] + (boot[BOOT_DFLINK + 1] << 8) == old_start) {
+                        boot[BOOT_DFLINK] = new_start;
+                        boot[BOOT_DFLINK + 1] = (new_start >> 8);
+                        putsect(vol, boot, 1);
+                }
+        }
+        for (x = 0; x != SECTOR_DIR_SIZE; ++x)
+                if (dir_upd[x])
+                        putsect(vol, dir[x], SECTOR_DIR + x);
+        if (putmap(vol, &map))
+                goto done;
+        fprintf(vol->out, "%d of %d file sectors moved\n", moved, total);
+        rtn = vol->status;
+        goto done;
+
+        bad:
+        fprintf(vol->err, "Run check first; nothing was changed\n");
+        vol->status = 1;
+        done:
+        free(used);
+        free(data);
+        free(old_sect);
+        free(new_sect);
+        return rtn;
+}
+
+/* Rename a file */
+
+int atari_rename(struct atr_volume *vol, char *old_name, char *new_name)
+{
+        if (find_file(vol, new_name, 0, NULL) != -1 || find_dir(vol, new_name) != -1) {
+                fprintf(vol->err, "'%s' already exists\n", new_name);
+                return -1;
+        }
+        return find_file(vol, old_name, 0, new_name);
+}
+
+/* How much read_dir() finds out about each file */
+#define INFO_NAME 0 /* Directory entry only */
+#define INFO_SIZE 1 /* Also follow the sector chain for the actual size */
+#define INFO_SEGS 2 /* Also read the data for binary load segments */
+
+/* Get actual size of file from the byte counts in its sector chain */
+
+void get_size(struct atr_volume *vol, struct name *nam)
+{
+        int total = 0;
+        int count = 0;
+        int sector = nam->sector;
+        while (sector) {
+                unsigned char buf[DD_SECTOR_SIZE];
+                if (count++ == max_chain(vol)) {
+                        fprintf(vol->err, " (file %s too long)\n", nam->name);
+                        vol->status = 1;
+                        break;
+                }
+                if (getsect(vol, buf, sector)) {
+                        fprintf(vol->err, " (trying to read file %s)\n", nam->name);
+                        break;
+                }
+                total += buf[vol->data_bytes];
+                sector = get_link(vol, buf);
+        }
+        nam->size = total;
+}
+
+/* Binary load (XEX) parser
+ *
+ * Fed the file a piece at a time as it comes off the sector chain.  Only the
+ * segment headers are kept; payload bytes are skipped over, except for any
+ * that land on the RUN/INIT vectors at $2E0 - $2E3.
+ */
+
+#define XEX_MAGIC 0 /* Expecting 0xFF 0xFF at start of file */
+#define XEX_HEADER 1 /* Reading segment header */
+#define XEX_DATA 2 /* Skipping segment data */
+#define XEX_BAD 3 /* Not a binary file, or bad header: ignore rest */
+
+#define VEC_RUN 0x2E0
+#define VEC_INIT 0x2E2
+
+struct xex {
+        int state;
+        unsigned char hdr[4]; /* Header bytes so far */
+        int nhdr;
+        long pos; /* Offset in file */
+        int left; /* Data bytes left in current segment */
+        unsigned char vec[4]; /* $2E0 - $2E3 as loaded by current segment */
+        int vec_set; /* Bit for each byte of vec loaded by current segment */
+        struct segment *segs;
+        int nsegs;
+        int segs_size;
+        int is_xex; /* Set if file starts with the magic number */
+        int bad_header; /* Set if a header has end before start */
+        int truncated; /* Set if file ends in the middle of a segment */
+        int trailing; /* Number of bytes of incomplete header at end */
+
+        /* If set, called with data bytes of segment seg as they go by */
+        void (*data)(void *arg, int seg, unsigned char *buf, int len);
+        void *arg;
+};
+
+void xex_init(struct xex *x)
+{
+        memset(x, 0, sizeof(struct xex));
+}
+
+/* Finish segment: fill in RUN and INIT if it loaded them */
+
+void xex_seg_done(struct xex *x)
+{
+        struct segment *seg = &x->segs[x->nsegs - 1];
+        if (x->vec_set & 3)
+                seg->run = x->vec[0] + (x->vec[1] << 8);
+        if (x->vec_set & 12)
+                seg->init = x->vec[2] + (x->vec[3] << 8);
+}
+
+void xex_feed(struct xex *x, unsigned char *buf, int len)
+{
+        while (len) {
+                switch (x->state) {
+                        case XEX_MAGIC: {
+                                if (*buf != 0xFF) {
+                                        x->state = XEX_BAD;
+                                        break;
+                                }
+                                ++buf; --len; ++x->pos;
+                                if (x->pos == 2) {
+                                        x->is_xex = 1;
+                                        x->state = XEX_HEADER;
+                                }
+                                break;
+                        } case XEX_HEADER: {
+                                struct segment *seg;
+                                x->hdr[x->nhdr++] = *buf++;
+                                --len; ++x->pos;
+                                /* Each segment can optionally start with 0xFFFF, skip it */
+                                if (x->nhdr == 2 && x->hdr[0] == 0xFF && x->hdr[1] == 0xFF)
+                                        x->nhdr = 0;
+                                if (x->nhdr != 4)
+                                        break;
+                                x->nhdr = 0;
+                                if (x->segs_size == x->nsegs) {
+                                        x->segs_size = x->segs_size ? x->segs_size * 2 : 16;
+                                        x->segs = (struct segment *)realloc(x->segs, x->segs_size * sizeof(struct segment));
+                                }
+                                seg = &x->segs[x->nsegs];
+                                seg->start = x->hdr[0] + (x->hdr[1] << 8);
+                                seg->size = x->hdr[2] + (x->hdr[3] << 8) - seg->start + 1;
+                                seg->init = -1;
+                                seg->run = -1;
+                                seg->offset = x->pos;
+                                if (seg->size < 1) { /* Bad load format? */
+                                        x->bad_header = 1;
+                                        x->state = XEX_BAD;
+                                        break;
+                                }
+                                ++x->nsegs;
+                                x->left = seg->size;
+                                memset(x->vec, 0xFE, sizeof(x->vec));
+                                x->vec_set = 0;
+                                x->state = XEX_DATA;
+                                break;
+                        } case XEX_DATA: {
+                                struct segment *seg = &x->segs[x->nsegs - 1];
+                                int amnt = (len < x->left ? len : x->left);
+                                int addr = seg->start + seg->size - x->left;
+                                int lo = (addr > VEC_RUN ? addr : VEC_RUN);
+                                int hi = (addr + amnt - 1 < VEC_INIT + 1 ? addr + amnt - 1 : VEC_INIT + 1);
+                                for (; lo <= hi; ++lo) {
+                                        x->vec[lo - VEC_RUN] = buf[lo - addr];
+                                        x->vec_set |= (1 << (lo - VEC_RUN));
+                                }
+                                if (x->data)
+                                        x->data(x->arg, x->nsegs - 1, buf, amnt);
+                                buf += amnt;
+                                len -= amnt;
+                                x->pos += amnt;
+                                x->left -= amnt;
+                                if (!x->left) {
+                                        xex_seg_done(x);
+                                        x->state = XEX_HEADER;
+                                }
+                                break;
+                        } default: {
+                                x->pos += len;
+                                len = 0;
+                                break;
+                        }
+                }
+        }
+}
+
+/* End of file: note a truncated last segment or partial header */
+
+void xex_end(struct xex *x)
+{
+        if (x->state == XEX_DATA) {
+                x->truncated = 1;
+                xex_seg_done(x);
+        } else if (x->state == XEX_HEADER) {
+                x->trailing = x->nhdr;
+        }
+}
+
+/* Run file through parser, returns file size */
+
+long xex_file(struct atr_volume *vol, int sector, char *name, struct xex *x)
+{
+        long total = 0;
+        int count = 0;
+        if (vol->fs == FS_SPARTA) {
+                /* sector is the map, length is from find_file() */
+                struct sp_file sf;
+                unsigned char buf[XLAT_CHUNK];
+                if (!sp_load(vol, sector, &sf))
+                        while (total < vol->found_len) {
+                                long len = vol->found_len - total < XLAT_CHUNK ? vol->found_len - total : XLAT_CHUNK;
+                                long got = sp_read(vol, &sf, total, buf, len);
+                                if (got > 0) {
+                                        xex_feed(x, buf, got);
+                                        total += got;
+                                }
+                                if (got != len) {
+                                        fprintf(vol->err, " (file %s is shorter than its directory entry says)\n", name);
+                                        vol->status = 1;
+                                        break;
+                                }
+                        }
+                sp_free(&sf);
+                xex_end(x);
+                return total;
+        }
+        while (sector) {
+                unsigned char buf[DD_SECTOR_SIZE];
+                if (count++ == max_chain(vol)) {
+                        fprintf(vol->err, " (file %s too long)\n", name);
+                        vol->status = 1;
+                        break;
+                }
+                if (getsect(vol, buf, sector)) {
+                        fprintf(vol->err, " (trying to read file %s)\n", name);
+                        vol->status = 1;
+                        break;
+                }
+                xex_feed(x, buf, buf[vol->data_bytes]);
+                total += buf[vol->data_bytes];
+                sector = get_link(vol, buf);
+        }
+        xex_end(x);
+        return total;
+}
+
+/* Get info about file: actual size and binary load segments */
+
+void get_info(struct atr_volume *vol, struct name *nam)
+{
+        struct xex x;
+        xex_init(&x);
+        if (vol->fs == FS_SPARTA)
+                vol->found_len = nam->size;
+        nam->size = xex_file(vol, nam->sector, nam->name, &x);
+        nam->segments = x.segs;
+        nam->nsegs = x.nsegs;
+}
+
+/* xex command: show, merge or verify the segments of a binary load file */
+
+/* True if segment loads any of the RUN/INIT vectors */
+
+int seg_vec(struct segment *seg)
+{
+        return seg->start <= VEC_INIT + 1 && seg->start + seg->size - 1 >= VEC_RUN;
+}
+
+/* Merge: segments contiguous in memory are written as one.  Segments that
+ * load the vectors stay as they are, since INIT runs as soon as its segment
+ * is loaded. */
+
+struct xex_merge {
+        FILE *f;
+        struct xex *x; /* Segments from first pass */
+        int *group_end; /* For first segment of a group: last address of group, else -1 */
+        int seg; /* Last segment written */
+};
+
+void merge_data(void *arg, int seg, unsigned char *buf, int len)
+{
+        struct xex_merge *m = (struct xex_merge *)arg;
+        if (seg != m->seg) {
+                m->seg = seg;
+                if (m->group_end[seg] != -1) {
+                        int start = m->x->segs[seg].start;
+                        fputc(start & 0xFF, m->f);
+                        fputc(start >> 8, m->f);
+                        fputc(m->group_end[seg] & 0xFF, m->f);
+                        fputc(m->group_end[seg] >> 8, m->f);
+                }
+        }
+        fwrite(buf, 1, len, m->f);
+}
+
+int xex_merge(struct atr_volume *vol, int sector, char *name, struct xex *x, char *local_name)
+{
+        struct xex_merge m;
+        struct xex y;
+        int groups = 0;
+        int head = 0;
+        int n;
+
+        if (x->truncated || x->bad_header) {
+                fprintf(vol->err, "'%s' is damaged, not merging (try -v)\n", name);
+                return -1;
+        }
+        m.f = fopen(local_name, "w");
+        if (!m.f) {
+                fprintf(vol->err, "Couldn't open local file '%s'\n", local_name);
+                return -1;
+        }
+        m.x = x;
+        m.seg = -1;
+        m.group_end = (int *)malloc((x->nsegs + 1) * sizeof(int));
+        for (n = 0; n != x->nsegs; ++n) {
+                struct segment *seg = &x->segs[n];
+                struct segment *prev = &x->segs[head];
+                if (n && !seg_vec(seg) && !seg_vec(prev) &&
+                    seg->start == m.group_end[head] + 1) {
+                        m.group_end[head] = seg->start + seg->size - 1;
+                        m.group_end[n] = -1;
+                } else {
+                        head = n;
+                        m.group_end[n] = seg->start + seg->size - 1;
+                        ++groups;
+                }
+        }
+
+        /* Second pass writes the data */
+        fputc(0xFF, m.f);
+        fputc(0xFF, m.f);
+        xex_init(&y);
+        y.data = merge_data;
+        y.arg = &m;
+        xex_file(vol, sector, name, &y);
+        free(y.segs);
+        free(m.group_end);
+        if (fclose(m.f)) {
+                fprintf(vol->err, "Couldn't close local file '%s'\n", local_name);
+                return -1;
+        }
+        fprintf(vol->out, "%d segments merged into %d\n", x->nsegs, groups);
+        return vol->status;
+}
+
+/* Verify: report anything DOS would trip over */
+
+int xex_verify(struct atr_volume *vol, char *name, struct xex *x)
+{
+        int errors = 0;
+        int warnings = 0;
+        int n, y;
+
+        if (x->bad_header) {
+                fprintf(vol->err, "  ** Segment %d header has end address before start address\n", x->nsegs + 1);
+                ++errors;
+        }
+        if (x->truncated) {
+                fprintf(vol->err, "  ** File ends in the middle of segment %d\n", x->nsegs);
+                ++errors;
+        }
+        if (x->trailing) {
+                fprintf(vol->err, "  ** %d bytes of incomplete segment header at end of file\n", x->trailing);
+                ++errors;
+        }
+        for (n = 0; n != x->nsegs; ++n) {
+                struct segment *seg = &x->segs[n];
+                int vec = (seg->init != -1 ? seg->init : seg->run);
+                if (!seg_vec(seg))
+                        for (y = 0; y != n; ++y) {
+                                struct segment *other = &x->segs[y];
+                                if (!seg_vec(other) && seg->start < other->start + other->size &&
+                                    other->start < seg->start + seg->size) {
+                                        fprintf(vol->err, "  Warning: segment %d (%x-%x) overlaps segment %d (%x-%x)\n",
+                                                n + 1, seg->start, seg->start + seg->size - 1,
+                                                y + 1, other->start, other->start + other->size - 1);
+                                        ++warnings;
+                                        break;
+                                }
+                        }
+                if (vec != -1) {
+                        for (y = 0; y != x->nsegs; ++y)
+                                if (!seg_vec(&x->segs[y]) && vec >= x->segs[y].start &&
+                                    vec < x->segs[y].start + x->segs[y].size)
+                                        break;
+                        if (y == x->nsegs) {
+                                fprintf(vol->err, "  Warning: %s address %x (segment %d) is not in any loaded segment\n",
+                                        (seg->init != -1 ? "INIT" : "RUN"), vec, n + 1);
+                                ++warnings;
+                        }
+                }
+        }
+        if (!errors && !warnings)
+                fprintf(vol->out, "  It's OK.\n");
+        else
+                fprintf(vol->out, "  %d errors, %d warnings\n", errors, warnings);
+        if (errors)
+                vol->status = 1;
+        return vol->status;
+}
+
+int do_xex(struct atr_volume *vol, char *name, int verify, char *merge_name)
+{
+        struct xex x;
+        long size;
+        int sector = find_file(vol, name, 0, NULL);
+        int rtn = 0;
+        int n;
+
+        if (sector == -1) {
+                fprintf(vol->err, "File '%s' not found\n", name);
+                return -1;
+        }
+        xex_init(&x);
+        size = xex_file(vol, sector, name, &x);
+        if (!x.is_xex) {
+                fprintf(vol->err, "'%s' is not a binary load file\n", name);
+                vol->status = 1;
+                return -1;
+        }
+
+        fprintf(vol->out, "%s: %d segments, %ld bytes\n", name, x.nsegs, size);
+        if (verify) {
+                rtn = xex_verify(vol, name, &x);
+        } else if (merge_name) {
+                rtn = xex_merge(vol, sector, name, &x, merge_name);
+        } else {
+                fprintf(vol->out, "  seg  offset  load        size\n");
+                for (n = 0; n != x.nsegs; ++n) {
+                        struct segment *seg = &x.segs[n];
+                        fprintf(vol->out, "  %3d  %6ld  %04x-%04x  %5d", n + 1, seg->offset,
+                                seg->start, seg->start + seg->size - 1, seg->size);
+                        if (seg->init != -1)
+                                fprintf(vol->out, "  init=%x", seg->init);
+                        if (seg->run != -1)
+                                fprintf(vol->out, "  run=%x", seg->run);
+                        fprintf(vol->out, "\n");
+                }
+                if (x.truncated || x.bad_header || x.trailing)
+                        fprintf(vol->err, "  ** File is damaged (try -v)\n");
+                rtn = vol->status;
+        }
+        free(x.segs);
+        return rtn;
+}
+
+/* read_dir() for SpartaDOS.  Sizes come from the directory, so only -l -l
+ * (binary load segments) reads the files. */
+
+void sp_read_dir(struct atr_volume *vol, int all_flg, int info_flg)
+{
+        struct sp_dir dir;
+        int n;
+        if (sp_open_dir(vol, vol->dir_sect, &dir)) {
+                fprintf(vol->err, " (trying to read directory)\n");
+                sp_close_dir(&dir);
+                return;
+        }
+        for (n = 1; n != sp_entries(&dir) && vol->name_n != SP_MAX_NAMES; ++n) {
+                struct sp_dirent *e = SP_ENTRY(&dir, n);
+                struct name *nam;
+                char s[NAME_SIZE];
+                if (!sp_in_use(e))
+                        continue;
+                nam = (struct name *)malloc(sizeof(struct name));
+                nam->name = strdup(sp_getname(e, s));
+                nam->locked = ((e->flag & SP_FLAG_LOCKED) != 0);
+                nam->sector = get16(&e->map_lo);
+                nam->size = get24(e->len);
+                nam->sects = (nam->size + vol->sector_size - 1) / vol->sector_size;
+                nam->segments = 0;
+                nam->nsegs = 0;
+                nam->is_dir = ((e->flag & SP_FLAG_SUBDIR) != 0);
+                nam->is_sys = !memcmp(e->suffix, "SYS", 3);
+                nam->is_cm = !memcmp(e->suffix, "COM", 3);
+                if (nam->is_dir)
+                        nam->size = 0;
+                else if (info_flg >= INFO_SEGS)
+                        get_info(vol, nam);
+                if (all_flg || !(nam->is_sys || (e->flag & SP_FLAG_HIDDEN))) {
+                        vol->names[vol->name_n++] = nam;
+                } else {
+                        free(nam->segments);
+                        free(nam->name);
+                        free(nam);
+                }
+        }
+        sp_close_dir(&dir);
+}
+
+/* Read directory into names/name_n array
+ * info_flg says how much to find out beyond the directory entry (INFO_...)
+ * If all_flg is set, included system files in
+ */
+
+void read_dir(struct atr_volume *vol, int all_flg, int info_flg)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int x;
+        if (vol->fs == FS_SPARTA) {
+                sp_read_dir(vol, all_flg, info_flg);
+                return;
+        }
+        for (x = vol->dir_sect; x != vol->dir_sect + SECTOR_DIR_SIZE; ++x) {
+                int y;
+                if (getsect(vol, buf, x)) {
+                        fprintf(vol->err, " (trying to read directory)\n");
+                        break;
+                }
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(buf + y);
+
+                        if (!(d->flag & (FLAG_IN_USE | FLAG_DELETED)))
+                                goto done;
+
+                        if (d->flag & FLAG_IN_USE) {
+                                struct name *nam;
+                                char s[NAME_SIZE];
+                                getname(d, s);
+                                nam = (struct name *)malloc(sizeof(struct name));
+                                nam->name = strdup(s);
+                                if (d->flag & FLAG_LOCKED)
+                                        nam->locked = 1;
+                                else
+                                        nam->locked = 0;
+                                nam->sector = d->start_lo + (d->start_hi * 256);
+                                nam->sects = d->count_lo + (d->count_hi * 256);
+                                nam->segments = 0;
+                                nam->nsegs = 0;
+                                nam->size = -1;
+                                nam->is_dir = ((d->flag & FLAG_SUBDIR) != 0);
+                                if (nam->is_dir)
+                                        nam->size = 0;
+                                else if (info_flg >= INFO_SEGS)
+                                        get_info(vol, nam);
+                                else if (info_flg >= INFO_SIZE)
+                                        get_size(vol, nam);
+
+                                if (d->suffix[0] == 'S' && d->suffix[1] == 'Y' && d->suffix[2] == 'S')
+                                        nam->is_sys = 1;
+                                else
+                                        nam->is_sys = 0;
+
+                                if (d->suffix[0] == 'C' && d->suffix[1] == 'O' && d->suffix[2] == 'M')
+                                        nam->is_cm = 1;
+                                else
+                                        nam->is_cm = 0;
+
+                                if ((all_flg || !nam->is_sys))
+                                        vol->names[vol->name_n++] = nam;
+                        }
+                }
+        }
+        done:;
+}
+
+/* Name as listed: subdirectories get a '/' */
+
+char *list_name(struct name *nam, char *s)
+{
+        sprintf(s, "%s%s", nam->name, nam->is_dir ? "/" : "");
+        return s;
+}
+
+#define FLUSHLINE do { \
+        if (strlen(linebuf) + 15 >= 78) { \
+                int n; \
+                fprintf(vol->out, "%s\n", linebuf); \
+                for (n = 0; n != ofst; ++n) linebuf[n] = ' '; \
+                linebuf[n] = 0; \
+        } \
+} while (0)
+
+void atari_dir(struct atr_volume *vol, int all, int full, int single)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int x, y;
+        int rows;
+        int cols = (80 / 13);
+        read_dir(vol, all, full ? INFO_SEGS : INFO_NAME);
+
+        qsort(vol->names, vol->name_n, sizeof(struct name *), (int (*)(const void *, const void *))comp);
+
+        if (full) {
+                int totals = 0;
+                int total_bytes = 0;
+                fprintf(vol->out, "\n");
+                for (x = 0; x != vol->name_n; ++x) {
+                        char linebuf[100];
+                        int ofst;
+                        int extra = 0;
+                        int n;
+                        char s[NAME_SIZE + 1];
+                        sprintf(linebuf, "%cr%c%c%c %6d (%3d) %-13s",
+                               (vol->names[x]->is_dir ? 'd' : '-'),
+                               (vol->names[x]->locked ? '-' : 'w'),
+                               (vol->names[x]->is_cm ? 'x' : '-'),
+                               (vol->names[x]->is_sys ? 's' : '-'),
+                               vol->names[x]->size, vol->names[x]->sects, list_name(vol->names[x], s));
+                        ofst = strlen(linebuf) + 1;
+                        for (n = 0; n != vol->names[x]->nsegs; ++n) {
+                                struct segment *seg = &vol->names[x]->segments[n];
+                                if (!extra) {
+                                        strcat(linebuf, " (");
+                                        extra = 1;
+                                } else {
+                                        strcat(linebuf, " ");
+                                }
+                                FLUSHLINE;
+                                sprintf(linebuf + strlen(linebuf), "load=%x-%x", seg->start, seg->start + seg->size - 1);
+                                if (seg->init != -1) {
                                         FLUSHLINE;
                                         sprintf(linebuf + strlen(linebuf), " init=%x", seg->init);
                                 }
@@ -1472,173 +4852,1664 @@ void atari_dir(int all, int full, int single)
                                         sprintf(linebuf + strlen(linebuf), " run=%x", seg->run);
                                 }
                         }
-                        if (extra)
-                                strcat(linebuf, ")");
-                        printf("%s\n", linebuf);
-                        totals += names[x]->sects;
-                        total_bytes += names[x]->size;
+                        if (extra)
+                                strcat(linebuf, ")");
+                        fprintf(vol->out, "%s\n", linebuf);
+                        totals += vol->names[x]->sects;
+                        total_bytes += vol->names[x]->size;
+                }
+                fprintf(vol->out, "\n%d entries\n", vol->name_n);
+                fprintf(vol->out, "\n%d sectors, %d bytes\n", totals, total_bytes);
+                fprintf(vol->out, "\n");
+                do_free(vol);
+                fprintf(vol->out, "\n");
+        } else if (single) {
+                int x;
+                char s[NAME_SIZE + 1];
+                for (x = 0; x != vol->name_n; ++x) {
+                        fprintf(vol->out, "%s\n", list_name(vol->names[x], s));
+                }
+        } else {
+
+                /* Rows of 12 names each ordered like ls */
+
+                rows = (vol->name_n + cols - 1) / cols;
+
+                for (y = 0; y != rows; ++y) {
+                        for (x = 0; x != cols; ++x) {
+                                int n = y + x * rows;
+                                char s[NAME_SIZE + 1];
+                                /* printf("%11d  ", n); */
+                                if (n < vol->name_n)
+                                        fprintf(vol->out, "%-12s ", list_name(vol->names[n], s));
+                                else
+                                        fprintf(vol->out, "             ");
+                        }
+                        fprintf(vol->out, "\n");
+                }
+        }
+}
+
+/* Listing with selected fields, one file per line, tab separated, for
+ * scripts.  Only the files' sectors needed for the fields are read. */
+
+char *field_names[] = { "name", "flags", "start", "sects", "size", "segs", 0 };
+int field_info[] = { INFO_NAME, INFO_NAME, INFO_NAME, INFO_NAME, INFO_SIZE, INFO_SEGS };
+
+#define MAX_FIELDS 16
+
+int list_fields(struct atr_volume *vol, int all, char *spec)
+{
+        int fields[MAX_FIELDS];
+        int nfields = 0;
+        int info = INFO_NAME;
+        int x, y;
+
+        while (*spec) {
+                int len = strcspn(spec, ",");
+                int f;
+                for (f = 0; field_names[f]; ++f)
+                        if (strlen(field_names[f]) == len && !strncmp(field_names[f], spec, len))
+                                break;
+                if (!field_names[f] || nfields == MAX_FIELDS) {
+                        fprintf(vol->err, "Unknown field '%.*s' (use name, flags, start, sects, size, segs)\n", len, spec);
+                        return -1;
+                }
+                fields[nfields++] = f;
+                if (field_info[f] > info)
+                        info = field_info[f];
+                spec += len;
+                if (*spec == ',')
+                        ++spec;
+        }
+
+        read_dir(vol, all, info);
+        qsort(vol->names, vol->name_n, sizeof(struct name *), (int (*)(const void *, const void *))comp);
+
+        for (x = 0; x != vol->name_n; ++x) {
+                struct name *nam = vol->names[x];
+                for (y = 0; y != nfields; ++y) {
+                        char s[NAME_SIZE + 1];
+                        int n;
+                        if (y)
+                                fputc('\t', vol->out);
+                        switch (fields[y]) {
+                                case 0: fprintf(vol->out, "%s", list_name(nam, s)); break;
+                                case 1: fprintf(vol->out, "%cr%c%c%c", (nam->is_dir ? 'd' : '-'), (nam->locked ? '-' : 'w'),
+                                                (nam->is_cm ? 'x' : '-'), (nam->is_sys ? 's' : '-')); break;
+                                case 2: fprintf(vol->out, "%d", nam->sector); break;
+                                case 3: fprintf(vol->out, "%d", nam->sects); break;
+                                case 4: fprintf(vol->out, "%d", nam->size); break;
+                                case 5: {
+                                        for (n = 0; n != nam->nsegs; ++n) {
+                                                struct segment *seg = &nam->segments[n];
+                                                fprintf(vol->out, "%sload=%x-%x", (n ? " " : ""),
+                                                        seg->start, seg->start + seg->size - 1);
+                                                if (seg->init != -1)
+                                                        fprintf(vol->out, " init=%x", seg->init);
+                                                if (seg->run != -1)
+                                                        fprintf(vol->out, " run=%x", seg->run);
+                                        }
+                                        break;
+                                }
+                        }
+                }
+                fputc('\n', vol->out);
+        }
+        return vol->status;
+}
+
+int mkfs(struct atr_volume *vol, char *disk_name, int type, char* boot_sectors_file_path)
+{
+        unsigned char hdr[16];
+        unsigned char bf[256];
+        struct bitmap bitmap;
+        int size;
+        int n;
+        vol->disk = fopen(disk_name, "w+");
+        if (!vol->disk) {
+                fprintf(vol->err, "Couldn't open '%s'\n", disk_name);
+                return -1;
+        }
+        /* .ATR header */
+        memset(hdr, 0, 16);
+        hdr[0] = 0x96;
+        hdr[1] = 0x02;
+        switch (type) {
+                case 1: {
+                        vol->disk_size = SD_DISK_SIZE;
+                        size = 40*18*128;
+                        hdr[2] = size/16;
+                        hdr[3] = size/16/256;
+                        hdr[4] = 0x80;
+                        hdr[5] = 0x00;
+                        break;
+                } case 2: {
+                        vol->disk_size = ED_DISK_SIZE;
+                        size = 40*26*128;
+                        hdr[2] = size/16;
+                        hdr[3] = size/16/256;
+                        hdr[4] = 0x80;
+                        hdr[5] = 0x00;
+                        break;
+                } case 3: {
+                        vol->disk_size = DD_DISK_SIZE;
+                        set_density(vol, 1);
+                        size = 40*18*256 - 3*128;
+                        hdr[2] = size/16;
+                        hdr[3] = size/16/256;
+                        hdr[4] = 0x00;
+                        hdr[5] = 0x01;
+                        break;
+                }
+        }
+        if (16 != fwrite(hdr, 1, 16, vol->disk)) {
+                fprintf(vol->err, "Couldn't write to '%s'\n", disk_name);
+                return -1;
+        }
+        memset(bf, 0, 256);
+        for (n = 0; n != size; n += 128) {
+                if (128 != fwrite(bf, 1, 128, vol->disk)) {
+                        fprintf(vol->err, "Couldn't write to '%s'\n", disk_name);
+                        return -1;
+                }
+        }
+        /* VTOC */
+        bf[0] = 2;
+        if (vol->disk_size == ED_DISK_SIZE) {
+                bf[1] = (255 & 1010);
+                bf[2] = 1010/256;
+        } else {
+                bf[1] = (255 & 707);
+                bf[2] = 707/256;
+        }
+        putsect(vol, bf, SECTOR_VTOC);
+        bitmap_init(&bitmap, ED_BITMAP_SIZE * 8, 1);
+        reserve_space(&bitmap);
+        putmap(vol, &bitmap);
+        if (boot_sectors_file_path != NULL) {
+                FILE* boot_sectors_file = fopen(boot_sectors_file_path, "rb");
+                if (!boot_sectors_file) {
+                        fprintf(vol->err, "Couldn't open '%s'\n", boot_sectors_file_path);
+                        return -1;
+                }
+                n=0;
+                while (n++, !feof(boot_sectors_file)) {
+                        size = ( n < 3 ? SECTOR_SIZE : vol->sector_size);
+                        size = fread(bf, size, 1, boot_sectors_file);
+                        putsect(vol, bf, n);
+                }
+                fclose(boot_sectors_file);
+        }
+        return close_disk(vol);
+}
+
+/* Extract files of current directory into local directory dir (or the
+ * current one if dir is 0).  Subdirectories are extracted into local
+ * subdirectories. */
+
+int extract(struct atr_volume *vol, int all_flg, char *dir)
+{
+        struct name **names;
+        int count;
+        int status = 0;
+        int n;
+
+        /* We take the names, read_dir() is used again for subdirectories */
+        read_dir(vol, all_flg, INFO_NAME);
+        count = vol->name_n;
+        names = (struct name **)malloc((count + 1) * sizeof(struct name *));
+        memcpy(names, vol->names, count * sizeof(struct name *));
+        vol->name_n = 0;
+
+        for (n = 0; n != count; ++n) {
+                struct name *nam = names[n];
+                char local_name[1024];
+                int len;
+                if (dir)
+                        len = snprintf(local_name, sizeof(local_name), "%s/%s", dir, nam->name);
+                else
+                        len = snprintf(local_name, sizeof(local_name), "%s", nam->name);
+                if (len >= (int)sizeof(local_name)) {
+                        fprintf(vol->err, "Path too long for '%s'\n", nam->name);
+                        status = -1;
+                } else if (nam->is_dir) {
+                        struct stat st;
+                        int dir_sect = vol->dir_sect;
+                        fprintf(vol->out, "extracting %s/\n", local_name);
+                        if (mkdir(local_name, 0777) && (stat(local_name, &st) || !S_ISDIR(st.st_mode))) {
+                                fprintf(vol->err, "Couldn't create local directory '%s'\n", local_name);
+                                status = -1;
+                        } else if (!sub_dir(vol, nam->name)) {
+                                status |= extract(vol, all_flg, local_name);
+                        } else {
+                                status = -1;
+                        }
+                        vol->dir_sect = dir_sect;
+                } else {
+                        fprintf(vol->out, "extracting %s\n", local_name);
+                        status |= get_file(vol, nam->name, local_name);
+                }
+                free(nam->segments);
+                free(nam->name);
+                free(nam);
+        }
+        free(names);
+        return status;
+}
+
+/* Execute command on open disk image */
+
+int command(struct atr_volume *vol, int argc, char *argv[], int x)
+{
+        int all = 0;
+        int full = 0;
+        int single = 0;
+        int ls = 0;
+        char *fields = 0;
+
+        /* Directory options */
+        dir:
+        while (x != argc && argv[x][0] == '-') {
+                int y;
+                if (!strncmp(argv[x], "--fields=", 9)) {
+                        fields = argv[x++] + 9;
+                        continue;
+                }
+                for (y = 1;argv[x][y];++y) {
+                        int opt = argv[x][y];
+                        switch (opt) {
+                                case 'l': full = 1; break;
+                                case 'a': all = 1; break;
+                                case '1': single = 1; break;
+                                default: fprintf(vol->out, "Unknown option '%c'\n", opt); return -1;
+                        }
+                }
+                ++x;
+        }
+
+        /* Directory to list */
+        if (ls && x + 1 == argc) {
+                if (change_dir(vol, argv[x]))
+                        return -1;
+                ++x;
+        }
+
+        if (x == argc && fields) {
+                return list_fields(vol, all, fields);
+        } else if (x == argc) {
+                /* Just print a directory listing */
+                atari_dir(vol, all, full, single);
+                return vol->status;
+        } else if (!strcmp(argv[x], "ls")) {
+                ++x;
+                ls = 1;
+                goto dir;
+        } else if (!strcmp(argv[x], "free")) {
+                return do_free(vol);
+        } else if (!strcmp(argv[x], "check") || !strcmp(argv[x], "fix")) {
+                FILE *err;
+                char *msgs;
+                size_t msgs_len;
+                int json = 0;
+                int rtn;
+                vol->fix = !strcmp(argv[x++], "fix");
+                for (; x != argc; ++x) {
+                        if (!strcmp(argv[x], "--json")) {
+                                json = 1;
+                        } else if (vol->fix && !strncmp(argv[x], "--policy=", 9)) {
+                                if (set_policy(vol, argv[x] + 9))
+                                        return -1;
+                        } else {
+                                fprintf(vol->err, "Unknown option '%s'\n", argv[x]);
+                                return -1;
+                        }
+                }
+                if (!json)
+                        return do_check(vol);
+                if (vol->fix && vol->fix_policy == FIX_ASK) {
+                        fprintf(vol->err, "fix --json needs --policy\n");
+                        return -1;
+                }
+                /* Only the JSON records go to the output.  Error messages
+                 * still go to the error output, and if check gives up
+                 * part way the last one is also given as a record. */
+                err = vol->err;
+                vol->json = vol->out;
+                vol->out = 0;
+                vol->err = open_memstream(&msgs, &msgs_len);
+                rtn = do_check(vol);
+                fclose(vol->err);
+                fwrite(msgs, 1, msgs_len, err);
+                if (rtn == -1)
+                        json_error(vol->json, vol->disk_name, msgs, msgs_len);
+                free(msgs);
+                vol->out = vol->json;
+                vol->err = err;
+                vol->json = 0;
+                return rtn;
+        } else if (!strcmp(argv[x], "defrag")) {
+                ++x;
+                return defrag(vol, x != argc && !strcmp(argv[x], "--dry-run"));
+        } else if (!strcmp(argv[x], "cat")) {
+                ++x;
+                while (x != argc && xlat_opt(vol, argv[x]))
+                        ++x;
+                if (x == argc) {
+                        fprintf(vol->err, "Missing file name to cat\n");
+                        return -1;
+                } else {
+                        char *name = enter_path(vol, argv[x]);
+                        if (!name)
+                                return -1;
+                        return cat(vol, name);
+                }
+        } else if (!strcmp(argv[x], "get")) {
+                char *local_name;
+                char *atari_name;
+                ++x;
+                while (x != argc && xlat_opt(vol, argv[x]))
+                        ++x;
+                if (x == argc) {
+                        fprintf(vol->out, "Missing file name to get\n");
+                        return -1;
+                }
+                atari_name = enter_path(vol, argv[x]);
+                if (!atari_name)
+                        return -1;
+                local_name = atari_name;
+                if (x + 1 != argc)
+                        local_name = argv[++x];
+                return get_file(vol, atari_name, local_name);
+        } else if (!strcmp(argv[x], "x")) {
+                int all_flg = 0;
+                ++x;
+                for (; x != argc; ++x) {
+                        if (!strcmp(argv[x], "-a"))
+                                all_flg = 1;
+                        else if (!xlat_opt(vol, argv[x]))
+                                break;
+                }
+                if (x != argc && change_dir(vol, argv[x]))
+                        return -1;
+                return extract(vol, all_flg, vol->extract_dir);
+        } else if (!strcmp(argv[x], "put")) {
+                char *local_name;
+                char *atari_name;
+                ++x;
+                for (; x != argc; ++x) {
+                        if (!strncmp(argv[x], "--alloc=", 8)) {
+                                if (set_alloc(vol, argv[x] + 8))
+                                        return -1;
+                        } else if (!xlat_opt(vol, argv[x]))
+                                break;
+                }
+                if (x == argc) {
+                        fprintf(vol->err, "Missing file name to put\n");
+                        return -1;
+                }
+                if (argc - x > 2) {
+                        /* Several files: write them all in one go */
+                        char **atari_names = (char **)malloc((argc - x) * sizeof(char *));
+                        int n;
+                        int rtn;
+                        for (n = 0; n != argc - x; ++n) {
+                                local_name = argv[x + n];
+                                if (!strcmp(local_name, "-")) {
+                                        fprintf(vol->err, "Standard input needs an atari-name: put - atari-name\n");
+                                        free(atari_names);
+                                        return -1;
+                                }
+                                if (strrchr(local_name, '/'))
+                                        atari_names[n] = strrchr(local_name, '/') + 1;
+                                else
+                                        atari_names[n] = local_name;
+                                fprintf(vol->out, "%s\n", atari_names[n]);
+                        }
+                        rtn = put_files(vol, argc - x, argv + x, atari_names);
+                        free(atari_names);
+                        return rtn;
+                }
+                local_name = argv[x];
+                if (!strcmp(local_name, "-") && x + 1 == argc) {
+                        fprintf(vol->err, "Standard input needs an atari-name: put - atari-name\n");
+                        return -1;
+                }
+                if (strrchr(local_name, '/'))
+                        atari_name = strrchr(local_name, '/') + 1;
+                else
+                        atari_name = local_name;
+                fprintf(vol->out, "%s\n", atari_name);
+                if (x + 1 != argc) {
+                        atari_name = enter_path(vol, argv[++x]);
+                        if (!atari_name)
+                                return -1;
+                }
+                return put_file(vol, local_name, atari_name);
+        } else if (!strcmp(argv[x], "w")) {
+                int n;
+                ++x;
+                if (x != argc && !strncmp(argv[x], "--alloc=", 8)) {
+                        if (set_alloc(vol, argv[x] + 8))
+                                return -1;
+                        ++x;
+                }
+                for (n = x; n != argc; ++n)
+                        fprintf(vol->out, "writing %s\n", argv[n]);
+                return put_files(vol, argc - x, argv + x, argv + x);
+        } else if (!strcmp(argv[x], "mv")) {
+                char *old_name;
+                char *new_name;
+                ++x;
+                if (!argv[x]) {
+                        fprintf(vol->err, "missing name\n");
+                        return -1;
+                } else {
+                        old_name = argv[x];
+                        ++x;
+                }
+                if (!argv[x]) {
+                        fprintf(vol->err, "missing name\n");
+                        return -1;
+                } else {
+                        new_name = argv[x];
+                        ++x;
+                }
+                old_name = enter_path(vol, old_name);
+                if (!old_name)
+                        return -1;
+                return atari_rename(vol, old_name, new_name);
+        } else if (!strcmp(argv[x], "xex")) {
+                int verify = 0;
+                char *merge_name = 0;
+                char *name;
+                ++x;
+                for (; x != argc; ++x) {
+                        if (!strcmp(argv[x], "-v"))
+                                verify = 1;
+                        else if (!strcmp(argv[x], "-m") && x + 1 != argc)
+                                merge_name = argv[++x];
+                        else
+                                break;
+                }
+                if (x == argc) {
+                        fprintf(vol->err, "Missing file name for xex\n");
+                        return -1;
+                }
+                name = enter_path(vol, argv[x]);
+                if (!name)
+                        return -1;
+                return do_xex(vol, name, verify, merge_name);
+        } else if (!strcmp(argv[x], "rm")) {
+                char *name;
+                ++x;
+                if (x == argc) {
+                        fprintf(vol->out, "Missing name to delete\n");
+                        return -1;
+                } else {
+                        name = enter_path(vol, argv[x]);
+                }
+                if (!name)
+                        return -1;
+                return rm(vol, name, 0);
+        } else {
+                fprintf(vol->out, "Unknown command '%s'\n", argv[x]);
+                return -1;
+        }
+        return 0;
+}
+
+/* True if arg is one of the command's arguments */
+
+int has_arg(int argc, char *argv[], int x, char *arg)
+{
+        for (; x != argc; ++x)
+                if (!strcmp(argv[x], arg))
+                        return 1;
+        return 0;
+}
+
+/* True if command modifies the disk image */
+
+int is_writer(int argc, char *argv[], int x)
+{
+        /* Skip directory options */
+        while (x != argc && argv[x][0] == '-')
+                ++x;
+        if (x == argc)
+                return 0;
+        if (!strcmp(argv[x], "defrag"))
+                return x + 1 == argc || strcmp(argv[x + 1], "--dry-run");
+        if (!strcmp(argv[x], "fix"))
+                return !has_arg(argc, argv, x, "--policy=none");
+        return !strcmp(argv[x], "put") || !strcmp(argv[x], "w") || !strcmp(argv[x], "mv") ||
+               !strcmp(argv[x], "rm") || !strcmp(argv[x], "fix");
+}
+
+/* Fleet mode: run one command over many images on a pool of threads.
+ *
+ * Each worker owns a range of the job list and takes jobs from the front of
+ * it.  When its range is empty it steals the back half of the largest
+ * remaining range of another worker.  Output of each image is collected in
+ * memory and printed as one group (or with each line prefixed with the
+ * image name), in the order the images were given.
+ */
+
+struct fleet_job {
+        char *path;
+        char *buf; /* Output collected for this image */
+        size_t len;
+        char *err_buf; /* Error messages, kept apart from JSON output */
+        size_t err_len;
+        int done;
+        int opened; /* Set if image could be opened */
+        int status;
+        int vtoc_errors;
+        int crosslinks;
+        int fixes; /* Number of fixes made */
+        long stat_reads;
+        long stat_writes;
+        long stat_hits;
+};
+
+struct fleet_worker {
+        pthread_t thread;
+        pthread_mutex_t lock;
+        int lo, hi; /* Jobs not started yet */
+        struct fleet *fleet;
+};
+
+struct fleet {
+        struct fleet_job *jobs;
+        int njobs;
+        struct fleet_worker *workers;
+        int nworkers;
+
+        /* Command to run */
+        int argc;
+        char **argv;
+        int writable;
+
+        int prefix; /* Prefix each output line with image name */
+        int json; /* Output is JSON records: print it as it is */
+
+        /* Output is printed in job order */
+        pthread_mutex_t out_lock;
+        int next_out;
+};
+
+/* Images found by fleet_walk() */
+
+char **walk_paths;
+int walk_n;
+int walk_size;
+
+void add_path(const char *path)
+{
+        if (walk_n == walk_size) {
+                walk_size = walk_size ? walk_size * 2 : 64;
+                walk_paths = (char **)realloc(walk_paths, walk_size * sizeof(char *));
+        }
+        walk_paths[walk_n++] = strdup(path);
+}
+
+int walk_fn(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+        if (flag == FTW_F && is_image_name(path))
+                add_path(path);
+        return 0;
+}
+
+/* For qsort */
+
+int comp_path(const void *l, const void *r)
+{
+        return strcmp(*(char **)l, *(char **)r);
+}
+
+/* Add image, or all .atr files found under a directory */
+
+void fleet_walk(char *path)
+{
+        struct stat st;
+        if (!stat(path, &st) && S_ISDIR(st.st_mode)) {
+                int first = walk_n;
+                nftw(path, walk_fn, 32, FTW_PHYS);
+                qsort(walk_paths + first, walk_n - first, sizeof(char *), comp_path);
+        } else {
+                add_path(path);
+        }
+}
+
+/* Print output with each line prefixed by the image name */
+
+void print_prefixed(FILE *f, char *path, char *buf, size_t len)
+{
+        char *p = buf;
+        while (p < buf + len) {
+                char *e = memchr(p, '\n', buf + len - p);
+                int n = e ? e - p + 1 : buf + len - p;
+                fprintf(f, "%s: %.*s%s", path, n, p, e ? "" : "\n");
+                p += n;
+        }
+}
+
+/* Print output of finished jobs in order */
+
+void fleet_output(struct fleet *fleet)
+{
+        while (fleet->next_out != fleet->njobs && fleet->jobs[fleet->next_out].done) {
+                struct fleet_job *job = &fleet->jobs[fleet->next_out++];
+                if (fleet->json) {
+                        /* Messages which aren't JSON go to stderr */
+                        if (!job->opened)
+                                json_error(stdout, job->path, job->err_buf, job->err_len);
+                        fwrite(job->buf, 1, job->len, stdout);
+                        fflush(stdout);
+                        print_prefixed(stderr, job->path, job->err_buf, job->err_len);
+                        free(job->err_buf);
+                        job->err_buf = 0;
+                } else if (fleet->prefix) {
+                        print_prefixed(stdout, job->path, job->buf, job->len);
+                } else {
+                        printf("==> %s <==\n", job->path);
+                        fwrite(job->buf, 1, job->len, stdout);
+                        printf("\n");
+                }
+                fflush(stdout);
+                free(job->buf);
+                job->buf = 0;
+        }
+}
+
+/* Run command on one image */
+
+void fleet_run(struct fleet *fleet, struct fleet_job *job)
+{
+        struct atr_volume *vol = new_volume();
+        char extract_dir[1024];
+        FILE *f = open_memstream(&job->buf, &job->len);
+        FILE *err = (fleet->json ? open_memstream(&job->err_buf, &job->err_len) : f);
+        vol->out = f;
+        vol->err = err;
+        if (!open_disk(vol, job->path, fleet->writable)) {
+                char *p;
+                job->opened = 1;
+                /* x extracts into directory named after image */
+                snprintf(extract_dir, sizeof(extract_dir), "%s", job->path);
+                if ((p = strrchr(extract_dir, '.')) && !strchr(p, '/'))
+                        *p = 0;
+                if (is_atr_name(extract_dir)) /* Was .atr.gz */
+                        extract_dir[strlen(extract_dir) - 4] = 0;
+                vol->extract_dir = extract_dir;
+                if (!strcmp(fleet->argv[0], "x"))
+                        mkdir(extract_dir, 0777);
+                job->status = command(vol, fleet->argc, fleet->argv, 0);
+                if (close_disk(vol))
+                        job->status = -1;
+                job->vtoc_errors = vol->vtoc_errors;
+                job->crosslinks = vol->crosslinks;
+                job->fixes = vol->fixes_applied;
+                job->stat_reads = vol->stat_reads;
+                job->stat_writes = vol->stat_writes;
+                job->stat_hits = vol->stat_hits;
+        } else {
+                job->status = -1;
+        }
+        free_volume(vol);
+        fclose(f);
+        if (err != f)
+                fclose(err);
+
+        pthread_mutex_lock(&fleet->out_lock);
+        job->done = 1;
+        fleet_output(fleet);
+        pthread_mutex_unlock(&fleet->out_lock);
+}
+
+/* Take next job: our own first, otherwise steal from someone else */
+
+int fleet_take(struct fleet_worker *w)
+{
+        struct fleet *fleet = w->fleet;
+        int job = -1;
+        pthread_mutex_lock(&w->lock);
+        if (w->lo != w->hi)
+                job = w->lo++;
+        pthread_mutex_unlock(&w->lock);
+        while (job == -1) {
+                struct fleet_worker *victim = 0;
+                int most = 0;
+                int lo = 0, hi = 0;
+                int x;
+                for (x = 0; x != fleet->nworkers; ++x) {
+                        struct fleet_worker *v = &fleet->workers[x];
+                        int left;
+                        pthread_mutex_lock(&v->lock);
+                        left = v->hi - v->lo;
+                        pthread_mutex_unlock(&v->lock);
+                        if (v != w && left > most) {
+                                most = left;
+                                victim = v;
+                        }
+                }
+                if (!victim)
+                        break;
+                /* Only hold one lock at a time: our own range is empty, so
+                 * nobody steals from us while we move the stolen range */
+                pthread_mutex_lock(&victim->lock);
+                if (victim->hi != victim->lo) {
+                        lo = victim->hi - (victim->hi - victim->lo + 1) / 2;
+                        hi = victim->hi;
+                        victim->hi = lo;
+                }
+                pthread_mutex_unlock(&victim->lock);
+                if (lo != hi) {
+                        pthread_mutex_lock(&w->lock);
+                        job = lo;
+                        w->lo = lo + 1;
+                        w->hi = hi;
+                        pthread_mutex_unlock(&w->lock);
+                }
+        }
+        return job;
+}
+
+void *fleet_worker(void *arg)
+{
+        struct fleet_worker *w = (struct fleet_worker *)arg;
+        int job;
+        while ((job = fleet_take(w)) != -1)
+                fleet_run(w->fleet, &w->fleet->jobs[job]);
+        return 0;
+}
+
+/* Run command (argv[0] .. argv[argc - 1]) over images with nworkers threads */
+
+int fleet(int nworkers, int prefix, int show_stats, int argc, char *argv[], char **paths, int npaths)
+{
+        struct fleet fleet[1];
+        int x;
+        int ok = 0, bad = 0, unopened = 0, vtoc_bad = 0, crosslinked = 0, fixes = 0, fixed = 0;
+        FILE *sum;
+        long reads = 0, writes = 0, hits = 0;
+
+        if (!argc || !(!strcmp(argv[0], "ls") || argv[0][0] == '-' || !strcmp(argv[0], "check") ||
+                       !strcmp(argv[0], "free") || !strcmp(argv[0], "x") || !strcmp(argv[0], "fix"))) {
+                fprintf(stderr, "Only ls, check, fix, free and x can be run on many images\n");
+                return -1;
+        }
+        if (!strcmp(argv[0], "fix")) {
+                for (x = 1; x != argc && strncmp(argv[x], "--policy=", 9); ++x);
+                if (x == argc) {
+                        fprintf(stderr, "fix on many images needs --policy\n");
+                        return -1;
+                }
+        }
+
+        memset(fleet, 0, sizeof(fleet));
+        fleet->argc = argc;
+        fleet->argv = argv;
+        fleet->writable = is_writer(argc, argv, 0);
+        fleet->prefix = prefix;
+        fleet->json = has_arg(argc, argv, 0, "--json");
+        pthread_mutex_init(&fleet->out_lock, NULL);
+
+        for (x = 0; x != npaths; ++x)
+                fleet_walk(paths[x]);
+        fleet->njobs = walk_n;
+        fleet->jobs = (struct fleet_job *)calloc(walk_n + 1, sizeof(struct fleet_job));
+        for (x = 0; x != walk_n; ++x)
+                fleet->jobs[x].path = walk_paths[x];
+
+        if (nworkers < 1)
+                nworkers = 1;
+        if (nworkers > fleet->njobs)
+                nworkers = fleet->njobs ? fleet->njobs : 1;
+        fleet->nworkers = nworkers;
+        fleet->workers = (struct fleet_worker *)calloc(nworkers, sizeof(struct fleet_worker));
+        for (x = 0; x != nworkers; ++x) {
+                struct fleet_worker *w = &fleet->workers[x];
+                pthread_mutex_init(&w->lock, NULL);
+                w->fleet = fleet;
+                w->lo = (long)fleet->njobs * x / nworkers;
+                w->hi = (long)fleet->njobs * (x + 1) / nworkers;
+        }
+        for (x = 0; x != nworkers; ++x)
+                pthread_create(&fleet->workers[x].thread, NULL, fleet_worker, &fleet->workers[x]);
+        for (x = 0; x != nworkers; ++x)
+                pthread_join(fleet->workers[x].thread, NULL);
+
+        /* Summary */
+        for (x = 0; x != fleet->njobs; ++x) {
+                struct fleet_job *job = &fleet->jobs[x];
+                if (!job->opened)
+                        ++unopened;
+                else if (job->status)
+                        ++bad;
+                else
+                        ++ok;
+                if (job->vtoc_errors)
+                        ++vtoc_bad;
+                if (job->crosslinks)
+                        ++crosslinked;
+                if (job->fixes) {
+                        fixes += job->fixes;
+                        ++fixed;
+                }
+                reads += job->stat_reads;
+                writes += job->stat_writes;
+                hits += job->stat_hits;
+                free(job->path);
+        }
+        /* Keep standard output all JSON */
+        sum = (fleet->json ? stderr : stdout);
+        fprintf(sum, "%d images: %d OK, %d with errors, %d could not be opened\n", fleet->njobs, ok, bad, unopened);
+        if (!strcmp(argv[0], "check") || !strcmp(argv[0], "fix"))
+                fprintf(sum, "  %d with VTOC mismatches, %d with cross-linked sectors\n", vtoc_bad, crosslinked);
+        if (fixed)
+                fprintf(sum, "  %d fixes made in %d images\n", fixes, fixed);
+        if (show_stats)
+                fprintf(stderr, "%ld sector reads, %ld cache hits, %ld sector writes\n", reads, hits, writes);
+
+        free(fleet->workers);
+        free(fleet->jobs);
+        free(walk_paths);
+        walk_paths = 0;
+        walk_n = walk_size = 0;
+        return (bad || unopened) ? 1 : 0;
+}
+
+/* SHA-256, for the store */
+
+struct sha256 {
+        uint32_t h[8];
+        uint64_t len; /* Bytes hashed so far */
+        unsigned char buf[64];
+        int n; /* Bytes in buf */
+};
+
+static const uint32_t sha256_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(struct sha256 *s)
+{
+        static const uint32_t h0[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(s->h, h0, sizeof(h0));
+        s->len = 0;
+        s->n = 0;
+}
+
+void sha256_block(struct sha256 *s, const unsigned char *p)
+{
+        uint32_t w[64];
+        uint32_t a, b, c, d, e, f, g, h;
+        int x;
+        for (x = 0; x != 16; ++x)
+                w[x] = ((uint32_t)p[x * 4] << 24) | ((uint32_t)p[x * 4 + 1] << 16) |
+                       ((uint32_t)p[x * 4 + 2] << 8) | p[x * 4 + 3];
+        for (; x != 64; ++x) {
+                uint32_t s0 = ROR32(w[x - 15], 7) ^ ROR32(w[x - 15], 18) ^ (w[x - 15] >> 3);
+                uint32_t s1 = ROR32(w[x - 2], 17) ^ ROR32(w[x - 2], 19) ^ (w[x - 2] >> 10);
+                w[x] = w[x - 16] + s0 + w[x - 7] + s1;
+        }
+        a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+        e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+        for (x = 0; x != 64; ++x) {
+                uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[x] + w[x];
+                uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g; g = f; f = e; e = d + t1;
+                d = c; c = b; b = a; a = t1 + t2;
+        }
+        s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+        s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void sha256_update(struct sha256 *s, const unsigned char *p, size_t len)
+{
+        s->len += len;
+        while (len) {
+                size_t amnt = 64 - s->n;
+                if (amnt > len)
+                        amnt = len;
+                memcpy(s->buf + s->n, p, amnt);
+                s->n += amnt;
+                p += amnt;
+                len -= amnt;
+                if (s->n == 64) {
+                        sha256_block(s, s->buf);
+                        s->n = 0;
+                }
+        }
+}
+
+/* Finish and write hash as 64 hex digits */
+
+void sha256_hex(struct sha256 *s, char *hex)
+{
+        uint64_t bits = s->len * 8;
+        unsigned char pad[72];
+        int padlen = (s->n < 56 ? 56 : 120) - s->n;
+        int x;
+        memset(pad, 0, sizeof(pad));
+        pad[0] = 0x80;
+        for (x = 0; x != 8; ++x)
+                pad[padlen + x] = (unsigned char)(bits >> (56 - 8 * x));
+        sha256_update(s, pad, padlen + 8);
+        for (x = 0; x != 8; ++x)
+                sprintf(hex + x * 8, "%08x", s->h[x]);
+}
+
+void sha256_str(const unsigned char *p, size_t len, char *hex)
+{
+        struct sha256 s;
+        sha256_init(&s);
+        sha256_update(&s, p, len);
+        sha256_hex(&s, hex);
+}
+
+/* Deduplicating store
+ *
+ * atr --store DIR ingest images...   Add images to the store
+ * atr --store DIR restore image out  Rebuild an image byte for byte
+ * atr --store DIR which what         List images which contain a file
+ *
+ * Objects are kept in DIR/objects/xx/yyy..., named by the SHA-256 of their
+ * contents.  There are two kinds: the contents of each file (the data bytes
+ * of its sector chain), and raw sectors which are not part of any file.  An
+ * image is kept as a recipe in DIR/images/HASH (HASH is that of the whole
+ * image), a text file:
+ *
+ *      atr-store 1
+ *      image HASH SIZE SECTOR-SIZE
+ *      header 16-BYTE-HEADER-IN-HEX
+ *      file N HASH LENGTH NAME               One for each file
+ *      SECT f N OFFSET TRAILER-IN-HEX        File sector
+ *      SECT r HASH                           Raw sector
+ *      tail HASH                             Bytes after the last sector
+ *
+ * A file sector is rebuilt from LENGTH bytes of file N starting at OFFSET
+ * (LENGTH is the byte count in the trailer), zero fill, then the trailer.
+ * Sectors which don't come out the same way are kept raw.  Sectors which are
+ * all zero are left out.
+ *
+ * DIR/index has a line for each file of each image: file hash, image hash,
+ * Atari name and the image's path, tab separated.  DIR/names has the image
+ * hash and path of every image ingested.
+ */
+
+#define HASH_SIZE 65 /* 64 hex digits and a NUL */
+
+/* Write object unless we have it: returns 1 if new, 0 if not, -1 for error */
+
+int put_object(char *dir, unsigned char *data, long len, char *hash)
+{
+        char path[1024];
+        char tmp[1100];
+        struct stat st;
+        FILE *f;
+        sha256_str(data, len, hash);
+        snprintf(path, sizeof(path), "%s/objects/%.2s", dir, hash);
+        mkdir(path, 0777);
+        snprintf(path, sizeof(path), "%s/objects/%.2s/%s", dir, hash, hash + 2);
+        if (!stat(path, &st))
+                return 0;
+        /* Write it under a temporary name, so no one sees half an object */
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+        f = fopen(tmp, "w");
+        if (!f) {
+                fprintf(stderr, "Couldn't create '%s'\n", tmp);
+                return -1;
+        }
+        if (len != fwrite(data, 1, len, f) || fclose(f) || rename(tmp, path)) {
+                fprintf(stderr, "Couldn't write '%s'\n", path);
+                remove(tmp);
+                return -1;
+        }
+        return 1;
+}
+
+/* Read object, returns malloc block with its contents or 0 */
+
+unsigned char *get_object(char *dir, char *hash, long *len)
+{
+        char path[1024];
+        char check[HASH_SIZE];
+        struct stat st;
+        unsigned char *data;
+        FILE *f;
+        snprintf(path, sizeof(path), "%s/objects/%.2s/%s", dir, hash, hash + 2);
+        f = fopen(path, "r");
+        if (!f || fstat(fileno(f), &st)) {
+                fprintf(stderr, "Missing object %s\n", hash);
+                if (f)
+                        fclose(f);
+                return 0;
+        }
+        data = (unsigned char *)malloc(st.st_size + 1);
+        *len = fread(data, 1, st.st_size, f);
+        fclose(f);
+        sha256_str(data, *len, check);
+        if (*len != st.st_size || strcmp(check, hash)) {
+                fprintf(stderr, "Object %s is damaged\n", hash);
+                free(data);
+                return 0;
+        }
+        return data;
+}
+
+/* Append a line to one of the store's lists */
+
+int store_append(char *dir, char *list, char *line)
+{
+        char path[1024];
+        FILE *f;
+        snprintf(path, sizeof(path), "%s/%s", dir, list);
+        f = fopen(path, "a");
+        if (!f || fputs(line, f) == EOF || fclose(f)) {
+                fprintf(stderr, "Couldn't write '%s'\n", path);
+                return -1;
+        }
+        return 0;
+}
+
+/* Add one image to the store */
+
+int ingest(char *dir, char *path)
+{
+        struct atr_volume *vol = new_volume();
+        unsigned char *image = 0;
+        int *owner = 0; /* File index for each sector, or -1 */
+        long *where = 0; /* Offset within its file */
+        char hash[HASH_SIZE];
+        char recipe[1024];
+        char tmp[1100];
+        char line[1024];
+        struct stat st;
+        FILE *f = 0;
+        int nsects;
+        int nfiles = 0, new_files = 0, raw = 0, new_raw = 0;
+        long new_bytes = 0;
+        int rtn = -1;
+        int x, n;
+
+        if (open_disk(vol, path, 0))
+                goto done;
+        if (vol->imd) {
+                fprintf(stderr, "'%s': ImageDisk images can't be stored, convert them with imd2atr\n", path);
+                goto done;
+        }
+        if (vol->fs == FS_SPARTA) {
+                /* Files are reached through sector maps, not chains of
+                 * sectors with links and byte counts, so the recipe can't
+                 * describe them */
+                fprintf(stderr, "'%s': SpartaDOS images can't be stored\n", path);
+                goto done;
+        }
+
+        /* Whole image, for its hash and the raw parts */
+        image = (unsigned char *)malloc(vol->disk_map_size + 1);
+        if (vol->disk_map) {
+                memcpy(image, vol->disk_map, vol->disk_map_size);
+        } else if (fseek(vol->disk, 0, SEEK_SET) ||
+                   vol->disk_map_size != fread(image, 1, vol->disk_map_size, vol->disk)) {
+                fprintf(stderr, "Couldn't read '%s'\n", path);
+                goto done;
+        }
+        sha256_str(image, vol->disk_map_size, hash);
+        snprintf(recipe, sizeof(recipe), "%s/images/%s", dir, hash);
+        if (!stat(recipe, &st)) {
+                printf("%s: already stored as %s\n", path, hash);
+                snprintf(line, sizeof(line), "%s\t%s\n", hash, path);
+                rtn = store_append(dir, "names", line);
+                goto done;
+        }
+
+        nsects = image_sects(vol);
+        owner = (int *)malloc((nsects + 1) * sizeof(int));
+        where = (long *)malloc((nsects + 1) * sizeof(long));
+        for (x = 0; x <= nsects; ++x)
+                owner[x] = -1;
+
+        snprintf(tmp, sizeof(tmp), "%s.%d", recipe, (int)getpid());
+        f = fopen(tmp, "w");
+        if (!f) {
+                fprintf(stderr, "Couldn't create '%s'\n", tmp);
+                goto done;
+        }
+        fprintf(f, "atr-store 1\n");
+        fprintf(f, "image %s %ld %d %d\n", hash, vol->disk_map_size, vol->sector_size, vol->layout);
+        fprintf(f, "header ");
+        for (x = 0; x != 16 && x < vol->disk_map_size; ++x)
+                fprintf(f, "%2.2x", image[x]);
+        fprintf(f, "\n");
+
+        /* Physical and SIO layouts have bytes around the boot sectors which
+         * aren't in any sector */
+        if (vol->layout != LAYOUT_LOGICAL && nsects > BOOT_SECTS) {
+                unsigned char gap[BOOT_SECTS * DD_SECTOR_SIZE];
+                char ghash[HASH_SIZE];
+                int len = 0;
+                for (x = 1; x <= BOOT_SECTS; ++x) {
+                        long ofst = sect_offset(vol, x, &n) + n;
+                        long end = (x == BOOT_SECTS ? vol->data_start : sect_offset(vol, x + 1, &n));
+                        memcpy(gap + len, image + ofst, end - ofst);
+                        len += end - ofst;
                 }
-                printf("\n%d entries\n", name_n);
-                printf("\n%d sectors, %d bytes\n", totals, total_bytes);
-                printf("\n");
-                do_free();
-                printf("\n");
-        } else if (single) {
-                int x;
-                for (x = 0; x != name_n; ++x) {
-                        printf("%s\n", names[x]->name);
+                for (n = 0; n != len && !gap[n]; ++n);
+                if (n != len) {
+                        int r = put_object(dir, gap, len, ghash);
+                        if (r < 0)
+                                goto done;
+                        if (r)
+                                new_bytes += len;
+                        fprintf(f, "gap %s\n", ghash);
                 }
-        } else {
-
-                /* Rows of 12 names each ordered like ls */
+        }
 
-                rows = (name_n + cols - 1) / cols;
+        /* Files: contents are the data bytes of the chain */
+        read_dir(vol, 1, INFO_NAME);
+        for (n = 0; n != vol->name_n; ++n) {
+                struct name *nam = vol->names[n];
+                unsigned char *data;
+                char fhash[HASH_SIZE];
+                long len = 0;
+                int count = 0;
+                int sector = nam->sector;
+                int r;
+                if (nam->is_dir)
+                        continue;
+                data = (unsigned char *)malloc(nsects * vol->sector_size + 1);
+                while (sector > 0 && sector <= nsects && owner[sector] == -1 && count++ != max_chain(vol)) {
+                        int size;
+                        unsigned char *buf = image + sect_offset(vol, sector, &size);
+                        /* A count no sector can hold isn't file data: the
+                         * chain stops and the sector is stored raw */
+                        if (buf[vol->data_bytes] > vol->data_size)
+                                break;
+                        owner[sector] = nfiles;
+                        where[sector] = len;
+                        memcpy(data + len, buf, buf[vol->data_bytes]);
+                        len += buf[vol->data_bytes];
+                        sector = get_link(vol, buf);
+                }
+                r = put_object(dir, data, len, fhash);
+                free(data);
+                if (r < 0)
+                        goto done;
+                if (r) {
+                        ++new_files;
+                        new_bytes += len;
+                }
+                fprintf(f, "file %d %s %ld %s\n", nfiles++, fhash, len, nam->name);
+                snprintf(line, sizeof(line), "%s\t%s\t%s\t%s\n", fhash, hash, nam->name, path);
+                if (store_append(dir, "index", line))
+                        goto done;
+        }
 
-                for (y = 0; y != rows; ++y) {
-                        for (x = 0; x != cols; ++x) {
-                                int n = y + x * rows;
-                                /* printf("%11d  ", n); */
-                                if (n < name_n)
-                                        printf("%-12s ", names[n]->name);
-                                else
-                                        printf("             ");
+        /* Sectors */
+        for (x = 1; x <= nsects; ++x) {
+                int size;
+                unsigned char *buf = image + sect_offset(vol, x, &size);
+                unsigned char rebuilt[DD_SECTOR_SIZE];
+                char shash[HASH_SIZE];
+                int r;
+                for (n = 0; n != size && !buf[n]; ++n);
+                if (n == size)
+                        continue;
+                if (owner[x] != -1 && buf[vol->data_bytes] <= vol->data_size) {
+                        /* Would it come out the same from the file? */
+                        memset(rebuilt, 0, size);
+                        memcpy(rebuilt, buf, buf[vol->data_bytes]);
+                        memcpy(rebuilt + vol->data_size, buf + vol->data_size, size - vol->data_size);
+                        if (!memcmp(rebuilt, buf, size)) {
+                                fprintf(f, "%d f %d %ld ", x, owner[x], where[x]);
+                                for (n = vol->data_size; n != size; ++n)
+                                        fprintf(f, "%2.2x", buf[n]);
+                                fprintf(f, "\n");
+                                continue;
                         }
-                        printf("\n");
                 }
+                r = put_object(dir, buf, size, shash);
+                if (r < 0)
+                        goto done;
+                ++raw;
+                if (r) {
+                        ++new_raw;
+                        new_bytes += size;
+                }
+                fprintf(f, "%d r %s\n", x, shash);
+        }
+
+        /* Anything after the last whole sector */
+        n = sect_offset(vol, nsects + 1, &x);
+        if (n < vol->disk_map_size) {
+                char thash[HASH_SIZE];
+                int r = put_object(dir, image + n, vol->disk_map_size - n, thash);
+                if (r < 0)
+                        goto done;
+                if (r)
+                        new_bytes += vol->disk_map_size - n;
+                fprintf(f, "tail %s\n", thash);
+        }
+
+        if (fclose(f) || rename(tmp, recipe)) {
+                f = 0;
+                fprintf(stderr, "Couldn't write '%s'\n", recipe);
+                goto done;
+        }
+        f = 0;
+        snprintf(line, sizeof(line), "%s\t%s\n", hash, path);
+        if (store_append(dir, "names", line))
+                goto done;
+        printf("%s: stored as %s\n", path, hash);
+        printf("  %d files (%d new), %d raw sectors (%d new), %ld new bytes\n",
+               nfiles, new_files, raw, new_raw, new_bytes);
+        rtn = 0;
+
+        done:
+        if (f) {
+                fclose(f);
+                remove(tmp);
         }
+        if (vol->disk)
+                close_disk(vol);
+        free_volume(vol);
+        free(image);
+        free(owner);
+        free(where);
+        return rtn;
 }
 
-int mkfs(char *disk_name, int type, char* boot_sectors_file_path)
+/* Find image by hash or by the path it was ingested from */
+
+int find_image(char *dir, char *what, char *hash)
 {
-        unsigned char hdr[16];
-        unsigned char bf[256];
-        unsigned char bitmap[ED_BITMAP_SIZE];
-        int size;
-        int n;
-        disk = fopen(disk_name, "w+");
-        if (!disk) {
-                fprintf(stderr, "Couldn't open '%s'\n", disk_name);
+        char path[1024];
+        char *line = 0;
+        size_t size = 0;
+        struct stat st;
+        FILE *f;
+        int found = 0;
+        snprintf(path, sizeof(path), "%s/images/%s", dir, what);
+        if (strlen(what) == HASH_SIZE - 1 && !stat(path, &st)) {
+                strcpy(hash, what);
+                return 0;
+        }
+        snprintf(path, sizeof(path), "%s/names", dir);
+        f = fopen(path, "r");
+        while (f && getline(&line, &size, f) > 0) {
+                char *tab = strchr(line, '\t');
+                line[strcspn(line, "\n")] = 0;
+                if (tab && tab - line == HASH_SIZE - 1 && !strcmp(tab + 1, what)) {
+                        memcpy(hash, line, HASH_SIZE - 1);
+                        hash[HASH_SIZE - 1] = 0;
+                        found = 1;
+                }
+        }
+        free(line);
+        if (f)
+                fclose(f);
+        if (!found) {
+                fprintf(stderr, "No image '%s' in store\n", what);
                 return -1;
         }
-        /* .ATR header */
-        memset(hdr, 0, 16);
-        hdr[0] = 0x96;
-        hdr[1] = 0x02;
-        switch (type) {
-                case 1: {
-                        disk_size = SD_DISK_SIZE;
-                        size = 40*18*128;
-                        hdr[2] = size/16;
-                        hdr[3] = size/16/256;
-                        hdr[4] = 0x80;
-                        hdr[5] = 0x00;
-                        break;
-                } case 2: {
-                        disk_size = ED_DISK_SIZE;
-                        size = 40*26*128;
-                        hdr[2] = size/16;
-                        hdr[3] = size/16/256;
-                        hdr[4] = 0x80;
-                        hdr[5] = 0x00;
-                        break;
-                } case 3: {
-                        disk_size = DD_DISK_SIZE;
-                        set_density(1);
-                        size = 40*18*256 - 3*128;
-                        hdr[2] = size/16;
-                        hdr[3] = size/16/256;
-                        hdr[4] = 0x00;
-                        hdr[5] = 0x01;
+        return 0;
+}
+
+/* Rebuild an image */
+
+int restore(char *dir, char *what, char *out_name)
+{
+        char hash[HASH_SIZE];
+        char check[HASH_SIZE];
+        char path[1024];
+        char *line = 0;
+        size_t line_size = 0;
+        unsigned char **files = 0; /* File contents */
+        long *file_len = 0;
+        int nfiles = 0;
+        unsigned char *image = 0;
+        long size = 0;
+        struct atr_volume *vol = new_volume();
+        FILE *f;
+        int rtn = -1;
+        int x;
+
+        if (find_image(dir, what, hash))
+                goto done;
+        snprintf(path, sizeof(path), "%s/images/%s", dir, hash);
+        f = fopen(path, "r");
+        if (!f) {
+                fprintf(stderr, "Couldn't open '%s'\n", path);
+                goto done;
+        }
+        while (getline(&line, &line_size, f) > 0) {
+                char a[HASH_SIZE];
+                long n, m;
+                int sect, idx;
+                int layout = LAYOUT_LOGICAL;
+                if (sscanf(line, "image %64s %ld %ld %d", a, &n, &m, &layout) >= 3) {
+                        size = n;
+                        image = (unsigned char *)calloc(size + DD_SECTOR_SIZE, 1);
+                        if (m == DD_SECTOR_SIZE)
+                                set_density(vol, 1);
+                        set_layout(vol, layout);
+                        vol->disk_map_size = size;
+                } else if (!image) {
+                        if (strcmp(line, "atr-store 1\n"))
+                                break;
+                } else if (!strncmp(line, "header ", 7)) {
+                        for (x = 0; x != 16 && sscanf(line + 7 + x * 2, "%2x", &idx) == 1; ++x)
+                                image[x] = idx;
+                } else if (sscanf(line, "file %d %64s %ld", &idx, a, &n) == 3) {
+                        if (idx != nfiles)
+                                break;
+                        files = (unsigned char **)realloc(files, (nfiles + 1) * sizeof(unsigned char *));
+                        file_len = (long *)realloc(file_len, (nfiles + 1) * sizeof(long));
+                        files[nfiles] = get_object(dir, a, &file_len[nfiles]);
+                        if (!files[nfiles++])
+                                break;
+                } else if (sscanf(line, "%d f %d %ld %64s", &sect, &idx, &n, a) == 4) {
+                        int ssize;
+                        long off = sect_offset(vol, sect, &ssize);
+                        int tlen = ssize - vol->data_size;
+                        int bytes;
+                        if (sect < 1 || idx < 0 || idx >= nfiles || off + ssize > size || strlen(a) != tlen * 2)
+                                break;
+                        for (x = 0; x != tlen; ++x) {
+                                sscanf(a + x * 2, "%2x", &bytes);
+                                image[off + vol->data_size + x] = bytes;
+                        }
+                        bytes = image[off + vol->data_bytes];
+                        if (n + bytes > file_len[idx])
+                                break;
+                        memcpy(image + off, files[idx] + n, bytes);
+                } else if (sscanf(line, "%d r %64s", &sect, a) == 2) {
+                        int ssize;
+                        long off = sect_offset(vol, sect, &ssize);
+                        unsigned char *data = get_object(dir, a, &n);
+                        if (!data || sect < 1 || n != ssize || off + ssize > size) {
+                                free(data);
+                                break;
+                        }
+                        memcpy(image + off, data, ssize);
+                        free(data);
+                } else if (sscanf(line, "tail %64s", a) == 1) {
+                        unsigned char *data = get_object(dir, a, &n);
+                        if (!data || n > size) {
+                                free(data);
+                                break;
+                        }
+                        memcpy(image + size - n, data, n);
+                        free(data);
+                } else if (sscanf(line, "gap %64s", a) == 1) {
+                        unsigned char *data = get_object(dir, a, &n);
+                        long len = 0;
+                        if (!data)
+                                break;
+                        for (x = 1; x <= BOOT_SECTS; ++x) {
+                                int ssize;
+                                long ofst = sect_offset(vol, x, &ssize) + ssize;
+                                long end = (x == BOOT_SECTS ? vol->data_start : sect_offset(vol, x + 1, &ssize));
+                                if (len + end - ofst > n || end > size)
+                                        break;
+                                memcpy(image + ofst, data + len, end - ofst);
+                                len += end - ofst;
+                        }
+                        free(data);
+                        if (len != n)
+                                break;
+                } else {
                         break;
                 }
         }
-        if (16 != fwrite(hdr, 1, 16, disk)) {
-                fprintf(stderr, "Couldn't write to '%s'\n", disk_name);
-                return -1;
+        fclose(f);
+        sha256_str(image ? image : (unsigned char *)"", size, check);
+        if (!image || strcmp(check, hash)) {
+                fprintf(stderr, "Recipe for %s is damaged, not restoring\n", hash);
+                goto done;
         }
-        memset(bf, 0, 256);
-        for (n = 0; n != size; n += 128) {
-                if (128 != fwrite(bf, 1, 128, disk)) {
-                        fprintf(stderr, "Couldn't write to '%s'\n", disk_name);
+        f = fopen(out_name, "w");
+        if (!f || size != fwrite(image, 1, size, f) || fclose(f)) {
+                fprintf(stderr, "Couldn't write '%s'\n", out_name);
+                goto done;
+        }
+        printf("%s: restored %s, %ld bytes\n", out_name, hash, size);
+        rtn = 0;
+
+        done:
+        for (x = 0; x != nfiles; ++x)
+                free(files[x]);
+        free(files);
+        free(file_len);
+        free(image);
+        free(line);
+        free_volume(vol);
+        return rtn;
+}
+
+/* List images which contain a file.  what is a file hash, a local file
+ * (which is hashed), or an Atari file name. */
+
+int which(char *dir, char *what)
+{
+        char hash[HASH_SIZE];
+        char path[1024];
+        char *line = 0;
+        size_t size = 0;
+        struct stat st;
+        FILE *f;
+        int by_name = 0;
+        int found = 0;
+
+        if (strlen(what) == HASH_SIZE - 1 && strspn(what, "0123456789abcdef") == HASH_SIZE - 1) {
+                strcpy(hash, what);
+        } else if (!stat(what, &st) && S_ISREG(st.st_mode)) {
+                unsigned char *data = (unsigned char *)malloc(st.st_size + 1);
+                f = fopen(what, "r");
+                if (!f || st.st_size != fread(data, 1, st.st_size, f)) {
+                        fprintf(stderr, "Couldn't read '%s'\n", what);
+                        if (f)
+                                fclose(f);
+                        free(data);
                         return -1;
                 }
-        }
-        /* VTOC */
-        bf[0] = 2;
-        if (disk_size == ED_DISK_SIZE) {
-                bf[1] = (255 & 1010);
-                bf[2] = 1010/256;
+                fclose(f);
+                sha256_str(data, st.st_size, hash);
+                free(data);
         } else {
-                bf[1] = (255 & 707);
-                bf[2] = 707/256;
+                by_name = 1;
         }
-        putsect(bf, SECTOR_VTOC);
-        memset(bitmap, 0xFF, ED_BITMAP_SIZE);
-        mark_space(bitmap, 0, 1); /* Sector zero */
-        mark_space(bitmap, 1, 1); /* Boot sectors */
-        mark_space(bitmap, 2, 1);
-        mark_space(bitmap, 3, 1);
-        mark_space(bitmap, SECTOR_VTOC, 1); /* VTOC */
-        for (n = 0; n != SECTOR_DIR_SIZE; ++n) /* DIR */
-                mark_space(bitmap, SECTOR_DIR + n, 1);
-        mark_space(bitmap, 720, 1); /* Reserved */
-        putmap(bitmap);
-        if (boot_sectors_file_path != NULL) {
-                FILE* boot_sectors_file = fopen(boot_sectors_file_path, "rb");
-                if (!boot_sectors_file) {
-                        fprintf(stderr, "Couldn't open '%s'\n", boot_sectors_file_path);
-                        return -1;
+
+        snprintf(path, sizeof(path), "%s/index", dir);
+        f = fopen(path, "r");
+        while (f && getline(&line, &size, f) > 0) {
+                char *fields[4];
+                char *p = line;
+                int n;
+                line[strcspn(line, "\n")] = 0;
+                for (n = 0; n != 4 && p; ++n) {
+                        fields[n] = p;
+                        p = strchr(p, '\t');
+                        if (p)
+                                *p++ = 0;
                 }
-                n=0;
-                while (n++, !feof(boot_sectors_file)) {
-                        size = ( n < 3 ? SECTOR_SIZE : sector_size);
-                        size = fread(bf, size, 1, boot_sectors_file);
-                        putsect(bf, n);
+                if (n != 4)
+                        continue;
+                if (by_name ? !strcasecmp(fields[2], what) : !strcmp(fields[0], hash)) {
+                        printf("%s\t%s\t%s\n", fields[3], fields[2], fields[1]);
+                        ++found;
                 }
-                fclose(boot_sectors_file);
         }
-        fclose(disk);
+        free(line);
+        if (f)
+                fclose(f);
+        if (!found) {
+                fprintf(stderr, "Not found\n");
+                return 1;
+        }
         return 0;
 }
 
+int store(char *dir, int argc, char *argv[])
+{
+        char path[1024];
+        int rtn = 0;
+        int x;
+        mkdir(dir, 0777);
+        snprintf(path, sizeof(path), "%s/objects", dir);
+        mkdir(path, 0777);
+        snprintf(path, sizeof(path), "%s/images", dir);
+        mkdir(path, 0777);
+        if (argc >= 2 && !strcmp(argv[0], "ingest")) {
+                for (x = 1; x != argc; ++x)
+                        if (ingest(dir, argv[x]))
+                                rtn = 1;
+                return rtn;
+        } else if (argc == 3 && !strcmp(argv[0], "restore")) {
+                return restore(dir, argv[1], argv[2]);
+        } else if (argc == 2 && !strcmp(argv[0], "which")) {
+                return which(dir, argv[1]);
+        }
+        fprintf(stderr, "Store commands are: ingest images..., restore image out-file, which file\n");
+        return -1;
+}
+
 int main(int argc, char *argv[])
 {
-        int all = 0;
-        int full = 0;
-        int single = 0;
-        long size;
+        struct atr_volume *vol;
+        int show_stats = 0;
+        int jobs = 0;
+        int prefix = 0;
+        char *store_dir = 0;
         int x;
+        int rtn;
         char *disk_name;
         x = 1;
+        /* Global options */
+        while (x != argc && argv[x][0] == '-') {
+                if (!strcmp(argv[x], "--stats"))
+                        show_stats = 1;
+                else if (!strcmp(argv[x], "-j") && x + 1 != argc)
+                        jobs = atoi(argv[++x]);
+                else if (!strncmp(argv[x], "-j", 2) && argv[x][2])
+                        jobs = atoi(argv[x] + 2);
+                else if (!strcmp(argv[x], "-p"))
+                        prefix = 1;
+                else if (!strcmp(argv[x], "--store") && x + 1 != argc)
+                        store_dir = argv[++x];
+                else
+                        break;
+                ++x;
+        }
+        if (store_dir)
+                return store(store_dir, argc - x, argv + x);
+        if (jobs) {
+                /* Fleet mode: atr -j N command [options] -- images... */
+                int sep;
+                for (sep = x; sep != argc && strcmp(argv[sep], "--"); ++sep);
+                if (sep == argc) {
+                        fprintf(stderr, "Missing -- before list of images\n");
+                        return -1;
+                }
+                argv[sep] = 0;
+                return fleet(jobs, prefix, show_stats, sep - x, argv + x, argv + sep + 1, argc - sep - 1);
+        }
         if (x == argc || !strcmp(argv[x], "--help") || !strcmp(argv[x], "-h")) {
                 printf("\nAtari DOS 2.0s, DOS 2.0d and DOS 2.5 diskette access\n");
                 printf("\n");
-                printf("Syntax: atr path-to-diskette [command] [args]\n");
+                printf("Syntax: atr [--stats] path-to-diskette [command] [args]\n");
+                printf("        atr [--stats] -j N [-p] command [args] -- paths...\n");
+                printf("        atr --store DIR ingest|restore|which [args]\n");
+                printf("\n");
+                printf("  --stats   Print number of sector reads and writes when done\n");
+                printf("\n");
+                printf("  -j N      Run ls, check, fix, free or x on many images using N threads.\n");
+                printf("            Directories in paths are searched for .atr, .atr.gz, .atz,\n");
+                printf("            .zip and .imd files.  Output is grouped by image, followed by\n");
+                printf("            a summary.  x extracts each image into a directory named\n");
+                printf("            after it.\n");
+                printf("  -p        Prefix each output line with image name instead of grouping\n");
+                printf("\n");
+                printf("  --store DIR ingest images...   Add images to deduplicating store DIR\n");
+                printf("  --store DIR restore image out  Rebuild image (its hash or the path it was\n");
+                printf("                                 ingested from) byte for byte into out\n");
+                printf("  --store DIR which file         List images containing file (a hash, a\n");
+                printf("                                 local file or an Atari file name)\n");
                 printf("\n");
                 printf("  Commands: (with no command, ls is assumed)\n\n");
-                printf("      ls [-la1]                    Directory listing\n");
+                printf("      ls [-la1] [dir]              Directory listing\n");
                 printf("                  -l for long\n");
                 printf("                  -a to show system files\n");
                 printf("                  -1 to show a single name per line\n\n");
-                printf("      cat [-l] atari-name           Type file to console\n");
-                printf("                  -l to convert line ending from 0x9b to 0x0a\n\n");
-                printf("      get [-l] atari-name [local-name]\n");
+                printf("      ls [-a] --fields=F,F...       List chosen fields, tab separated, one\n");
+                printf("                                    file per line.  Fields are name, flags,\n");
+                printf("                                    start, sects, size and segs\n\n");
+                printf("      cat [-ltu] atari-name         Type file to console\n");
+                printf("                  -l to convert line ending from 0x9b to 0x0a\n");
+                printf("                  -t same, and Atari tab 0x7f to 0x09\n");
+                printf("                  -u to convert ATASCII to UTF-8 (includes -t)\n\n");
+                printf("      get [-ltu] atari-name [local-name]\n");
                 printf("                                    Copy file from diskette to local-name\n");
-                printf("                  -l to convert line ending from 0x9b to 0x0a\n\n");
-                printf("      x [-a]                        Extract all files\n");
-                printf("                  -a to include system files\n\n");
-                printf("      put local-name [atari-name]\n");
+                printf("                  -l to convert line ending from 0x9b to 0x0a\n");
+                printf("                  -t same, and Atari tab 0x7f to 0x09\n");
+                printf("                  -u to convert ATASCII to UTF-8 (includes -t)\n\n");
+                printf("      x [-a] [-ltu] [dir]           Extract all files, and subdirectories\n");
+                printf("                  -a to include system files\n");
+                printf("                  -l, -t, -u as for get\n\n");
+                printf("      put [-ltu] [--alloc=P] local-name [atari-name]\n");
                 printf("                                    Copy file from local-name to diskette\n");
-                printf("                  -l to convert line ending from 0x0a to 0x9b\n\n");
-                printf("      w names...                    Write all named files to diskette\n\n");
+                printf("      put [-ltu] [--alloc=P] local-names...\n");
+                printf("                                    Copy three or more files to diskette\n");
+                printf("                  -l to convert line ending from 0x0a to 0x9b\n");
+                printf("                  -t same, and tab 0x09 to Atari tab 0x7f\n");
+                printf("                  -u to convert UTF-8 to ATASCII (includes -t)\n");
+                printf("                  local-name - reads standard input (atari-name needed);\n");
+                printf("                  pipes are read as a stream too\n\n");
+                printf("      w [--alloc=P] names...        Write all named files to diskette\n\n");
+                printf("                  --alloc=P picks where file sectors go:\n");
+                printf("                    first   lowest free sectors, as DOS does (default)\n");
+                printf("                    contig  first free run the file fits in\n");
+                printf("                    skew[:N] follow disk rotation, allowing N sectors\n");
+                printf("                            to pass after each (default: the\n");
+                printf("                            standard interleave)\n\n");
+                printf("      xex [-v] [-m local-name] atari-name\n");
+                printf("                                    Show segments of a binary load file\n");
+                printf("                  -v to check it for damage and odd addresses\n");
+                printf("                  -m to write a copy with segments that are contiguous\n");
+                printf("                     in memory merged\n\n");
                 printf("      free                          Print amount of free space\n\n");
                 printf("      mv old-name new-name          Rename a file\n\n");
                 printf("      rm atari-name                 Delete a file\n\n");
-                printf("      check                         Check filesystem (read only)\n\n");
-                printf("      fix                           Check and fix filesystem (prompts\n");
-                printf("                                    for each fix).\n\n");
+                printf("      check [--json]                Check filesystem (read only)\n\n");
+                printf("      fix [--policy=P] [--json]     Check and fix filesystem (prompts\n");
+                printf("                                    for each fix).\n");
+                printf("                  --policy=all to make every fix without asking\n");
+                printf("                  --policy=safe to fix only counts, open flags and the\n");
+                printf("                    VTOC header, never file sectors or the bitmap\n");
+                printf("                  --policy=none to only report\n");
+                printf("                  --json to print one JSON record per finding instead\n");
+                printf("                    of the report (needs --policy with fix)\n\n");
+                printf("      defrag [--dry-run]            Rewrite files contiguously in\n");
+                printf("                                    directory order (DOS 2 only)\n");
+                printf("                  --dry-run to only report how many sectors would move\n\n");
                 printf("      mkfs dos2.0s|dos2.0d|dos2.5 [file with boot sectors]\n");
-                printf("                                    Write a new filesystem\n");
+                printf("                                    Write a new filesystem\n\n");
+                printf("  On MyDOS and SpartaDOS volumes, atari-name and dir can be a path such as\n");
+                printf("  games/pong.com (or games>pong.com).\n");
                 return -1;
         }
         disk_name = argv[x++];
@@ -1662,184 +6533,25 @@ int main(int argc, char *argv[])
                         // file containing bootsectors specified
                         boot_sectors_file_path = argv[x+1];
                 }
-                return mkfs(disk_name, type, boot_sectors_file_path);
-        }
-
-        /* Open disk image */
-        disk = fopen(disk_name, "r+");
-        if (!disk) {
-                fprintf(stderr, "Couldn't open '%s'\n", disk_name);
-                return -1;
+                vol = new_volume();
+                rtn = mkfs(vol, disk_name, type, boot_sectors_file_path);
+                free_volume(vol);
+                return rtn;
         }
 
-        /* Determine image type */
-        if (fseek(disk, 0, SEEK_END)) {
-                fprintf(stderr, "Couldn't seek disk?\n");
-                return -1;
-        }
-        size = ftell(disk);
-//	if (size - 16 == 40 * 18 * 128) {
-        if (size - 16 < 1024 * 128) {
-                /* Minimum size for enhanced density is 1024 sectors */
-                /* Anything less: assume single-density */
-                /* printf("Single density DOS 2.0S disk assumed\n"); */
-                disk_size = SD_DISK_SIZE;
-//	} else if (size - 16 == 40 * 26 * 128) {
-        } else if (size - 16 < 128*3 + 256*717) {
-                /* Minimum size of double density is 3 128 byte sectors + 717 256 byte sectors */
-                /* Anything less: assume enhanced density */
-                /* printf("Enhanced density DOS 2.5 disk assumed\n"); */
-                disk_size = ED_DISK_SIZE;
-        } else if (size - 16 == 128*3 + 256*717) {
-                disk_size = SD_DISK_SIZE;
-                set_density(1);
-                /* printf("Double density DOS 2.0D disk assumed\n"); */
-        } else {
-                printf("Unknown disk size.  Expected:\n");
-                printf("  .ATR header is 16 bytes, so:\n");
-                printf("  16 + 40*18*128 = 92,176 bytes for DOS 2.0s single density\n");
-                printf("  16 + 40*26*128 = 133,136 bytes for DOS 2.5 enhanced density\n");
-                printf("  16 + 40*18*256 - 3*128 = 183,952 bytes for DOS 2.0d double density\n");
+        /* Open disk image: only commands which modify it need write access */
+        vol = new_volume();
+        if (open_disk(vol, disk_name, is_writer(argc, argv, x))) {
+                free_volume(vol);
                 return -1;
         }
 
-        /* Directory options */
-        dir:
-        while (x != argc && argv[x][0] == '-') {
-                int y;
-                for (y = 1;argv[x][y];++y) {
-                        int opt = argv[x][y];
-                        switch (opt) {
-                                case 'l': full = 1; break;
-                                case 'a': all = 1; break;
-                                case '1': single = 1; break;
-                                default: printf("Unknown option '%c'\n", opt); return -1;
-                        }
-                }
-                ++x;
-        }
-
-        if (x == argc) {
-                /* Just print a directory listing */
-                atari_dir(all, full, single);
-                return status;
-        } else if (!strcmp(argv[x], "ls")) {
-                ++x;
-                goto dir;
-        } else if (!strcmp(argv[x], "free")) {
-                return do_free();
-        } else if (!strcmp(argv[x], "check")) {
-                return do_check();
-        } else if (!strcmp(argv[x], "fix")) {
-                fix = 1;
-                return do_check();
-        } else if (!strcmp(argv[x], "cat")) {
-                ++x;
-                if (x != argc && !strcmp(argv[x], "-l")) {
-                        cvt_ending = 1;
-                        ++x;
-                }
-                if (x == argc) {
-                        fprintf(stderr,"Missing file name to cat\n");
-                        return -1;
-                } else {
-                        cat(argv[x++]);
-                        return status;
-                }
-        } else if (!strcmp(argv[x], "get")) {
-                char *local_name;
-                char *atari_name;
-                ++x;
-                if (x != argc && !strcmp(argv[x], "-l")) {
-                        cvt_ending = 1;
-                        ++x;
-                }
-                if (x == argc) {
-                        printf("Missing file name to get\n");
-                        return -1;
-                }
-                atari_name = argv[x];
-                local_name = atari_name;
-                if (x + 1 != argc)
-                        local_name = argv[++x];
-                return get_file(atari_name, local_name);
-        } else if (!strcmp(argv[x], "x")) {
-                int all_flg = 0;
-                int status = 0;
-                int n;
-                ++x;
-                if (x != argc && !strcmp(argv[x], "-a")) {
-                        all_flg = 1;
-                        ++x;
-                }
-                read_dir(all_flg, 0);
-                for (n = 0; n != name_n; ++n) {
-                        printf("extracting %s\n", names[n]->name);
-                        status |= get_file(names[n]->name, names[n]->name);
-                }
-                return status;
-        } else if (!strcmp(argv[x], "put")) {
-                char *local_name;
-                char *atari_name;
-                ++x;
-                if (x != argc && !strcmp(argv[x], "-l")) {
-                        cvt_ending = 1;
-                        ++x;
-                }
-                if (x == argc) {
-                        fprintf(stderr, "Missing file name to put\n");
-                        return -1;
-                }
-                local_name = argv[x];
-                if (strrchr(local_name, '/'))
-                        atari_name = strrchr(local_name, '/') + 1;
-                else
-                        atari_name = local_name;
-                printf("%s\n", atari_name);
-                if (x + 1 != argc)
-                        atari_name = argv[++x];
-                return put_file(local_name, atari_name);
-        } else if (!strcmp(argv[x], "w")) {
-                int status = 0;
-                ++x;
-                while (argv[x]) {
-                        printf("writing %s\n", argv[x]);
-                        status |= put_file(argv[x], argv[x]);
-                        ++x;
-                }
-                return status;
-        } else if (!strcmp(argv[x], "mv")) {
-                char *old_name;
-                char *new_name;
-                ++x;
-                if (!argv[x]) {
-                        fprintf(stderr,"missing name\n");
-                        return -1;
-                } else {
-                        old_name = argv[x];
-                        ++x;
-                }
-                if (!argv[x]) {
-                        fprintf(stderr,"missing name\n");
-                        return -1;
-                } else {
-                        new_name = argv[x];
-                        ++x;
-                }
-                return atari_rename(old_name, new_name);
-        } else if (!strcmp(argv[x], "rm")) {
-                char *name;
-                ++x;
-                if (x == argc) {
-                        printf("Missing name to delete\n");
-                        return -1;
-                } else {
-                        name = argv[x];
-                }
-                return rm(name, 0);
-        } else {
-                printf("Unknown command '%s'\n", argv[x]);
-                return -1;
-        }
-        return 0;
+        rtn = command(vol, argc, argv, x);
+        if (close_disk(vol))
+                rtn = -1;
+        if (show_stats)
+                fprintf(stderr, "%ld sector reads, %ld cache hits, %ld sector writes\n",
+                        vol->stat_reads, vol->stat_hits, vol->stat_writes);
+        free_volume(vol);
+        return rtn;
 }
@@ -22,15 +22,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <time.h>
+#include "imd.h"
+#include "convert.h"
 
-/* A loaded .ATR image */
+/* An .ATR image being read.  Sector data is read a track at a time, so the
+ * source can be a pipe. */
 
 struct atr {
-	long size; /* Size of data in bytes */
+	FILE *f; /* Source, at the start of the next track's data */
+	long size; /* Size of data in bytes, with the boot sectors as 256 bytes
+	              each if they are stored as 128 */
+	long left; /* Bytes of data in the file not yet read */
 	int type; /* 0 = 128 byte sectors, 1 = 256 byte sectors. */
-	unsigned char *data; /* Sector data */
+	int logical; /* Set if the first three sectors of a 256 byte sector
+	                image are stored as 128 bytes each */
 
 	int cyls; /* No. of tracks */
 	int sects; /* No. of sectors per track */
@@ -47,46 +56,38 @@ struct atr {
 
 void free_atr(struct atr *atr)
 {
-	if (atr->data)
-		free(atr->data);
+	if (atr->f != stdin)
+		fclose(atr->f);
 	free(atr);
 }
 
-/* Interleave map for 90K disks */
-int sd_map[] = 
-  { 1, 3, 5, 7, 9, 11, 13, 15, 17, 2, 4, 6, 8, 10, 12, 14, 16, 18 };
+/* Open .atr image, read its header and decide on the disk format.  The
+ * size of the data comes from the file's size, or from the header when
+ * reading from a pipe (source name "-"). */
 
-/* Interleave map for 130K disks */
-int dd_map[] =
-  { 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26 };
-
-/* Interleave map for 180K disks */
-int hd_map[] = 
-  { 1, 3, 5, 7, 9, 11, 13, 15, 17, 2, 4, 6, 8, 10, 12, 14, 16, 18 };
-
-/* Read .atr image */
-
-struct atr *read_atr(char *name, int force_ed, int force_dd)
+struct atr *read_atr(struct job *job)
 {
 	struct atr *atr;
-	FILE *f = fopen(name, "rb");
+	char *name = show_name(job->source_name);
+	FILE *f = (strcmp(job->source_name, "-") ? fopen(job->source_name, "rb") : stdin);
 	unsigned char header[16];
 	int sec_size; /* Sector size from header */
 	if (!f) {
-		fprintf(stderr, "Couldn't open %s\n", name);
+		fprintf(job->err, "Couldn't open %s\n", name);
 		return 0;
 	}
+	atr = (struct atr *)malloc(sizeof(struct atr));
+	atr->f = f;
+	atr->map = 0;
+	atr->logical = 0;
 	if (1 != fread(header, 16, 1, f)) {
-		fprintf(stderr, "Header missing from %s\n", name);
-		fclose(f);
+		fprintf(job->err, "Header missing from %s\n", name);
+		free_atr(atr);
 		return 0;
 	}
 	if (header[0] != 0x96 || header[1] != 0x02) {
-		fprintf(stderr, "Warning.. magic number is not 0x0296\n");
+		fprintf(job->err, "Warning.. magic number is not 0x0296\n");
 	}
-	atr = (struct atr *)malloc(sizeof(struct atr));
-	atr->map = 0;
-	atr->data =0;
 
 	/* Get image size from header */
 	atr->size = ((long)header[2] + ((long)header[3] << 8) + ((long)header[6] << 16)) * 0x10;
@@ -101,148 +102,159 @@ struct atr *read_atr(char *name, int force_ed, int force_dd)
 	else if (sec_size == 0x100)
 		atr->type = 1;
 	else {
-		fprintf(stderr, "Unknown sector size %d\n", sec_size);
+		fprintf(job->err, "Unknown sector size %d\n", sec_size);
 		free_atr(atr);
-		fclose(f);
 		return 0;
 	}
 
-	/* Get actual image size, don't trust size from header */
-	fseek(f, 0, SEEK_END);
-	atr->size = ftell(f) - 16;
-	fseek(f, 16, SEEK_SET);
-
-	/* Allocate space for image: give extra space to expand boot sectors */
-	atr->data = (unsigned char *)malloc(atr->size + 3 * 128);
-	if (!atr->data) {
-		fprintf(stderr, "Couldn't allocate space for image\n");
-		free_atr(atr);
-		fclose(f);
-		return 0;
-	}
-
-	/* Read image */
-	if (1 != fread(atr->data, atr->size, 1, f)) {
-		fprintf(stderr, "Error reading from file\n");
-		free_atr(atr);
-		fclose(f);
-		return 0;
+	/* Get actual image size, don't trust size from header (unless we
+	 * can't seek) */
+	if (f != stdin && !fseek(f, 0, SEEK_END)) {
+		atr->size = ftell(f) - 16;
+		fseek(f, 16, SEEK_SET);
 	}
-	/* Success! */
-	fclose(f);
-
-	/* Deal with boot sectors */
-	if (sec_size == 256) {
-		if ((atr->size >> 7) & 1) {
-			/* It has an odd number of 128 bytes chunks.. first
-			   three sectors are 128 bytes.  Expand image to make
-			   physical sectors. */
-			memmove(atr->data + 768, atr->data + 384, atr->size - 384);
-			memcpy(atr->data + 512, atr->data + 256, 128);
-			memset(atr->data + 640, 0, 128);
-
-			memcpy(atr->data + 256, atr->data + 128, 128);
-			memset(atr->data + 384, 0, 128);
-
-			memset(atr->data + 128, 0, 128);
-			atr->size += 384;
-		} else {
-			int x;
-			int flg = 0;
-			for (x = 384; x != 768; ++x)
-				if (atr->data[x])
-					flg = 1;
-			if (!flg) {
-				/* Bytes 384 - 768 are all zeros.  SIO2PC does this */
-				memcpy(atr->data + 512, atr->data + 256, 128);
-				memset(atr->data + 640, 0, 128);
-
-				memcpy(atr->data + 256, atr->data + 128, 128);
-				memset(atr->data + 384, 0, 128);
-
-				memset(atr->data + 128, 0, 128);
-			} else {
-				/* We already have physical sectors */
-			}
-		}
+	atr->left = atr->size;
+	job->bytes = atr->size + 16;
+
+	/* An odd number of 128 byte chunks: the first three sectors are 128
+	 * bytes.  They are expanded to physical sectors as they are read. */
+	if (sec_size == 256 && ((atr->size >> 7) & 1)) {
+		atr->logical = 1;
+		atr->size += 384;
 	}
 
-	printf("Converting %s (%ld %dB sectors) ", name, atr->size/sec_size, sec_size);
-
 	/* Decide on best disk format to use */
-	if (sec_size == 128 && atr->size <= 128 * 18 * 40 && !force_ed && !force_dd) {
-		printf("=> 90K disk\n");
+	if (sec_size == 128 && atr->size <= 128 * 18 * 40 && !job->force_ed && !job->force_dd) {
+		fprintf(job->out, "Converting %s (%ld %dB sectors) => 90K disk\n", name, atr->size/sec_size, sec_size);
 		atr->cyls = 40;
 		atr->sec_size = 128;
 		atr->sects = 18;
 		atr->dd = 0;
 		atr->map = sd_map;
-	} else if (sec_size == 128 && atr->size <= 128 * 26 * 40 && !force_dd) {
-		printf("=> 130K disk\n");
+	} else if (sec_size == 128 && atr->size <= 128 * 26 * 40 && !job->force_dd) {
+		fprintf(job->out, "Converting %s (%ld %dB sectors) => 130K disk\n", name, atr->size/sec_size, sec_size);
 		atr->cyls = 40;
 		atr->sec_size = 128;
 		atr->sects = 26;
 		atr->dd = 1;
 		atr->map = dd_map;
 	} else if (sec_size == 256 && atr->size <= 256 * 18 * 40) {
-		printf("=> 180K disk\n");
+		fprintf(job->out, "Converting %s (%ld %dB sectors) => 180K disk\n", name, atr->size/sec_size, sec_size);
 		atr->cyls = 40;
 		atr->sec_size = 256;
 		atr->sects = 18;
 		atr->dd = 2;
 		atr->map = hd_map;
 	} else {
-		printf("\n");
-		fprintf(stderr,"Unknown format\n");
-		free(atr->data);
-		free(atr);
+		fprintf(job->out, "Converting %s (%ld %dB sectors) \n", name, atr->size/sec_size, sec_size);
+		fprintf(job->err,"Unknown format\n");
+		free_atr(atr);
 		return 0;
 	}
 	return atr;
 }
 
-/* True if all bytes are the same */
+/* Read next track's data into buf (which has room for the whole track).
+ * Returns how much of the track the image has, or -1 for a read error. */
 
-int is_same(unsigned char *data, int len)
+long read_track(struct job *job, struct atr *atr, unsigned char *buf, int cyl)
 {
-	int c = data[0];
+	long track_len = (long)atr->sects * atr->sec_size;
+	long want, got;
 	int x;
-	for (x = 1; x != len; ++x)
-		if (data[x] != c)
-			return 0;
-	return 1;
+
+	memset(buf, 0, track_len);
+	want = track_len;
+	if (cyl == 0 && atr->logical)
+		want -= 384;
+	if (want > atr->left)
+		want = atr->left;
+	got = fread(buf, 1, want, atr->f);
+	atr->left -= got;
+	if (got != want) {
+		if (ferror(atr->f)) {
+			fprintf(job->err, "Error reading from %s\n", show_name(job->source_name));
+			return -1;
+		}
+		/* Only possible when reading from a pipe: the rest is missing */
+		fprintf(job->err, "Warning.. %s is shorter than its header says\n", show_name(job->source_name));
+		atr->left = 0;
+	}
+
+	/* Deal with boot sectors */
+	if (cyl == 0 && atr->sec_size == 256) {
+		if (atr->logical) {
+			/* First three sectors are 128 bytes.  Expand them to
+			   make physical sectors. */
+			memmove(buf + 768, buf + 384, track_len - 768);
+			memcpy(buf + 512, buf + 256, 128);
+			memset(buf + 640, 0, 128);
+
+			memcpy(buf + 256, buf + 128, 128);
+			memset(buf + 384, 0, 128);
+
+			memset(buf + 128, 0, 128);
+			if (got >= 384)
+				got += 384;
+			else if (got > 128)
+				got += (got > 256 ? 256 : 128);
+		} else {
+			for (x = 384; x != 768 && !buf[x]; ++x);
+			if (x == 768) {
+				/* Bytes 384 - 768 are all zeros.  SIO2PC does this */
+				memcpy(buf + 512, buf + 256, 128);
+				memset(buf + 640, 0, 128);
+
+				memcpy(buf + 256, buf + 128, 128);
+				memset(buf + 384, 0, 128);
+
+				memset(buf + 128, 0, 128);
+			} else {
+				/* We already have physical sectors */
+			}
+		}
+	}
+	return got;
 }
 
+/* Largest track: header, sector map, then a type byte and data for each
+ * sector */
+#define MAX_SECTS 26
+#define MAX_TRACK (5 + MAX_SECTS + MAX_SECTS * (1 + 256))
+
 /* Convert IMD file */
 
-int write_imd(struct atr *atr, char *dest_name, char *comment)
+/* Write .imd file, or to stdout if dest_name is "-" */
+
+int write_imd(struct job *job, struct atr *atr, char *dest_name, char *comment)
 {
 	FILE *f;
 	time_t t = time(NULL);
-	struct tm *tm = localtime(&t);
+	struct tm tm[1];
 	int cyl;
 	int sect;
 	int x;
 
-	f = fopen(dest_name, "rb");
-	if (f) {
-		char buf[80];
-		fclose(f);
-		printf("%s already exists.  Overwrite (y,n)?", dest_name);
-		fgets(buf,sizeof(buf)-1,stdin);
-		if (buf[0] != 'y' && buf[0] != 'Y') {
-			printf("Skipping...\n");
-			return 0;
-		}
+	if (!strcmp(dest_name, "-")) {
+		f = stdout;
+		dest_name = "standard output";
+	} else {
+		if ((x = check_dest(job, dest_name)))
+			return x;
+		f = fopen(dest_name, "wb");
 	}
 
-	f = fopen(dest_name, "wb");
-
 	if (!f) {
-		fprintf(stderr,"Couldn't open %s for writing\n", dest_name);
-		return 1;
+		fprintf(job->err,"Couldn't open %s for writing\n", dest_name);
+		return JOB_FAILED;
 	}
 
+#ifdef HAVE_THREADS
+	localtime_r(&t, tm);
+#else
+	*tm = *localtime(&t);
+#endif
+
 	/* Write timestamp */
 	fprintf(f, "ATR2IMD 1.0: %2.2d/%2.2d/%4.4d %2.2d:%2.2d:%2.2d\n",
 	       tm->tm_mday,tm->tm_mon + 1,tm->tm_year + 1900,tm->tm_hour,
@@ -251,72 +263,131 @@ int write_imd(struct atr *atr, char *dest_name, char *comment)
 	/* Write comment */
 	fprintf(f, "%s\n\x1a", comment);
 
-	/* Write tracks */
+	/* Write tracks: each is put together in memory, then written at once */
 	for (cyl = 0; cyl != atr->cyls; ++cyl) {
+		unsigned char data[MAX_SECTS * 256];
+		unsigned char track[MAX_TRACK];
+		long have = read_track(job, atr, data, cyl);
+		int len = 0;
+		if (have == -1) {
+			if (f != stdout)
+				fclose(f);
+			return JOB_FAILED;
+		}
 		if (atr->dd)
-			fputc(5, f); /* 250 Kbps MFM */
+			track[len++] = 5; /* 250 Kbps MFM */
 		else
-			fputc(2, f); /* 250 Kbps FM */
-		fputc(cyl, f); /* Cylinder */
-		fputc(0, f); /* Head */
-		fputc(atr->sects, f); /* Number of sectors */
+			track[len++] = 2; /* 250 Kbps FM */
+		track[len++] = cyl; /* Cylinder */
+		track[len++] = 0; /* Head */
+		track[len++] = atr->sects; /* Number of sectors */
 		if (atr->sec_size == 256)
-			fputc(1, f); /* Bytes per sector 0 = 128 */
+			track[len++] = 1; /* Bytes per sector 1 = 256 */
 		else
-			fputc(0, f); /* Bytes per sector 1 = 256 */
+			track[len++] = 0; /* Bytes per sector 0 = 128 */
 		/* Sector map */
 		for (x = 0; x != atr->sects; ++x) {
-			fputc(atr->map[x], f);
+			track[len++] = atr->map[x];
 		}
 		/* Cylinder map (empty) */
 		/* Head map (empty) */
 		/* Sectors */
 		for (x = 0; x != atr->sects; ++x) {
-			int ofst;
-			int dbl = 0;
+			long ofst;
 			sect = atr->map[x] - 1;
-			ofst = atr->sec_size * (cyl * atr->sects + sect);
-			if (ofst >= atr->size) {
-				fputc(2, f);
-				fputc(~0, f);
-			} else if (is_same(atr->data + ofst, atr->sec_size)) {
-				fputc(2, f);
-				fputc(~atr->data[ofst], f);
+			ofst = (long)atr->sec_size * sect;
+			if (ofst >= have) {
+				track[len++] = 2;
+				track[len++] = 0xFF;
+			} else if (ofst + atr->sec_size > have) {
+				/* Last sector is short: read_track() left it
+				 * padded with zeros */
+				track[len++] = 1;
+				invert(track + len, data + ofst, atr->sec_size);
+				len += atr->sec_size;
+			} else if (is_same(data + ofst, atr->sec_size)) {
+				track[len++] = 2;
+				track[len++] = ~data[ofst];
 			} else {
-				int y;
-				fputc(1, f);
-				if (dbl) {
-					for (y = 0; y != 128; ++y) {
-						fputc(~atr->data[ofst + y], f);
-					}
-					for (y = 0; y != 128; ++y) {
-						fputc(~0, f);
-					}
-				} else
-					for (y = 0; y != atr->sec_size; ++y) {
-						fputc(~atr->data[ofst + y], f);
-					}
+				track[len++] = 1;
+				invert(track + len, data + ofst, atr->sec_size);
+				len += atr->sec_size;
 			}
 		}
+		if (len != fwrite(track, 1, len, f)) {
+			fprintf(job->err,"Couldn't write %s\n", dest_name);
+			if (f != stdout)
+				fclose(f);
+			return JOB_FAILED;
+		}
 	}
 
-	fclose(f);
-	return 0;
+	if (f == stdout ? fflush(f) : fclose(f)) {
+		fprintf(job->err,"Couldn't write %s\n", dest_name);
+		return JOB_FAILED;
+	}
+	return JOB_OK;
+}
+
+/* Convert one file */
+
+void convert(struct job *job)
+{
+	char *p;
+	struct atr *atr;
+	char dest_name[1024];
+	char cmnt[1024];
+	char *comment = job->comment;
+
+	/* Create destination name based on source name: standard input is
+	 * converted to standard output */
+	snprintf(dest_name, sizeof(dest_name) - 4, "%s", job->source_name);
+	if (strcmp(dest_name, "-")) {
+		if ((p = strrchr(dest_name, '.')))
+			*p = 0;
+		strcat(dest_name, ".imd");
+	}
+
+	/* Create comment if none provided */
+	if (!comment) {
+		if (strcmp(job->source_name, "-"))
+			snprintf(cmnt, sizeof(cmnt), "Converted from file %s", job->source_name);
+		else
+			snprintf(cmnt, sizeof(cmnt), "Converted from standard input");
+		comment = cmnt;
+	}
+
+	/* Read .atr file */
+	if (!(atr = read_atr(job))) {
+		job->status = JOB_FAILED;
+		return;
+	}
+
+	/* Write .imd file */
+	job->status = write_imd(job, atr, dest_name, comment);
+
+	/* Free .atr image */
+	free_atr(atr);
 }
 
 int main(int argc, char *argv[])
 {
 	int x;
 	int err = 0;
-	int did = 0;
 	char *comment = 0;
 	int force_ed = 0;
 	int force_dd = 0;
+	int nworkers = 1;
+	struct job *jobs = 0;
+	int njobs = 0;
+	int jobs_size = 0;
+	int failed = 0;
+	int piped = 0; /* Set if "-" was given */
 
-	/* Parse args */
+	/* Parse args: each file is converted with the options given before it */
 
 	for (x = 1; argv[x]; ++x) {
-		if (argv[x][0] == '-') {
+		if (argv[x][0] == '-' && argv[x][1]) {
 			/* Some kind of option */
 			if (!strcmp(argv[x], "--comment") && argv[x + 1])
 				comment = argv[++x];
@@ -329,47 +400,43 @@ int main(int argc, char *argv[])
 			} else if (!strcmp(argv[x], "--dd")) {
 				force_ed = 0;
 				force_dd = 1;
+			} else if (!strcmp(argv[x], "--force")) {
+				exists_policy = EXISTS_FORCE;
+			} else if (!strcmp(argv[x], "--skip-existing")) {
+				exists_policy = EXISTS_SKIP;
+			} else if (!strcmp(argv[x], "-q")) {
+				quiet = 1;
+#ifdef HAVE_THREADS
+			} else if (!strcmp(argv[x], "-j") && argv[x + 1] && atoi(argv[x + 1]) > 0) {
+				nworkers = atoi(argv[++x]);
+#endif
 			} else {
 				err = 1;
 				break;
 			}
 		} else {
-			char *p;
-			struct atr *atr;
-			char dest_name[1024];
-			char cmnt[1024];
-			char *source_name = argv[x];
-
-			/* Create destination name based on source name */
-			strcpy(dest_name, source_name);
-			if ((p = strrchr(dest_name, '.')))
-				*p = 0;
-			strcat(dest_name, ".imd");
-
-			/* Create comment if none provided */
-			if (!comment) {
-				sprintf(cmnt, "Converted from file %s", source_name);
-				comment = cmnt;
+			if (!strcmp(argv[x], "-") && piped++) {
+				/* There's only one standard input */
+				err = 1;
+				break;
 			}
-
-			/* Read .atr file */
-			if (!(atr = read_atr(source_name, force_ed, force_dd)))
-				return 1;
-
-			/* Write .imd file */
-			if (write_imd(atr, dest_name, comment))
-				return 1;
-
-			/* Free .atr image */
-			free_atr(atr);
+			if (njobs == jobs_size) {
+				jobs_size = jobs_size ? jobs_size * 2 : 16;
+				jobs = (struct job *)realloc(jobs, jobs_size * sizeof(struct job));
+			}
+			memset(&jobs[njobs], 0, sizeof(struct job));
+			jobs[njobs].source_name = argv[x];
+			jobs[njobs].comment = comment;
+			jobs[njobs].force_ed = force_ed;
+			jobs[njobs].force_dd = force_dd;
+			++njobs;
 
 			/* Reset options */
 			comment = 0;
-			did = 1;
 		}
 	}
 
-	if (!did || err) {
+	if (!njobs || err) {
 		fprintf(stderr,"Convert Nick Kennedy's .ATR (ATARI) disk image file format to\n");
 		fprintf(stderr,"Dave Dunfield's .IMD (ImageDisk) file format.\n");
 		fprintf(stderr,"\n");
@@ -380,6 +447,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr,"\n");
 		fprintf(stderr,"  --comment <comment>   Comment to put in .IMD file (otherwise file name\n");
 		fprintf(stderr,"                        is used as the comment)\n");
+		fprintf(stderr,"  -q                    Only print errors\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"A filename of - converts standard input to standard output (messages then\n");
+		fprintf(stderr,"go to standard error).  It may be given once.\n");
 		fprintf(stderr,"\n");
 		fprintf(stderr,"atr2imd creates the smallest disk image needed to fit the .atr file.\n");
 		fprintf(stderr,"These options can be used to create a larger than necessary disk image:\n");
@@ -387,8 +458,22 @@ int main(int argc, char *argv[])
 		fprintf(stderr,"  --sd                  Force single density (90K disk, 128 byte FM sectors)\n");
 		fprintf(stderr,"  --ed                  Force medium density (130K disk, 128 byte MFM sectors)\n");
 		fprintf(stderr,"  --dd                  Force double density (180K disk, 256 byte MFM sectors)\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"Any number of files can be given.  If a .IMD file already exists:\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"  --force               Overwrite it\n");
+		fprintf(stderr,"  --skip-existing       Leave it alone\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"Otherwise you are asked, or if that isn't possible it's an error.\n");
+#ifdef HAVE_THREADS
+		fprintf(stderr,"\n");
+		fprintf(stderr,"  -j <n>                Convert n files at a time\n");
+#endif
+		free(jobs);
 		return 1;
 	}
 
-	return 0;
+	failed = run_jobs(jobs, njobs, nworkers, piped);
+	free(jobs);
+	return failed;
 }
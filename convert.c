@@ -0,0 +1,228 @@
+/* Batch conversion for atr2imd and imd2atr
+ *
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef __DJGPP__
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "convert.h"
+
+#ifdef HAVE_THREADS
+#include <pthread.h>
+#endif
+
+int exists_policy = EXISTS_ASK;
+int interactive;
+
+FILE *msgs;
+FILE *progress;
+int quiet;
+
+/* Name to show for a source file */
+
+char *show_name(char *name)
+{
+	return strcmp(name, "-") ? name : "standard input";
+}
+
+/* Decide what to do if destination already exists: returns JOB_OK to go
+ * ahead and write it */
+
+int check_dest(struct job *job, char *dest_name)
+{
+	char buf[80];
+	FILE *f = fopen(dest_name, "rb");
+	if (!f)
+		return JOB_OK;
+	fclose(f);
+	if (exists_policy == EXISTS_FORCE)
+		return JOB_OK;
+	if (exists_policy == EXISTS_SKIP) {
+		fprintf(job->out, "%s already exists, skipping\n", dest_name);
+		return JOB_SKIPPED;
+	}
+	if (!interactive) {
+		fprintf(job->err, "%s already exists (use --force or --skip-existing)\n", dest_name);
+		return JOB_FAILED;
+	}
+	printf("%s already exists.  Overwrite (y,n)?", dest_name);
+	fflush(stdout);
+	if (!fgets(buf,sizeof(buf)-1,stdin) || (buf[0] != 'y' && buf[0] != 'Y')) {
+		printf("Skipping...\n");
+		return JOB_SKIPPED;
+	}
+	return JOB_OK;
+}
+
+/* Parallel conversion: workers take the next job from the list.  Messages
+ * from each job are collected in memory and printed in the order the files
+ * were given: progress messages to msgs, errors to stderr as when converting
+ * one file at a time. */
+
+#ifdef HAVE_THREADS
+
+struct pool {
+	struct job *jobs;
+	int njobs;
+	int next; /* Next job to start */
+	int next_out; /* Next job to print messages of */
+	pthread_mutex_t lock;
+};
+
+void pool_output(struct pool *pool)
+{
+	while (pool->next_out != pool->njobs && pool->jobs[pool->next_out].done) {
+		struct job *job = &pool->jobs[pool->next_out++];
+		if (job->buf) {
+			fwrite(job->buf, 1, job->len, msgs);
+			fflush(msgs);
+			free(job->buf);
+			job->buf = 0;
+		}
+		fwrite(job->err_buf, 1, job->err_len, stderr);
+		fflush(stderr);
+		free(job->err_buf);
+		job->err_buf = 0;
+	}
+}
+
+void *pool_worker(void *arg)
+{
+	struct pool *pool = (struct pool *)arg;
+	for (;;) {
+		struct job *job;
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next == pool->njobs) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		job->err = open_memstream(&job->err_buf, &job->err_len);
+		job->out = (quiet ? progress : open_memstream(&job->buf, &job->len));
+		convert(job);
+		if (!quiet)
+			fclose(job->out);
+		fclose(job->err);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pool_output(pool);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return 0;
+}
+
+void run_pool(struct job *jobs, int njobs, int nworkers)
+{
+	struct pool pool[1];
+	pthread_t *threads;
+	int x;
+	memset(pool, 0, sizeof(pool));
+	pool->jobs = jobs;
+	pool->njobs = njobs;
+	pthread_mutex_init(&pool->lock, NULL);
+	threads = (pthread_t *)malloc(nworkers * sizeof(pthread_t));
+	for (x = 0; x != nworkers; ++x)
+		pthread_create(&threads[x], NULL, pool_worker, pool);
+	for (x = 0; x != nworkers; ++x)
+		pthread_join(threads[x], NULL);
+	free(threads);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+#endif
+
+/* Report how the batch went */
+
+void summary(struct job *jobs, int njobs, struct timeval *start)
+{
+	struct timeval end;
+	double secs, mb = 0.0;
+	int ok = 0, failed = 0, skipped = 0;
+	int x;
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.0;
+	for (x = 0; x != njobs; ++x) {
+		if (jobs[x].status == JOB_OK) {
+			++ok;
+			mb += jobs[x].bytes / 1048576.0;
+		} else if (jobs[x].status == JOB_SKIPPED)
+			++skipped;
+		else
+			++failed;
+	}
+	fprintf(msgs, "%d files: %d converted, %d skipped, %d failed\n", njobs, ok, skipped, failed);
+	fprintf(msgs, "  %.1f MB in %.2f seconds", mb, secs);
+	if (secs > 0.0)
+		fprintf(msgs, " (%.1f MB/s)", mb / secs);
+	fprintf(msgs, "\n");
+	for (x = 0; x != njobs; ++x)
+		if (jobs[x].status == JOB_FAILED)
+			fprintf(msgs, "  Failed: %s\n", show_name(jobs[x].source_name));
+}
+
+/* Convert all of the jobs, nworkers at a time.  piped is set if one of them
+ * is standard input.  Returns 1 if any failed. */
+
+int run_jobs(struct job *jobs, int njobs, int nworkers, int piped)
+{
+	struct timeval start;
+	int failed = 0;
+	int x;
+	if (nworkers > njobs)
+		nworkers = njobs;
+	interactive = (nworkers == 1 && !piped && isatty(0));
+	msgs = (piped ? stderr : stdout);
+	progress = (quiet ? fopen("/dev/null", "w") : 0);
+	if (!progress)
+		progress = msgs;
+#ifdef __DJGPP__
+	if (piped) {
+		setmode(fileno(stdin), O_BINARY);
+		setmode(fileno(stdout), O_BINARY);
+	}
+#endif
+	gettimeofday(&start, NULL);
+	if (nworkers == 1) {
+		for (x = 0; x != njobs; ++x) {
+			jobs[x].out = progress;
+			jobs[x].err = stderr;
+			convert(&jobs[x]);
+		}
+	}
+#ifdef HAVE_THREADS
+	else
+		run_pool(jobs, njobs, nworkers);
+#endif
+	if (njobs > 1 && !quiet)
+		summary(jobs, njobs, &start);
+	for (x = 0; x != njobs; ++x)
+		if (jobs[x].status == JOB_FAILED)
+			failed = 1;
+	return failed;
+}
@@ -0,0 +1,84 @@
+/* Batch conversion for atr2imd and imd2atr
+ *
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+/* DJGPP has no threads: -j is not available */
+#ifndef __DJGPP__
+#define HAVE_THREADS
+#endif
+
+/* What to do when the destination file already exists */
+
+#define EXISTS_ASK 0 /* Ask, if we can: otherwise it's an error */
+#define EXISTS_FORCE 1 /* Overwrite it */
+#define EXISTS_SKIP 2 /* Leave it alone */
+
+extern int exists_policy;
+extern int interactive; /* Set if we can ask */
+
+/* Where messages go: stderr instead of stdout when the converted file is
+ * written to stdout.  With -q progress messages (everything but errors) go
+ * nowhere. */
+
+extern FILE *msgs;
+extern FILE *progress;
+extern int quiet;
+
+/* Result of a conversion */
+
+#define JOB_OK 0
+#define JOB_FAILED 1
+#define JOB_SKIPPED 2
+
+/* A conversion to do */
+
+struct job {
+	char *source_name;
+
+	/* atr2imd options */
+	char *comment; /* Comment to put in .imd file, or 0 for default */
+	int force_ed;
+	int force_dd;
+
+	/* imd2atr options */
+	int dump; /* Show tracks */
+	int logical;
+	int sio;
+
+	FILE *out; /* Progress messages */
+	FILE *err; /* Error messages */
+	char *buf; /* Progress messages collected during parallel conversion */
+	size_t len;
+	char *err_buf; /* Error messages collected during parallel conversion */
+	size_t err_len;
+	int done;
+	int status;
+	long bytes; /* Size of source file */
+};
+
+/* Convert one file: each program supplies this */
+void convert(struct job *job);
+
+char *show_name(char *name);
+int check_dest(struct job *job, char *dest_name);
+int run_jobs(struct job *jobs, int njobs, int nworkers, int piped);
+
+#endif
@@ -0,0 +1,438 @@
+/* Read and write Dave Dunfield's .IMD (ImageDisk) disk image files
+ *
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* DJGPP has no mmap(): the file is read into memory instead */
+#ifndef __DJGPP__
+#define HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "imd.h"
+
+/* Interleave maps (physical order of sectors on a track), as written by
+ * atr2imd.  Logically consecutive sectors are spaced so that the drive is
+ * ready for the next one when it comes around. */
+
+/* 90K disks */
+int sd_map[] =
+	{ 1, 3, 5, 7, 9, 11, 13, 15, 17, 2, 4, 6, 8, 10, 12, 14, 16, 18 };
+
+/* 130K disks */
+int dd_map[] =
+	{ 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26 };
+
+/* 180K disks */
+int hd_map[] =
+	{ 1, 3, 5, 7, 9, 11, 13, 15, 17, 2, 4, 6, 8, 10, 12, 14, 16, 18 };
+
+/* Copy len bytes from src to dst, inverted (.imd data is the complement
+ * of .atr data) */
+
+void invert(unsigned char *dst, unsigned char *src, int len)
+{
+	int x = 0;
+#ifdef __SSE2__
+	__m128i ones = _mm_set1_epi8((char)0xFF);
+	for (; x + 16 <= len; x += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *)(src + x));
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_xor_si128(v, ones));
+	}
+#else
+	for (; x + 8 <= len; x += 8) {
+		uint64_t v;
+		memcpy(&v, src + x, 8);
+		v = ~v;
+		memcpy(dst + x, &v, 8);
+	}
+#endif
+	for (; x != len; ++x)
+		dst[x] = ~src[x];
+}
+
+/* True if all bytes are the same (a sector which can be stored as a fill
+ * byte) */
+
+int is_same(unsigned char *data, int len)
+{
+	int x = 0;
+#ifdef __SSE2__
+	__m128i c = _mm_set1_epi8((char)data[0]);
+	for (; x + 16 <= len; x += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *)(data + x));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, c)) != 0xFFFF)
+			return 0;
+	}
+#else
+	uint64_t c = 0x0101010101010101ULL * data[0];
+	for (; x + 8 <= len; x += 8) {
+		uint64_t v;
+		memcpy(&v, data + x, 8);
+		if (v != c)
+			return 0;
+	}
+#endif
+	for (; x != len; ++x)
+		if (data[x] != data[0])
+			return 0;
+	return 1;
+}
+
+/* Logical order of sectors: each track's sectors by sector number, one
+ * track after another.  If a sector number appears twice in a map, the first
+ * one wins; if one is missing, its logical sector has no record. */
+
+static void imd_order(struct imd *imd)
+{
+	int n, x;
+	imd->nsects = 0;
+	for (n = 0; n != imd->ntracks; ++n)
+		imd->nsects += imd->tracks[n].sects;
+	imd->order = (int *)malloc((imd->nsects + 1) * sizeof(int));
+	imd->nsects = 0;
+	for (n = 0; n != imd->ntracks; ++n) {
+		struct track *t = &imd->tracks[n];
+		int *slot = imd->order + imd->nsects; /* By sector number - 1 */
+		for (x = 0; x != t->sects; ++x)
+			slot[x] = -1;
+		for (x = t->sects - 1; x >= 0; --x)
+			if (t->map[x] >= 1 && t->map[x] <= t->sects)
+				slot[t->map[x] - 1] = t->rec + x;
+		imd->nsects += t->sects;
+	}
+}
+
+void free_imd(struct imd *imd)
+{
+	int n;
+#ifdef HAVE_MMAP
+	if (imd->mapped)
+		munmap(imd->image, imd->image_size);
+	else
+#endif
+		free(imd->image);
+	free(imd->tracks);
+	for (n = 0; n != imd->nrecs; ++n)
+		free(imd->recs[n].data);
+	free(imd->recs);
+	free(imd->order);
+	free(imd);
+}
+
+/* Load .imd file into memory: mmap it, or read it if that fails (as it
+ * does for a pipe).  name "-" is standard input. */
+
+static int load_imd(struct imd *imd, char *name, FILE *err)
+{
+#ifdef HAVE_MMAP
+	struct stat st;
+#endif
+	FILE *f = (strcmp(name, "-") ? fopen(name, "rb") : stdin);
+
+	if (!f) {
+		fprintf(err, "Couldn't open %s\n", name);
+		return -1;
+	}
+
+#ifdef HAVE_MMAP
+	if (!fstat(fileno(f), &st) && S_ISREG(st.st_mode) && st.st_size) {
+		imd->image_size = st.st_size;
+		imd->image = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (imd->image != MAP_FAILED) {
+			imd->mapped = 1;
+			if (f != stdin)
+				fclose(f);
+			return 0;
+		}
+	}
+#endif
+
+	/* Couldn't map it: read it */
+	imd->image_size = 0;
+	imd->image = 0;
+	for (;;) {
+		long alloc = imd->image_size ? imd->image_size * 2 : 65536;
+		imd->image = (unsigned char *)realloc(imd->image, alloc);
+		imd->image_size += fread(imd->image + imd->image_size, 1, alloc - imd->image_size, f);
+		if (imd->image_size != alloc)
+			break;
+	}
+	if (ferror(f)) {
+		fprintf(err, "Couldn't read %s\n", name);
+		if (f != stdin)
+			fclose(f);
+		return -1;
+	}
+	if (f != stdin)
+		fclose(f);
+	return 0;
+}
+
+struct imd *read_imd(char *name, FILE *err)
+{
+	struct imd *imd;
+	unsigned char *p, *end;
+	int tracks_size = 0;
+	int recs_size = 0;
+
+	imd = (struct imd *)calloc(1, sizeof(struct imd));
+	if (load_imd(imd, name, err)) {
+		free_imd(imd);
+		return 0;
+	}
+
+	/* Header */
+	p = imd->image;
+	end = imd->image + imd->image_size;
+	while (p != end && *p != 0x1A)
+		++p;
+
+	if (p == imd->image) {
+		fprintf(err, "No header?\n");
+		free_imd(imd);
+		return 0;
+	}
+
+	imd->comment = (char *)imd->image;
+	imd->comment_len = p - imd->image;
+	if (p != end)
+		++p;
+
+	/* Index tracks */
+	while (p != end) {
+		struct track *track;
+		int x;
+		if (*p > 5) {
+			fprintf(err,"Invalid mode byte?\n");
+			free_imd(imd);
+			return 0;
+		}
+		if (end - p < 5) {
+			fprintf(err,"Truncated track header\n");
+			free_imd(imd);
+			return 0;
+		}
+		if (imd->ntracks == tracks_size) {
+			tracks_size = tracks_size ? tracks_size * 2 : 64;
+			imd->tracks = (struct track *)realloc(imd->tracks, tracks_size * sizeof(struct track));
+		}
+		track = &imd->tracks[imd->ntracks];
+		track->hdr = p;
+		track->mode = p[0];
+		if (p[1] > 80) {
+			fprintf(err,"Invalid cylinder number\n");
+			free_imd(imd);
+			return 0;
+		}
+		track->cyl = p[1];
+		if ((p[2] & ~(HEAD_CMAP | HEAD_HMAP)) > 1) {
+			fprintf(err,"Invalid head number\n");
+			free_imd(imd);
+			return 0;
+		}
+		track->head = (p[2] & 1);
+		if (p[3] < 1) {
+			fprintf(err,"Invalid number of sectors\n");
+			free_imd(imd);
+			return 0;
+		}
+		track->sects = p[3];
+		if (p[4] > 6) {
+			fprintf(err,"Invalid sector size\n");
+			free_imd(imd);
+			return 0;
+		}
+		track->sec_size = (128 << p[4]);
+		x = p[2];
+		p += 5;
+
+		/* Maps */
+		if (end - p < track->sects * (1 + !!(x & HEAD_CMAP) + !!(x & HEAD_HMAP))) {
+			fprintf(err,"Couldn't read sector map\n");
+			free_imd(imd);
+			return 0;
+		}
+		track->map = p;
+		p += track->sects;
+		track->cmap = 0;
+		if (x & HEAD_CMAP) {
+			track->cmap = p;
+			p += track->sects;
+		}
+		track->hmap = 0;
+		if (x & HEAD_HMAP) {
+			track->hmap = p;
+			p += track->sects;
+		}
+
+		/* Sector records */
+		track->rec = imd->nrecs;
+		for (x = 0; x != track->sects; ++x) {
+			if (p == end || *p > SECT_DELETED_ERROR_FILL) {
+				fprintf(err,"Invalid sector type\n");
+				free_imd(imd);
+				return 0;
+			}
+			if (imd->nrecs == recs_size) {
+				recs_size = recs_size ? recs_size * 2 : 1024;
+				imd->recs = (struct imd_rec *)realloc(imd->recs, recs_size * sizeof(struct imd_rec));
+			}
+			imd->recs[imd->nrecs].p = p;
+			imd->recs[imd->nrecs].size = track->sec_size;
+			imd->recs[imd->nrecs].data = 0;
+			++imd->nrecs;
+			if (*p == SECT_NONE) {
+				++imd->missing;
+				++p;
+				continue;
+			}
+			if (*p == SECT_DELETED || *p == SECT_DELETED_FILL || *p >= SECT_DELETED_ERROR)
+				++imd->deleted;
+			if (*p >= SECT_ERROR)
+				++imd->errors;
+			if (*p & 1) {
+				if (end - p < 1 + track->sec_size) {
+					fprintf(err,"Couldn't read sectors\n");
+					free_imd(imd);
+					return 0;
+				}
+				p += 1 + track->sec_size;
+			} else {
+				if (end - p < 2) {
+					fprintf(err,"Couldn't read compressed sector\n");
+					free_imd(imd);
+					return 0;
+				}
+				p += 2;
+			}
+		}
+		++imd->ntracks;
+	}
+	imd_order(imd);
+	return imd;
+}
+
+/* Get logical sector n as Atari data: returns its size, or -1 if there is
+ * no such sector.  Sectors with no data, or not in the map, read as zeros. */
+
+int imd_get(struct imd *imd, int n, unsigned char *buf)
+{
+	struct imd_rec *r;
+	int size;
+	if (n < 0 || n >= imd->nsects)
+		return -1;
+	if (imd->order[n] == -1) {
+		/* Not in map: logical sectors of a track start at its first record */
+		int t;
+		for (t = 0; t + 1 != imd->ntracks && imd->tracks[t + 1].rec <= n; ++t);
+		memset(buf, 0, imd->tracks[t].sec_size);
+		return imd->tracks[t].sec_size;
+	}
+	r = &imd->recs[imd->order[n]];
+	size = r->size;
+	if (r->data)
+		memcpy(buf, r->data, size);
+	else if (*r->p == SECT_NONE)
+		memset(buf, 0, size);
+	else if (*r->p & 1)
+		invert(buf, r->p + 1, size);
+	else
+		memset(buf, ~r->p[1] & 0xFF, size);
+	return size;
+}
+
+/* Write logical sector n (Atari data).  It is kept in memory until
+ * imd_save(). */
+
+int imd_put(struct imd *imd, int n, unsigned char *buf)
+{
+	struct imd_rec *r;
+	if (n < 0 || n >= imd->nsects || imd->order[n] == -1)
+		return -1;
+	r = &imd->recs[imd->order[n]];
+	if (!r->data)
+		r->data = (unsigned char *)malloc(r->size);
+	memcpy(r->data, buf, r->size);
+	imd->written = 1;
+	return 0;
+}
+
+/* Write image with written sectors back to name: to a temporary file which
+ * then replaces it.  Everything else is copied as it is.  Written sectors are
+ * compressed if they can be, and lose any deleted data or error marks. */
+
+int imd_save(struct imd *imd, char *name, FILE *err)
+{
+	char tmp[1100];
+	struct stat st;
+	unsigned char *buf;
+	unsigned char *p = imd->image; /* Copied up to here */
+	FILE *f;
+	int ok = 1;
+	int n;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", name, (int)getpid());
+	f = fopen(tmp, "wb");
+	if (!f) {
+		fprintf(err, "Couldn't create '%s'\n", tmp);
+		return -1;
+	}
+
+	buf = (unsigned char *)malloc(1 + (128 << 6));
+	for (n = 0; ok && n != imd->nrecs; ++n) {
+		struct imd_rec *r = &imd->recs[n];
+		if (!r->data)
+			continue;
+		/* Everything up to this record as it was */
+		ok = (fwrite(p, 1, r->p - p, f) == r->p - p);
+		if (is_same(r->data, r->size)) {
+			buf[0] = SECT_FILL;
+			buf[1] = ~r->data[0];
+			ok = ok && (fwrite(buf, 1, 2, f) == 2);
+		} else {
+			buf[0] = SECT_DATA;
+			invert(buf + 1, r->data, r->size);
+			ok = ok && (fwrite(buf, 1, 1 + r->size, f) == 1 + r->size);
+		}
+		/* Skip old record */
+		p = r->p + (*r->p == SECT_NONE ? 1 : (*r->p & 1) ? 1 + r->size : 2);
+	}
+	ok = ok && (fwrite(p, 1, imd->image + imd->image_size - p, f) == imd->image + imd->image_size - p);
+	free(buf);
+
+	if (!stat(name, &st))
+		chmod(tmp, st.st_mode & 07777);
+	if (fclose(f) || !ok || rename(tmp, name)) {
+		fprintf(err, "Couldn't write '%s'\n", name);
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,116 @@
+/* Dave Dunfield's .IMD (ImageDisk) disk image file format
+ *
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef IMD_H
+#define IMD_H
+
+/* An .IMD file is an ASCII header ending with 0x1A, then for each track:
+ *
+ *   mode, cylinder, head, number of sectors, sector size code (128 << n)
+ *   sector numbering map (one byte per sector)
+ *   cylinder map, if bit 7 of head is set
+ *   head map, if bit 6 of head is set
+ *   a record for each sector: type byte, then data as given by the type
+ *
+ * Sector data is stored inverted: it is the complement of Atari data. */
+
+/* Sector record types */
+
+#define SECT_NONE 0 /* Data could not be read: no data follows */
+#define SECT_DATA 1 /* Normal: sec_size bytes of data follow */
+#define SECT_FILL 2 /* Compressed: one fill byte follows */
+#define SECT_DELETED 3 /* Deleted data, normal */
+#define SECT_DELETED_FILL 4 /* Deleted data, compressed */
+#define SECT_ERROR 5 /* Data error, normal */
+#define SECT_ERROR_FILL 6 /* Data error, compressed */
+#define SECT_DELETED_ERROR 7 /* Deleted data with error, normal */
+#define SECT_DELETED_ERROR_FILL 8 /* Deleted data with error, compressed */
+
+/* Flags in head byte */
+
+#define HEAD_CMAP 0x80 /* Cylinder map follows sector map */
+#define HEAD_HMAP 0x40 /* Head map follows cylinder map */
+
+/* A track: the maps point into the image, and the sector records are found
+ * through the imd's record index. */
+
+struct track {
+	unsigned char *hdr; /* Track header in image */
+	int mode; /*
+		0 = 500 kbps FM
+		1 = 300 kbps FM
+		2 = 250 kbps FM
+		3 = 500 kbps MFM
+		4 = 300 kbps MFM
+		5 = 250 kbps MFM */
+	int sec_size;
+	int head;
+	int cyl;
+	int sects;
+	unsigned char *map; /* Sector numbering map */
+	unsigned char *cmap; /* Cylinder map, or 0 */
+	unsigned char *hmap; /* Head map, or 0 */
+	int rec; /* Index of first sector record in imd->recs */
+};
+
+/* A sector record */
+
+struct imd_rec {
+	unsigned char *p; /* Type byte in image, then data */
+	int size; /* Sector size */
+	unsigned char *data; /* New contents (as Atari data) once written, else 0 */
+};
+
+/* A loaded .IMD file: the whole file is mapped (or read if it can't be) and
+ * tracks are indexed in place. */
+
+struct imd {
+	unsigned char *image;
+	long image_size;
+	int mapped; /* Set if image is mmapped, else malloced */
+	char *comment; /* Not terminated: see comment_len */
+	int comment_len;
+	struct track *tracks;
+	int ntracks;
+	struct imd_rec *recs; /* Sector records for all tracks, in file order */
+	int nrecs;
+	int *order; /* Logical sectors (each track's sectors by number, track
+	               after track) to index in recs, or -1 if not in the map */
+	int nsects; /* Number of logical sectors */
+	int written; /* Set if any sector was written */
+	int deleted; /* Number of sectors with deleted data marks */
+	int errors; /* Number of sectors read with data errors */
+	int missing; /* Number of sectors with no data */
+};
+
+/* Interleave maps for 90K, 130K and 180K disks */
+
+extern int sd_map[];
+extern int dd_map[];
+extern int hd_map[];
+
+struct imd *read_imd(char *name, FILE *err);
+void free_imd(struct imd *imd);
+void invert(unsigned char *dst, unsigned char *src, int len);
+int is_same(unsigned char *data, int len);
+int imd_get(struct imd *imd, int n, unsigned char *buf);
+int imd_put(struct imd *imd, int n, unsigned char *buf);
+int imd_save(struct imd *imd, char *name, FILE *err);
+
+#endif
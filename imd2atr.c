@@ -21,183 +21,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <time.h>
-
-/* A track */
-
-struct track {
-	struct track *next;
-	int mode; /*
-		0 = 500 kbps FM
-		1 = 300 kbps FM
-		2 = 250 kbps FM
-		3 = 500 kbps MFM
-		4 = 300 kbps MFM
-		5 = 250 kbps MFM */
-	int sec_size;
-	int head;
-	int cyl;
-	int sects;
-	unsigned char *map;
-	unsigned char *data;
-};
-
-/* A loaded .IMD file */
-
-struct imd {
-	char *comment;
-	struct track *tracks;
-	int ntracks;
-};
-
-void free_imd(struct imd *imd)
-{
-	struct track *t;
-	while ((t = imd->tracks)) {
-		imd->tracks = t->next;
-		if (t->map)
-			free(t->map);
-		if (t->data)
-			free(t->data);
-		free(t);
-	}
-	if (imd->comment)
-		free(imd->comment);
-	free(imd);
-}
-
-struct imd *read_imd(char *name)
-{
-	struct imd *imd;
-	struct track *track;
-	struct track *last;
-	char buf[1024];
-	int x;
-	int c;
-	FILE *f = fopen(name, "rb");
-	last = 0;
-
-	if (!f) {
-		fprintf(stderr, "Couldn't open %s\n", name);
-		return 0;
-	}
-
-	printf("Converting %s\n", name);
-
-	/* Read header */
-	x = 0;
-	while ((c = fgetc(f)), (c != -1 && c != 0x1A)) {
-		if (x < sizeof(buf) - 1)
-			buf[x++] = c;
-	}
-	buf[x] = 0;
-
-	if (!x) {
-		fprintf(stderr, "No header?\n");
-		fclose(f);
-		return 0;
-	}
-
-	imd = (struct imd *)malloc(sizeof(struct imd));
-	imd->comment = strdup(buf);
-	imd->tracks = 0;
-	imd->ntracks = 0;
-
-	/* Read tracks */
-	while ((c = fgetc(f)), (c != -1)) {
-		int x;
-		if (c < 0 || c > 5) {
-			fprintf(stderr,"Invalid mode byte?\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-//		printf("track\n");
-		track = (struct track *)malloc(sizeof(struct track));
-		track->data = 0;
-		track->map = 0;
-		track->next = 0;
-		track->mode = c;
-		c = fgetc(f);
-		if (c < 0 || c > 80) {
-			fprintf(stderr,"Invalid cylinder number\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->cyl = c;
-		c = fgetc(f);
-		if (c < 0 || c > 1) {
-			fprintf(stderr,"Invalid head number\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->head = c;
-		c = fgetc(f);
-		if (c < 1) {
-			fprintf(stderr,"Invalid number of sectors\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->sects = c;
-		c = fgetc(f);
-		if (c < 0 || c > 6) {
-			fprintf(stderr,"Invalid sector size\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->sec_size = (128 << c);
-		track->map = (unsigned char *)malloc(track->sects);
-		if (1 != fread(track->map, track->sects, 1, f)) {
-			fprintf(stderr,"Couldn't read sector map\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->data = (unsigned char *)malloc(track->sects * track->sec_size);
-		for (x = 0; x != track->sects; ++x) {
-			c = fgetc(f);
-			if (c < 0 || c > 8) {
-				fprintf(stderr,"Invalid sector type\n");
-				fclose(f);
-				free_imd(imd);
-				return 0;
-			}
-			if (c & 1) {
-				if (1 != fread(track->data + x * track->sec_size, track->sec_size, 1, f)) {
-					fprintf(stderr,"Couldn't read sectors\n");
-					fclose(f);
-					free_imd(imd);
-					return 0;
-				}
-			} else if (c == 0) {
-				memset(track->data + x * track->sec_size, 0, track->sec_size);
-			} else {
-				c = fgetc(f);
-				if (c < 0) {
-					fprintf(stderr,"Couldn't compressed sector\n");
-					fclose(f);
-					free_imd(imd);
-					return 0;
-				}
-				memset(track->data + x * track->sec_size, c, track->sec_size);
-			}
-		}
-		if (last) {
-			last->next = track;
-			last = track;
-		} else {
-			last = imd->tracks = track;
-		}
-		++imd->ntracks;
-	}
-	fclose(f);
-	return imd;
-}
+#include "imd.h"
+#include "convert.h"
 
 char *modes[] =
 {
@@ -209,80 +39,107 @@ char *modes[] =
 	"5 (250 kbps MFM)"
 };
 
-void dump_imd(struct imd *imd)
+void dump_imd(struct imd *imd, FILE *out)
 {
-	struct track *t;
-	printf("Comment = %s\n", imd->comment);
-	printf("%d tracks\n", imd->ntracks);
-	for (t = imd->tracks; t; t = t->next) {
+	int n;
+	fprintf(out, "Comment = %.*s\n", imd->comment_len, imd->comment);
+	fprintf(out, "%d tracks\n", imd->ntracks);
+	for (n = 0; n != imd->ntracks; ++n) {
+		struct track *t = &imd->tracks[n];
 		int x;
-		printf("Cyl=%d Head=%d Sects=%d Sec_size=%d Mode=%s\n  Map:",
+		fprintf(out, "Cyl=%d Head=%d Sects=%d Sec_size=%d Mode=%s\n  Map:",
 			t->cyl, t->head, t->sects, t->sec_size, modes[t->mode]);
 		for(x = 0; x != t->sects; ++x)
-			printf(" %d", t->map[x]);
-		printf("\n");
+			fprintf(out, " %d", t->map[x]);
+		fprintf(out, "\n");
+		if (t->cmap) {
+			fprintf(out, "  Cylinder map:");
+			for(x = 0; x != t->sects; ++x)
+				fprintf(out, " %d", t->cmap[x]);
+			fprintf(out, "\n");
+		}
+		if (t->hmap) {
+			fprintf(out, "  Head map:");
+			for(x = 0; x != t->sects; ++x)
+				fprintf(out, " %d", t->hmap[x]);
+			fprintf(out, "\n");
+		}
+		for (x = 0; x != t->sects; ++x)
+			if (*imd->recs[t->rec + x].p > SECT_FILL)
+				break;
+		if (x != t->sects) {
+			fprintf(out, "  Types:");
+			for(x = 0; x != t->sects; ++x)
+				fprintf(out, " %d", *imd->recs[t->rec + x].p);
+			fprintf(out, "\n");
+		}
 	}
 }
 
 long imd_size(struct imd *imd)
 {
 	long size = 0;
-	struct track *t;
-	for (t = imd->tracks; t; t = t->next) {
-		size += t->sec_size * t->sects;
+	int n;
+	for (n = 0; n != imd->ntracks; ++n) {
+		size += imd->tracks[n].sec_size * imd->tracks[n].sects;
 	}
 	return size;
 }
 
-int write_atr(struct imd *imd, char *dest_name, int logical, int sio)
+/* Write .atr file, or to stdout if dest_name is "-" */
+
+int write_atr(struct job *job, struct imd *imd, char *dest_name)
 {
+	int logical = job->logical;
+	int sio = job->sio;
 	FILE *f;
-	struct track *t;
 	unsigned char header[16];
-	unsigned char buf[8192];
+	unsigned char *buf;
 	long size;
+	long max_track;
 	int sec_size;
 	int count;
+	int n;
 	count = 0;
 
+	if (!imd->ntracks) {
+		fprintf(job->err,"No tracks\n");
+		return JOB_FAILED;
+	}
+
 	sec_size = imd->tracks->sec_size;
 	size = imd_size(imd);
 
-	printf("Sector size is %d\n", sec_size);
+	fprintf(job->out, "Sector size is %d\n", sec_size);
 
 	if (sec_size == 256) {
 		if (logical)
-			printf("  Using logical\n");
+			fprintf(job->out, "  Using logical\n");
 		else if (sio)
-			printf("  Using sio\n");
+			fprintf(job->out, "  Using sio\n");
 		else
-			printf("  Using physical\n");
+			fprintf(job->out, "  Using physical\n");
 	}
 
 	if (size & (sec_size - 1)) {
-		fprintf(stderr,"Invalid .imd file size = %ld bytes\n", size);
-		fprintf(stderr,"It must be multiple of %d\n", sec_size);
-		return 1;
+		fprintf(job->err,"Invalid .imd file size = %ld bytes\n", size);
+		fprintf(job->err,"It must be multiple of %d\n", sec_size);
+		return JOB_FAILED;
 	} else {
-		printf("Disk size is %ldK\n", size / 1024);
+		fprintf(job->out, "Disk size is %ldK\n", size / 1024);
 	}
 
-	f = fopen(dest_name, "rb");
-	if (f) {
-		char buf[80];
-		fclose(f);
-		printf("%s already exists.  Overwrite (y,n)?", dest_name);
-		fgets(buf,sizeof(buf)-1,stdin);
-		if (buf[0] != 'y' && buf[0] != 'Y') {
-			printf("Skipping...\n");
-			return 0;
-		}
+	if (!strcmp(dest_name, "-")) {
+		f = stdout;
+		dest_name = "standard output";
+	} else {
+		if ((n = check_dest(job, dest_name)))
+			return n;
+		f = fopen(dest_name, "wb");
 	}
-
-	f = fopen(dest_name, "wb");
 	if (!f) {
-		fprintf(stderr,"Couldn't open %s\n", dest_name);
-		return 1;
+		fprintf(job->err,"Couldn't open %s\n", dest_name);
+		return JOB_FAILED;
 	}
 
 	if (logical && sec_size == 256 && size >= 768)
@@ -299,30 +156,91 @@ int write_atr(struct imd *imd, char *dest_name, int logical, int sio)
 
 	fwrite(header, 16, 1, f);
 
-	for (t = imd->tracks; t; t = t->next) {
+	/* Each track is put together in logical sector order, then written at
+	 * once.  Leave room for the padding after the boot sectors. */
+	max_track = 0;
+	for (n = 0; n != imd->ntracks; ++n)
+		if ((long)imd->tracks[n].sects * imd->tracks[n].sec_size > max_track)
+			max_track = (long)imd->tracks[n].sects * imd->tracks[n].sec_size;
+	buf = (unsigned char *)malloc(max_track + 384);
+
+	for (n = 0; n != imd->ntracks; ++n) {
+		struct track *t = &imd->tracks[n];
+		long len = 0;
 		int x;
-		for (x = 1; x != t->sects + 1; ++x) {
-			int y;
-			for (y = 0; y != t->sects; ++y)
-				if (t->map[y] == x)
-					break;
-			memcpy(buf, t->data + t->sec_size * y, t->sec_size);
-			for (y = 0; y != t->sec_size; ++y)
-				buf[y] ^= 0xFF;
+
+		for (x = 0; x != t->sects; ++x) {
+			imd_get(imd, count, buf + len);
+			/* Only the first half of the boot sectors is written, so
+			 * the next sector goes on top of the second half */
 			if ((logical || sio) && sec_size == 256 && count < 3)
-				fwrite(buf, 128, 1, f);
+				len += 128;
 			else
-				fwrite(buf, t->sec_size, 1, f);
+				len += t->sec_size;
 			++count;
-			if (sio && count == 3) {
-				memset(buf, 0, 384);
-				fwrite(buf, 384, 1, f);
+			if (sio && sec_size == 256 && count == 3) {
+				memset(buf + len, 0, 384);
+				len += 384;
 			}
 		}
+
+		if (fwrite(buf, 1, len, f) != len) {
+			fprintf(job->err,"Couldn't write %s\n", dest_name);
+			free(buf);
+			if (f != stdout)
+				fclose(f);
+			return JOB_FAILED;
+		}
+	}
+
+	free(buf);
+	if (f == stdout ? fflush(f) : fclose(f)) {
+		fprintf(job->err,"Couldn't write %s\n", dest_name);
+		return JOB_FAILED;
+	}
+	return JOB_OK;
+}
+
+/* Convert one file */
+
+void convert(struct job *job)
+{
+	char dest_name[1024];
+	struct imd *imd;
+	char *p;
+
+	/* Create destination name based on source name: standard input is
+	 * converted to standard output */
+	snprintf(dest_name, sizeof(dest_name) - 4, "%s", job->source_name);
+	if (strcmp(dest_name, "-")) {
+		if ((p = strrchr(dest_name, '.')))
+			*p = 0;
+		strcat(dest_name, ".atr");
 	}
 
-	fclose(f);
-	return 0;
+	fprintf(job->out, "Converting %s\n", show_name(job->source_name));
+
+	/* Read imd file */
+	if (!(imd = read_imd(job->source_name, job->err))) {
+		job->status = JOB_FAILED;
+		return;
+	}
+	job->bytes = imd->image_size;
+
+	if (imd->missing)
+		fprintf(job->out, "  %d sectors have no data (written as zeros)\n", imd->missing);
+	if (imd->deleted)
+		fprintf(job->out, "  %d sectors have deleted data marks (written as normal sectors)\n", imd->deleted);
+	if (imd->errors)
+		fprintf(job->out, "  %d sectors were read with data errors\n", imd->errors);
+
+	if (job->dump)
+		dump_imd(imd, job->out);
+
+	/* Write atr file */
+	job->status = write_atr(job, imd, dest_name);
+
+	free_imd(imd);
 }
 
 int main(int argc, char *argv[])
@@ -333,12 +251,17 @@ int main(int argc, char *argv[])
 
 	int x;
 	int err = 0;
-	int did = 0;
+	int nworkers = 1;
+	struct job *jobs = 0;
+	int njobs = 0;
+	int jobs_size = 0;
+	int failed = 0;
+	int piped = 0; /* Set if "-" was given */
 
-	/* Parse args */
+	/* Parse args: each file is converted with the options given before it */
 
 	for (x = 1; argv[x]; ++x) {
-		if (argv[x][0] == '-') {
+		if (argv[x][0] == '-' && argv[x][1]) {
 			if (!strcmp(argv[x], "--dump"))
 				dump = 1;
 			else if (!strcmp(argv[x], "--logical")) {
@@ -350,36 +273,38 @@ int main(int argc, char *argv[])
 			} else if (!strcmp(argv[x], "--physical")) {
 				sio = 0;
 				logical = 0;
+			} else if (!strcmp(argv[x], "--force")) {
+				exists_policy = EXISTS_FORCE;
+			} else if (!strcmp(argv[x], "--skip-existing")) {
+				exists_policy = EXISTS_SKIP;
+			} else if (!strcmp(argv[x], "-q")) {
+				quiet = 1;
+#ifdef HAVE_THREADS
+			} else if (!strcmp(argv[x], "-j") && argv[x + 1] && atoi(argv[x + 1]) > 0) {
+				nworkers = atoi(argv[++x]);
+#endif
 			} else
 				err = 1;
 		} else {
-			char *source_name = argv[x];
-			char dest_name[1024];
-			struct imd *imd;
-			char *p;
-
-			/* Create destination name based on source name */
-			strcpy(dest_name, source_name);
-			if ((p = strrchr(dest_name, '.')))
-				*p = 0;
-			strcat(dest_name, ".atr");
-
-			/* Read imd file */
-			if (!(imd = read_imd(source_name)))
-				return 1;
-
-			if (dump)
-				dump_imd(imd);
-
-			/* Write atr file */
-			if (write_atr(imd, dest_name, logical, sio))
-				return 1;
-
-			did = 1;
+			if (!strcmp(argv[x], "-") && piped++) {
+				/* There's only one standard input */
+				err = 1;
+				break;
+			}
+			if (njobs == jobs_size) {
+				jobs_size = jobs_size ? jobs_size * 2 : 16;
+				jobs = (struct job *)realloc(jobs, jobs_size * sizeof(struct job));
+			}
+			memset(&jobs[njobs], 0, sizeof(struct job));
+			jobs[njobs].source_name = argv[x];
+			jobs[njobs].dump = dump;
+			jobs[njobs].logical = logical;
+			jobs[njobs].sio = sio;
+			++njobs;
 		}
 	}
 
-	if (!did || err) {
+	if (!njobs || err) {
 		fprintf(stderr,"Convert Dave Dunfield's .IMD (ImageDisk) file format to\n");
 		fprintf(stderr,"Nick Kennedy's .ATR (ATARI) disk image file format.\n");
 		fprintf(stderr,"\n");
@@ -389,6 +314,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr,"imd2atr [options] filename\n");
 		fprintf(stderr,"\n");
 		fprintf(stderr,"  --dump    Show tracks\n");
+		fprintf(stderr,"  -q        Only print errors\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"A filename of - converts standard input to standard output (messages then\n");
+		fprintf(stderr,"go to standard error).  It may be given once.\n");
 		fprintf(stderr,"\n");
 		fprintf(stderr,"The following options control how we deal with first three sectors of a 256-byte\n");
 		fprintf(stderr,"sector disk.  Such disks store 256 bytes on the disk for these sectors, but the\n");
@@ -403,8 +332,22 @@ int main(int argc, char *argv[])
 		fprintf(stderr,"\n");
 		fprintf(stderr,"Default format is '--logical', but emulators can deal with\n");
 		fprintf(stderr,"all three of them and '--physical' preserves all data actually read.\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"Any number of files can be given.  If a .ATR file already exists:\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"  --force         Overwrite it\n");
+		fprintf(stderr,"  --skip-existing Leave it alone\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"Otherwise you are asked, or if that isn't possible it's an error.\n");
+#ifdef HAVE_THREADS
+		fprintf(stderr,"\n");
+		fprintf(stderr,"  -j <n>          Convert n files at a time\n");
+#endif
+		free(jobs);
 		return 1;
 	}
 
-	return 0;
+	failed = run_jobs(jobs, njobs, nworkers, piped);
+	free(jobs);
+	return failed;
 }